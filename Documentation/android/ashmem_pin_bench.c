@@ -0,0 +1,261 @@
+/*
+ * ashmem_pin_bench - cost of ashmem pin, unpin and pin status ioctls on a
+ * region with many unpinned ranges
+ *
+ * Copyright 2008 Google Inc.
+ *
+ * This file is dual licensed.  It may be redistributed and/or modified
+ * under the terms of the Apache 2.0 License OR version 2 of the GNU
+ * General Public License.
+ *
+ * The region gets one unpinned page at every other page, so none of the
+ * ranges can merge, then single pages at random offsets are pinned and
+ * unpinned again and their status queried. The time per ioctl should stay
+ * flat as the number of ranges grows.
+ *
+ * With -r, pin + unpin is timed again while that many other processes keep
+ * the shrinker busy: each fills a region of its own, unpins it and purges
+ * all caches with ASHMEM_PURGE_ALL_CACHES, over and over. The average, 99th
+ * percentile and worst pin + unpin are reported for both runs; a purge
+ * should only hold up the area it is purging, so the percentiles under
+ * reclaim should stay close to those without. Purging needs CAP_SYS_ADMIN.
+ *
+ * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/types.h>
+#include <linux/ashmem.h>
+
+#define MAX_RECLAIMERS 16
+
+static int ranges = 10000;
+static int iterations = 10000;
+static int reclaimers;
+static int reclaim_pages = 256;
+
+struct shared {
+	volatile int stop;
+	unsigned long purges[MAX_RECLAIMERS];
+};
+
+static void pabort(const char *s)
+{
+	perror(s);
+	abort();
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void pin_ioctl(int fd, int cmd, long page, long pagesize)
+{
+	struct ashmem_pin pin = {
+		.offset = page * pagesize,
+		.len = pagesize,
+	};
+
+	if (ioctl(fd, cmd, &pin) < 0)
+		pabort("ashmem pin ioctl");
+}
+
+static void report(const char *what, uint64_t ns, int ops)
+{
+	printf("%-20s %8d ops %10llu ns/op\n", what, ops,
+	       (unsigned long long)ns / ops);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* pin and unpin each of 'pages', and report the spread of the pair */
+static void pin_unpin(int fd, const char *what, const long *pages,
+		      uint64_t *lat, long pagesize)
+{
+	uint64_t start, total = 0;
+	long i;
+
+	for (i = 0; i < iterations; i++) {
+		start = now_ns();
+		pin_ioctl(fd, ASHMEM_PIN, pages[i], pagesize);
+		pin_ioctl(fd, ASHMEM_UNPIN, pages[i], pagesize);
+		lat[i] = now_ns() - start;
+		total += lat[i];
+	}
+	report(what, total, iterations);
+	qsort(lat, iterations, sizeof(*lat), cmp_u64);
+	printf("%-20s %8s     99%% %10llu ns, max %llu ns\n", "", "",
+	       (unsigned long long)lat[iterations * 99 / 100],
+	       (unsigned long long)lat[iterations - 1]);
+}
+
+/* fills, unpins and purges a region of its own until told to stop */
+static void reclaimer(struct shared *shared, int n, long pagesize)
+{
+	struct ashmem_pin all = { 0, 0 };
+	size_t size = (size_t)reclaim_pages * pagesize;
+	unsigned long purges = 0;
+	char *map;
+	int fd;
+
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0)
+		pabort("can't open /dev/ashmem");
+	if (ioctl(fd, ASHMEM_SET_SIZE, size) < 0)
+		pabort("can't set the region size");
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		pabort("can't map the region");
+
+	while (!shared->stop) {
+		memset(map, n, size);
+		if (ioctl(fd, ASHMEM_UNPIN, &all) < 0)
+			pabort("reclaimer unpin");
+		if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0)
+			pabort("can't purge");
+		if (ioctl(fd, ASHMEM_PIN, &all) < 0)
+			pabort("reclaimer pin");
+		purges++;
+	}
+	shared->purges[n] = purges;
+	exit(0);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-nirp]\n", prog);
+	puts("  -n --ranges      unpinned ranges in the region (default 10000)\n"
+	     "  -i --iterations  ioctls timed per operation (default 10000)\n"
+	     "  -r --reclaimers  processes purging while pin + unpin is timed\n"
+	     "                   again (default 0, none)\n"
+	     "  -p --pages       pages each reclaimer fills and purges\n"
+	     "                   (default 256)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "ranges",     1, 0, 'n' },
+		{ "iterations", 1, 0, 'i' },
+		{ "reclaimers", 1, 0, 'r' },
+		{ "pages",      1, 0, 'p' },
+		{ NULL, 0, 0, 0 },
+	};
+	long pagesize = sysconf(_SC_PAGESIZE);
+	long *pages, i;
+	uint64_t start, *lat;
+	struct shared *shared;
+	pid_t pids[MAX_RECLAIMERS];
+	unsigned long purges = 0;
+	size_t size;
+	int fd, c;
+
+	while ((c = getopt_long(argc, argv, "n:i:r:p:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			ranges = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'r':
+			reclaimers = atoi(optarg);
+			break;
+		case 'p':
+			reclaim_pages = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (ranges <= 0 || iterations <= 0 || reclaimers < 0 ||
+	    reclaimers > MAX_RECLAIMERS || reclaim_pages <= 0)
+		print_usage(argv[0]);
+
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0)
+		pabort("can't open /dev/ashmem");
+	size = (size_t)ranges * 2 * pagesize;
+	if (ioctl(fd, ASHMEM_SET_SIZE, size) < 0)
+		pabort("can't set the region size");
+	if (mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ==
+	    MAP_FAILED)
+		pabort("can't map the region");
+
+	/* the unpinned pages to operate on, in random order */
+	pages = malloc(iterations * sizeof(*pages));
+	lat = malloc(iterations * sizeof(*lat));
+	if (!pages || !lat)
+		pabort("malloc");
+	srand(1);
+	for (i = 0; i < iterations; i++)
+		pages[i] = (rand() % ranges) * 2 + 1;
+
+	start = now_ns();
+	for (i = 0; i < ranges; i++)
+		pin_ioctl(fd, ASHMEM_UNPIN, i * 2 + 1, pagesize);
+	report("unpin (building)", now_ns() - start, ranges);
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++)
+		pin_ioctl(fd, ASHMEM_GET_PIN_STATUS, pages[i], pagesize);
+	report("get pin status", now_ns() - start, iterations);
+
+	pin_unpin(fd, "pin + unpin", pages, lat, pagesize);
+
+	if (reclaimers) {
+		shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (shared == MAP_FAILED)
+			pabort("mmap");
+		for (i = 0; i < reclaimers; i++) {
+			pids[i] = fork();
+			if (pids[i] < 0)
+				pabort("fork");
+			if (!pids[i])
+				reclaimer(shared, i, pagesize);
+		}
+		/* let them get going */
+		usleep(100000);
+		pin_unpin(fd, "pin + unpin (reclaim)", pages, lat, pagesize);
+		shared->stop = 1;
+		for (i = 0; i < reclaimers; i++) {
+			waitpid(pids[i], NULL, 0);
+			purges += shared->purges[i];
+		}
+		printf("%d reclaimers, %lu purges of %d pages\n", reclaimers,
+		       purges, reclaim_pages);
+	}
+
+	/* a pinned page between two unpinned ones, nothing to do */
+	start = now_ns();
+	for (i = 0; i < iterations; i++)
+		pin_ioctl(fd, ASHMEM_PIN, pages[i] - 1, pagesize);
+	report("pin (pinned)", now_ns() - start, iterations);
+
+	printf("%d unpinned ranges, %ld byte pages\n", ranges, pagesize);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * binder_alloc_bench - cost of allocating and freeing binder transaction
+ * buffers, by payload size
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Forks a receiver that becomes the context manager, then calls it with
+ * payloads of each size in turn. For every call two things are timed:
+ *
+ * 	- the sender's write-only BC_TRANSACTION, which allocates the buffer
+ * 	  in the receiver, copies the payload in and queues the work
+ * 	- the receiver's write-only BC_FREE_BUFFER of that buffer
+ *
+ * Everything else in the round trip is left out. Buffers of up to 256 bytes
+ * come from the per-proc slabs and larger ones from the free buffer tree,
+ * so the cost should step up past 256 bytes rather than grow with every
+ * size. Only the copy should grow with the size.
+ *
+ * The context manager can only be set once, run this with servicemanager
+ * stopped.
+ *
+ * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/binder.h>
+
+#include "binder_bench.h"
+
+#define MAP_SIZE (128 * 1024)
+#define MAX_DATA 8192
+#define WARMUP 100
+#define CODE_WARMUP 0xffffffff
+
+static const int default_sizes[] = {
+	16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192
+};
+
+static int calls = 10000;
+static int only_size;
+
+struct shared {
+	volatile int manager;
+	uint64_t free_ns[0];
+};
+
+/* frees every call, timing it, and replies with no data */
+static void receiver(struct shared *shared)
+{
+	int fd = binder_open(MAP_SIZE);
+	uint32_t enter = BC_ENTER_LOOPER;
+	struct binder_transaction_data txn;
+	struct txn_cmd reply;
+	uint64_t start;
+
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		pabort("can't become the context manager");
+	shared->manager = 1;
+	binder_write(fd, &enter, sizeof(enter));
+
+	memset(&reply, 0, sizeof(reply));
+	reply.cmd = BC_REPLY;
+	for (;;) {
+		if (binder_wait(fd, &txn) != BR_TRANSACTION)
+			continue;
+		start = now_ns();
+		free_buffer(fd, txn.data.ptr.buffer);
+		if (txn.code != CODE_WARMUP && txn.code < (unsigned)calls)
+			shared->free_ns[txn.code] = now_ns() - start;
+		binder_write(fd, &reply, sizeof(reply));
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t avg(const uint64_t *ns, int n)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		total += ns[i];
+	return total / n;
+}
+
+static void run(int fd, struct shared *shared, uint64_t *send_ns, int size)
+{
+	static char data[MAX_DATA];
+	struct binder_transaction_data txn;
+	struct txn_cmd call;
+	uint64_t start;
+	int i;
+
+	memset(&call, 0, sizeof(call));
+	call.cmd = BC_TRANSACTION;
+	call.txn.target.handle = 0;
+	call.txn.data_size = size;
+	call.txn.data.ptr.buffer = data;
+
+	for (i = -WARMUP; i < calls; i++) {
+		call.txn.code = i < 0 ? CODE_WARMUP : i;
+		start = now_ns();
+		binder_write(fd, &call, sizeof(call));
+		if (i >= 0)
+			send_ns[i] = now_ns() - start;
+		if (binder_wait(fd, &txn) != BR_REPLY)
+			pabort("no reply");
+		free_buffer(fd, txn.data.ptr.buffer);
+	}
+
+	qsort(send_ns, calls, sizeof(*send_ns), cmp_u64);
+	qsort(shared->free_ns, calls, sizeof(*shared->free_ns), cmp_u64);
+	printf("%6d %10llu %10llu %10llu %10llu\n", size,
+	       (unsigned long long)avg(send_ns, calls),
+	       (unsigned long long)send_ns[calls * 99 / 100],
+	       (unsigned long long)avg(shared->free_ns, calls),
+	       (unsigned long long)shared->free_ns[calls * 99 / 100]);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-ns]\n", prog);
+	puts("  -n --calls  calls per payload size (default 10000)\n"
+	     "  -s --size   only this payload size, up to 8192 (default\n"
+	     "              16 to 8192 bytes in powers of two)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "calls", 1, 0, 'n' },
+		{ "size",  1, 0, 's' },
+		{ NULL, 0, 0, 0 },
+	};
+	struct shared *shared;
+	uint64_t *send_ns;
+	pid_t pid;
+	int fd, i, c;
+
+	while ((c = getopt_long(argc, argv, "n:s:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		case 's':
+			only_size = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (calls <= 0 || only_size < 0 || only_size > MAX_DATA)
+		print_usage(argv[0]);
+
+	shared = mmap(NULL, sizeof(*shared) + calls * sizeof(uint64_t),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		pabort("mmap");
+	send_ns = calloc(calls, sizeof(*send_ns));
+	if (!send_ns)
+		pabort("calloc");
+
+	pid = fork();
+	if (pid < 0)
+		pabort("fork");
+	if (!pid)
+		receiver(shared);
+	while (!shared->manager)
+		usleep(10000);
+
+	fd = binder_open(MAP_SIZE);
+	printf("%d calls per size, ns\n", calls);
+	printf("%6s %10s %10s %10s %10s\n", "size", "send avg", "send 99%",
+	       "free avg", "free 99%");
+	if (only_size)
+		run(fd, shared, send_ns, only_size);
+	else
+		for (i = 0; i < sizeof(default_sizes) / sizeof(int); i++)
+			run(fd, shared, send_ns, default_sizes[i]);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * binder_bench.h - binder plumbing shared by the binder tests and
+ * benchmarks in this directory
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Every program here talks to the driver the same way: open and map
+ * /dev/binder, write commands, read until a transaction or a reply arrives,
+ * and free the buffers it came in. Errors abort the program.
+ */
+
+#ifndef _BINDER_BENCH_H
+#define _BINDER_BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/binder.h>
+
+struct txn_cmd {
+	uint32_t cmd;
+	struct binder_transaction_data txn;
+} __attribute__((packed));
+
+static void pabort(const char *s)
+{
+	perror(s);
+	abort();
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* opens /dev/binder with 'map_size' bytes mapped for incoming buffers */
+static int binder_open(size_t map_size)
+{
+	int fd = open("/dev/binder", O_RDWR);
+
+	if (fd < 0)
+		pabort("can't open /dev/binder");
+	if (mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		pabort("can't map /dev/binder");
+	return fd;
+}
+
+static void binder_write(int fd, void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+		pabort("binder write");
+}
+
+/*
+ * Writes 'len' bytes of commands at 'data', if any, and reads in the same
+ * BINDER_WRITE_READ until a transaction or a reply arrives. Copies it to
+ * 'txn' and returns the command it came with.
+ */
+static uint32_t binder_call(int fd, void *data, size_t len,
+			    struct binder_transaction_data *txn)
+{
+	uint32_t buf[64];
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	for (;;) {
+		char *ptr, *end;
+
+		bwr.read_size = sizeof(buf);
+		bwr.read_consumed = 0;
+		bwr.read_buffer = (unsigned long)buf;
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+			pabort("binder read");
+		bwr.write_size = 0;
+
+		ptr = (char *)buf;
+		end = ptr + bwr.read_consumed;
+		while (ptr < end) {
+			uint32_t cmd = *(uint32_t *)ptr;
+
+			ptr += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(txn, ptr, sizeof(*txn));
+				return cmd;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+			case BR_RELEASE:
+			case BR_DECREFS:
+				ptr += sizeof(struct binder_ptr_cookie);
+				break;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				fprintf(stderr, "call failed: %x\n", cmd);
+				exit(1);
+			default:
+				fprintf(stderr, "unexpected binder command %x\n",
+					cmd);
+				exit(1);
+			}
+		}
+	}
+}
+
+/* binder_call with nothing to write */
+static inline uint32_t binder_wait(int fd,
+				   struct binder_transaction_data *txn)
+{
+	return binder_call(fd, NULL, 0, txn);
+}
+
+static void free_buffer(int fd, const void *buffer)
+{
+	struct {
+		uint32_t cmd;
+		const void *buffer;
+	} __attribute__((packed)) free_cmd = { BC_FREE_BUFFER, buffer };
+
+	binder_write(fd, &free_cmd, sizeof(free_cmd));
+}
+
+#endif /* _BINDER_BENCH_H */
@@ -0,0 +1,224 @@
+/*
+ * binder_pi_test - round trip latency of an RT client calling into a loaded
+ * binder service
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The test forks a service that becomes the context manager and spins for
+ * a while on every call, and a number of CPU hogs at normal priority. The
+ * parent then calls the service from a SCHED_FIFO thread and reports the
+ * round trip times, and the policy the service ran the calls with. Without
+ * priority inheritance the service competes with the hogs and the RT
+ * client waits for it; with it the service runs the call as SCHED_FIFO.
+ *
+ * Everything runs on the first CPU, so the hogs compete with the service
+ * on SMP as well. The context manager can only be set once, run this with
+ * servicemanager stopped. Needs root for SCHED_FIFO.
+ *
+ * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/binder.h>
+
+#include "binder_bench.h"
+
+#define MAP_SIZE (128 * 1024)
+#define MAX_LOADERS 16
+
+static int calls = 1000;
+static int loaders = 4;
+static int work_us = 200;
+static int rt_prio = 50;
+
+static void spin_us(int us)
+{
+	uint64_t end = now_ns() + (uint64_t)us * 1000;
+
+	while (now_ns() < end)
+		;
+}
+
+/* replies to every call with the policy it was run with */
+static void service(void)
+{
+	int fd = binder_open(MAP_SIZE);
+	uint32_t enter = BC_ENTER_LOOPER;
+	struct binder_transaction_data txn;
+	struct txn_cmd reply;
+	int32_t policy;
+
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		pabort("can't become the context manager");
+	binder_write(fd, &enter, sizeof(enter));
+
+	for (;;) {
+		if (binder_wait(fd, &txn) != BR_TRANSACTION)
+			continue;
+		policy = sched_getscheduler(0);
+		spin_us(work_us);
+		free_buffer(fd, txn.data.ptr.buffer);
+
+		memset(&reply, 0, sizeof(reply));
+		reply.cmd = BC_REPLY;
+		reply.txn.data_size = sizeof(policy);
+		reply.txn.data.ptr.buffer = &policy;
+		binder_write(fd, &reply, sizeof(reply));
+	}
+}
+
+static void loader(void)
+{
+	for (;;)
+		;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void client(void)
+{
+	int fd = binder_open(MAP_SIZE);
+	struct sched_param param = { .sched_priority = rt_prio };
+	struct binder_transaction_data txn;
+	struct txn_cmd call;
+	uint64_t *lat, start, total = 0;
+	int i, not_rt = 0;
+
+	lat = calloc(calls, sizeof(*lat));
+	if (!lat)
+		pabort("calloc");
+	if (rt_prio && sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+		pabort("can't set SCHED_FIFO");
+
+	for (i = 0; i < calls; i++) {
+		memset(&call, 0, sizeof(call));
+		call.cmd = BC_TRANSACTION;
+		call.txn.target.handle = 0;
+		call.txn.code = 1;
+
+		start = now_ns();
+		binder_write(fd, &call, sizeof(call));
+		if (binder_wait(fd, &txn) != BR_REPLY)
+			pabort("no reply");
+		lat[i] = now_ns() - start;
+
+		if (txn.data_size != sizeof(int32_t) ||
+		    *(const int32_t *)txn.data.ptr.buffer != SCHED_FIFO)
+			not_rt++;
+		free_buffer(fd, txn.data.ptr.buffer);
+		total += lat[i];
+	}
+
+	qsort(lat, calls, sizeof(*lat), cmp_u64);
+	printf("%d calls, %d loaders, %d us of work, client %s %d\n",
+	       calls, loaders, work_us, rt_prio ? "SCHED_FIFO" : "SCHED_OTHER",
+	       rt_prio);
+	printf("round trip us: min %llu avg %llu 99%% %llu max %llu\n",
+	       (unsigned long long)lat[0] / 1000,
+	       (unsigned long long)total / calls / 1000,
+	       (unsigned long long)lat[calls * 99 / 100] / 1000,
+	       (unsigned long long)lat[calls - 1] / 1000);
+	printf("calls the service ran below SCHED_FIFO: %d\n", not_rt);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-nlwp]\n", prog);
+	puts("  -n --calls    number of calls (default 1000)\n"
+	     "  -l --loaders  CPU hogs competing with the service (default 4)\n"
+	     "  -w --work     time the service spins per call, in us (default 200)\n"
+	     "  -p --prio     SCHED_FIFO priority of the client, 0 for SCHED_OTHER\n"
+	     "                (default 50)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "calls",   1, 0, 'n' },
+		{ "loaders", 1, 0, 'l' },
+		{ "work",    1, 0, 'w' },
+		{ "prio",    1, 0, 'p' },
+		{ NULL, 0, 0, 0 },
+	};
+	pid_t pids[MAX_LOADERS + 1];
+	cpu_set_t cpus;
+	int i, c, n = 0;
+
+	while ((c = getopt_long(argc, argv, "n:l:w:p:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		case 'l':
+			loaders = atoi(optarg);
+			break;
+		case 'w':
+			work_us = atoi(optarg);
+			break;
+		case 'p':
+			rt_prio = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (calls <= 0 || loaders < 0 || loaders > MAX_LOADERS)
+		print_usage(argv[0]);
+
+	CPU_ZERO(&cpus);
+	CPU_SET(0, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+		pabort("can't bind to the first CPU");
+
+	pids[n] = fork();
+	if (pids[n] < 0)
+		pabort("fork");
+	if (!pids[n++])
+		service();
+	for (i = 0; i < loaders; i++) {
+		pids[n] = fork();
+		if (pids[n] < 0)
+			pabort("fork");
+		if (!pids[n++])
+			loader();
+	}
+	/* give the service time to become the context manager */
+	sleep(1);
+
+	client();
+
+	for (i = 0; i < n; i++) {
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+	}
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * binder_pingpong_bench - call throughput of independent binder
+ * client/server pairs
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Forks N servers and N clients, each its own process, and one more that
+ * becomes the context manager and acts as a tiny service manager: every
+ * server registers its object under its index, and the client with the
+ * same index looks it up, like servicemanager's addService and getService.
+ * The pairs then start together and ping-pong calls for the given time,
+ * with each call and each reply written and read in one BINDER_WRITE_READ.
+ * Pairs share no process, so with a driver that has no global lock the
+ * total rate should grow with the number of pairs, up to the number of
+ * CPUs. Run it with 1, 2, 4... pairs to see how it scales.
+ *
+ * The context manager can only be set once, run this with servicemanager
+ * stopped.
+ *
+ * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/binder.h>
+
+#include "binder_bench.h"
+
+#define MAP_SIZE (128 * 1024)
+#define MAX_PAIRS 64
+#define MAX_DATA 4096
+
+enum {
+	CODE_REGISTER = 1,	/* a server's object and index */
+	CODE_LOOKUP,		/* an index, the reply holds the object */
+	CODE_PING,
+};
+
+static int pairs = 4;
+static int seconds = 5;
+static int data_size = 32;
+
+struct shared {
+	volatile int manager;
+	volatile int ready;
+	volatile int go;
+	volatile int stop;
+	unsigned long calls[MAX_PAIRS];
+};
+
+/* keeps the ref to 'handle' after the buffer it came in is freed */
+static void acquire(int fd, signed long handle)
+{
+	uint32_t cmd[2] = { BC_ACQUIRE, handle };
+
+	binder_write(fd, cmd, sizeof(cmd));
+}
+
+/*
+ * The context manager: keeps the servers' handles by index and hands them
+ * out to the clients. A client that asks too early gets an empty reply and
+ * tries again.
+ */
+static void manager(struct shared *shared)
+{
+	int fd = binder_open(MAP_SIZE);
+	signed long handles[MAX_PAIRS];
+	struct binder_transaction_data txn;
+	struct txn_cmd reply;
+	struct flat_binder_object obj;
+	size_t offset = 0;
+	uint32_t enter = BC_ENTER_LOOPER;
+
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		pabort("can't become the context manager");
+	shared->manager = 1;
+	memset(handles, 0, sizeof(handles));
+	binder_write(fd, &enter, sizeof(enter));
+	for (;;) {
+		const char *data;
+		int32_t index;
+
+		if (binder_call(fd, NULL, 0, &txn) != BR_TRANSACTION)
+			continue;
+		data = txn.data.ptr.buffer;
+		memset(&reply, 0, sizeof(reply));
+		reply.cmd = BC_REPLY;
+		if (txn.code == CODE_REGISTER &&
+		    txn.data_size == sizeof(obj) + sizeof(index)) {
+			memcpy(&obj, data, sizeof(obj));
+			memcpy(&index, data + sizeof(obj), sizeof(index));
+			if (obj.type == BINDER_TYPE_HANDLE &&
+			    index >= 0 && index < MAX_PAIRS) {
+				acquire(fd, obj.handle);
+				handles[index] = obj.handle;
+			}
+		} else if (txn.code == CODE_LOOKUP &&
+			   txn.data_size == sizeof(index)) {
+			memcpy(&index, data, sizeof(index));
+			if (index >= 0 && index < MAX_PAIRS &&
+			    handles[index]) {
+				memset(&obj, 0, sizeof(obj));
+				obj.type = BINDER_TYPE_HANDLE;
+				obj.handle = handles[index];
+				reply.txn.data_size = sizeof(obj);
+				reply.txn.offsets_size = sizeof(offset);
+				reply.txn.data.ptr.buffer = &obj;
+				reply.txn.data.ptr.offsets = &offset;
+			}
+		}
+		free_buffer(fd, txn.data.ptr.buffer);
+		binder_write(fd, &reply, sizeof(reply));
+	}
+}
+
+static void server(struct shared *shared, int n)
+{
+	int fd = binder_open(MAP_SIZE);
+	struct binder_transaction_data txn;
+	struct {
+		struct flat_binder_object obj;
+		int32_t index;
+	} __attribute__((packed)) reg;
+	size_t offset = 0;
+	uint32_t enter = BC_ENTER_LOOPER;
+	struct {
+		uint32_t free_cmd;
+		const void *buffer;
+		struct txn_cmd reply;
+	} __attribute__((packed)) cmds;
+	char data[MAX_DATA];
+	struct txn_cmd call;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.binder = (void *)(long)(n + 1);
+	reg.index = n;
+	memset(&call, 0, sizeof(call));
+	call.cmd = BC_TRANSACTION;
+	call.txn.target.handle = 0;
+	call.txn.code = CODE_REGISTER;
+	call.txn.data_size = sizeof(reg);
+	call.txn.offsets_size = sizeof(offset);
+	call.txn.data.ptr.buffer = &reg;
+	call.txn.data.ptr.offsets = &offset;
+	if (binder_call(fd, &call, sizeof(call), &txn) != BR_REPLY)
+		pabort("no reply to register");
+	free_buffer(fd, txn.data.ptr.buffer);
+
+	binder_write(fd, &enter, sizeof(enter));
+	memset(data, 0, sizeof(data));
+	memset(&cmds, 0, sizeof(cmds));
+	cmds.free_cmd = BC_FREE_BUFFER;
+	cmds.reply.cmd = BC_REPLY;
+	cmds.reply.txn.data_size = data_size;
+	cmds.reply.txn.data.ptr.buffer = data;
+
+	/* free the call and reply to it in the write of the next read */
+	if (binder_call(fd, NULL, 0, &txn) != BR_TRANSACTION)
+		pabort("expected a call");
+	for (;;) {
+		cmds.buffer = txn.data.ptr.buffer;
+		if (binder_call(fd, &cmds, sizeof(cmds), &txn) !=
+		    BR_TRANSACTION)
+			pabort("expected a call");
+	}
+}
+
+static void client(struct shared *shared, int n)
+{
+	int fd = binder_open(MAP_SIZE);
+	struct binder_transaction_data txn;
+	struct flat_binder_object obj;
+	signed long handle;
+	int32_t index = n;
+	struct {
+		uint32_t free_cmd;
+		const void *buffer;
+		struct txn_cmd call;
+	} __attribute__((packed)) cmds;
+	char data[MAX_DATA];
+	struct txn_cmd call;
+	unsigned long calls = 0;
+
+	for (;;) {
+		memset(&call, 0, sizeof(call));
+		call.cmd = BC_TRANSACTION;
+		call.txn.target.handle = 0;
+		call.txn.code = CODE_LOOKUP;
+		call.txn.data_size = sizeof(index);
+		call.txn.data.ptr.buffer = &index;
+		if (binder_call(fd, &call, sizeof(call), &txn) != BR_REPLY)
+			pabort("no reply to lookup");
+		if (txn.data_size == sizeof(obj)) {
+			memcpy(&obj, txn.data.ptr.buffer, sizeof(obj));
+			handle = obj.handle;
+			acquire(fd, handle);
+			free_buffer(fd, txn.data.ptr.buffer);
+			break;
+		}
+		free_buffer(fd, txn.data.ptr.buffer);
+		usleep(10000);
+	}
+	__sync_fetch_and_add(&shared->ready, 1);
+
+	memset(data, 0, sizeof(data));
+	memset(&cmds, 0, sizeof(cmds));
+	cmds.free_cmd = BC_FREE_BUFFER;
+	cmds.call.cmd = BC_TRANSACTION;
+	cmds.call.txn.target.handle = handle;
+	cmds.call.txn.code = CODE_PING;
+	cmds.call.txn.data_size = data_size;
+	cmds.call.txn.data.ptr.buffer = data;
+
+	while (!shared->go)
+		;
+	/* the first call has no reply to free yet */
+	if (binder_call(fd, &cmds.call, sizeof(cmds.call), &txn) != BR_REPLY)
+		pabort("no reply");
+	calls++;
+	/* counted locally, the clients mustn't share a cache line */
+	while (!shared->stop) {
+		cmds.buffer = txn.data.ptr.buffer;
+		if (binder_call(fd, &cmds, sizeof(cmds), &txn) != BR_REPLY)
+			pabort("no reply");
+		calls++;
+	}
+	free_buffer(fd, txn.data.ptr.buffer);
+	shared->calls[n] = calls;
+	exit(0);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-ptd]\n", prog);
+	puts("  -p --pairs  client/server pairs (default 4)\n"
+	     "  -t --time   seconds to run (default 5)\n"
+	     "  -d --data   bytes in each call and reply (default 32)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "pairs", 1, 0, 'p' },
+		{ "time",  1, 0, 't' },
+		{ "data",  1, 0, 'd' },
+		{ NULL, 0, 0, 0 },
+	};
+	struct shared *shared;
+	unsigned long total = 0, slowest = ~0UL;
+	unsigned long long rate;
+	uint64_t start, ns;
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS], mgr;
+	int i, c;
+
+	while ((c = getopt_long(argc, argv, "p:t:d:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			pairs = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'd':
+			data_size = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (pairs <= 0 || pairs > MAX_PAIRS || seconds <= 0 ||
+	    data_size < 0 || data_size > MAX_DATA)
+		print_usage(argv[0]);
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		pabort("mmap");
+
+	mgr = fork();
+	if (mgr < 0)
+		pabort("fork");
+	if (!mgr)
+		manager(shared);
+	/* it must be the context manager before anyone looks for it */
+	while (!shared->manager)
+		usleep(10000);
+
+	for (i = 0; i < pairs; i++) {
+		servers[i] = fork();
+		if (servers[i] < 0)
+			pabort("fork");
+		if (!servers[i])
+			server(shared, i);
+		clients[i] = fork();
+		if (clients[i] < 0)
+			pabort("fork");
+		if (!clients[i])
+			client(shared, i);
+	}
+	while (shared->ready != pairs)
+		usleep(10000);
+
+	start = now_ns();
+	shared->go = 1;
+	sleep(seconds);
+	shared->stop = 1;
+	ns = now_ns() - start;
+
+	for (i = 0; i < pairs; i++)
+		waitpid(clients[i], NULL, 0);
+	for (i = 0; i < pairs; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+	kill(mgr, SIGKILL);
+	waitpid(mgr, NULL, 0);
+
+	for (i = 0; i < pairs; i++) {
+		total += shared->calls[i];
+		if (shared->calls[i] < slowest)
+			slowest = shared->calls[i];
+	}
+
+	printf("%d pairs, %d bytes each way, %d s\n", pairs, data_size,
+	       seconds);
+	rate = (unsigned long long)total * 1000000000 / ns;
+	printf("total %llu calls/s, %llu us per call\n", rate,
+	       total ? (unsigned long long)ns * pairs / total / 1000 : 0);
+	printf("per pair %llu calls/s, slowest %llu calls/s\n",
+	       rate / pairs, (unsigned long long)slowest * 1000000000 / ns);
+	return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * binder_translate_bench - cost of translating binder objects in
+ * transactions that carry many of them
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Forks a service that becomes the context manager and an owner that
+ * creates K objects and hands them all to the service once, which keeps a
+ * ref to each. Then two phases are timed, each N calls of M objects picked
+ * at random from the K:
+ *
+ * 	- objects: the owner sends its own objects to the service. Every
+ * 	  object is a node lookup in the owner and a ref by node lookup in
+ * 	  the service.
+ * 	- handles: the service sends its handles back to the owner. Every
+ * 	  object is a ref by descriptor lookup in the service.
+ *
+ * The time per call and per object of each phase is reported, with the
+ * node and ref cache hits and misses of both processes over the phase,
+ * from /proc/binder/stats. With K up to the cache size nearly every lookup
+ * should hit; with thousands of objects most miss and the cost per object
+ * is that of the tree walks.
+ *
+ * The context manager can only be set once, run this with servicemanager
+ * stopped.
+ *
+ * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/binder.h>
+
+#include "binder_bench.h"
+
+#define MAP_SIZE (1024 * 1024)
+#define MAX_OBJECTS 65536
+#define MAX_PER_CALL 256
+
+enum {
+	CODE_SETUP = 1,	/* objects for the service to keep */
+	CODE_CALL,	/* objects to translate and drop */
+	CODE_TURN,	/* the service calls the owner from now on */
+	CODE_DONE,	/* the owner stops serving */
+};
+
+static int objects = 4096;
+static int per_call = 64;
+static int calls = 1000;
+
+struct shared {
+	volatile int manager;
+	volatile int ready;
+	volatile int go_objects;
+	volatile int done_objects;
+	volatile int go_handles;
+	volatile int done_handles;
+	uint64_t objects_ns;
+	uint64_t handles_ns;
+};
+
+struct cache_stats {
+	int node_hits, node_misses;
+	int ref_hits, ref_misses;
+};
+
+static struct flat_binder_object objs[MAX_PER_CALL];
+static size_t offsets[MAX_PER_CALL];
+
+static void reply_empty(int fd)
+{
+	struct txn_cmd reply;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.cmd = BC_REPLY;
+	binder_write(fd, &reply, sizeof(reply));
+}
+
+/* calls 'handle' with the first 'n' entries of objs */
+static void call_objs(int fd, signed long handle, unsigned int code, int n)
+{
+	struct binder_transaction_data txn;
+	struct txn_cmd call;
+
+	memset(&call, 0, sizeof(call));
+	call.cmd = BC_TRANSACTION;
+	call.txn.target.handle = handle;
+	call.txn.code = code;
+	call.txn.data_size = n * sizeof(*objs);
+	call.txn.offsets_size = n * sizeof(*offsets);
+	call.txn.data.ptr.buffer = objs;
+	call.txn.data.ptr.offsets = offsets;
+	binder_write(fd, &call, sizeof(call));
+	if (binder_wait(fd, &txn) != BR_REPLY)
+		pabort("no reply");
+	free_buffer(fd, txn.data.ptr.buffer);
+}
+
+/*
+ * Keeps a ref to every object it is given with CODE_SETUP, then on
+ * CODE_TURN sends them back to the owner in the handles phase.
+ */
+static void service(struct shared *shared)
+{
+	int fd = binder_open(MAP_SIZE);
+	uint32_t enter = BC_ENTER_LOOPER;
+	struct binder_transaction_data txn;
+	signed long *handles;
+	int nr_handles = 0;
+	uint64_t start;
+	int i, j;
+
+	handles = calloc(objects, sizeof(*handles));
+	if (!handles)
+		pabort("calloc");
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		pabort("can't become the context manager");
+	shared->manager = 1;
+	binder_write(fd, &enter, sizeof(enter));
+
+	for (;;) {
+		const struct flat_binder_object *obj;
+		unsigned int code;
+
+		if (binder_wait(fd, &txn) != BR_TRANSACTION)
+			continue;
+		code = txn.code;
+		if (code == CODE_SETUP) {
+			obj = txn.data.ptr.buffer;
+			for (i = 0; i < txn.data_size / sizeof(*obj); i++) {
+				uint32_t acquire[2] = { BC_ACQUIRE, obj[i].handle };
+
+				if (obj[i].type != BINDER_TYPE_HANDLE ||
+				    nr_handles == objects)
+					continue;
+				binder_write(fd, acquire, sizeof(acquire));
+				handles[nr_handles++] = obj[i].handle;
+			}
+		}
+		free_buffer(fd, txn.data.ptr.buffer);
+		reply_empty(fd);
+		if (code == CODE_TURN)
+			break;
+	}
+	if (nr_handles != objects) {
+		fprintf(stderr, "service got %d of %d objects\n", nr_handles,
+			objects);
+		exit(1);
+	}
+
+	while (!shared->go_handles)
+		;
+	shared->handles_ns = 0;
+	for (i = 0; i < calls; i++) {
+		for (j = 0; j < per_call; j++) {
+			memset(&objs[j], 0, sizeof(objs[j]));
+			objs[j].type = BINDER_TYPE_HANDLE;
+			objs[j].handle = handles[rand() % objects];
+		}
+		start = now_ns();
+		call_objs(fd, handles[0], CODE_CALL, per_call);
+		shared->handles_ns += now_ns() - start;
+	}
+	shared->done_handles = 1;
+	call_objs(fd, handles[0], CODE_DONE, 0);
+	for (;;)
+		pause();
+}
+
+static void owner(struct shared *shared)
+{
+	int fd = binder_open(MAP_SIZE);
+	uint32_t enter = BC_ENTER_LOOPER;
+	struct binder_transaction_data txn;
+	uint64_t start;
+	int i, j, n;
+
+	for (i = 0; i < MAX_PER_CALL; i++)
+		offsets[i] = i * sizeof(*objs);
+
+	/* the address of object i is i + 1, nothing dereferences it */
+	for (i = 0; i < objects; i += n) {
+		n = objects - i < MAX_PER_CALL ? objects - i : MAX_PER_CALL;
+		for (j = 0; j < n; j++) {
+			memset(&objs[j], 0, sizeof(objs[j]));
+			objs[j].type = BINDER_TYPE_BINDER;
+			objs[j].binder = (void *)(long)(i + j + 1);
+		}
+		call_objs(fd, 0, CODE_SETUP, n);
+	}
+	shared->ready = 1;
+
+	while (!shared->go_objects)
+		;
+	shared->objects_ns = 0;
+	for (i = 0; i < calls; i++) {
+		for (j = 0; j < per_call; j++) {
+			memset(&objs[j], 0, sizeof(objs[j]));
+			objs[j].type = BINDER_TYPE_BINDER;
+			objs[j].binder = (void *)(long)(rand() % objects + 1);
+		}
+		start = now_ns();
+		call_objs(fd, 0, CODE_CALL, per_call);
+		shared->objects_ns += now_ns() - start;
+	}
+	shared->done_objects = 1;
+
+	/* hand over to the service and serve its calls until it's done */
+	call_objs(fd, 0, CODE_TURN, 0);
+	binder_write(fd, &enter, sizeof(enter));
+	for (;;) {
+		if (binder_wait(fd, &txn) != BR_TRANSACTION)
+			continue;
+		free_buffer(fd, txn.data.ptr.buffer);
+		reply_empty(fd);
+		if (txn.code == CODE_DONE)
+			break;
+	}
+	for (;;)
+		pause();
+}
+
+/* the cache counters of 'pid' from /proc/binder/stats, zero if not there */
+static void read_cache_stats(pid_t pid, struct cache_stats *stats)
+{
+	char line[256];
+	int in_proc = 0, p;
+	FILE *f;
+
+	memset(stats, 0, sizeof(*stats));
+	f = fopen("/proc/binder/stats", "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "proc %d", &p) == 1) {
+			in_proc = p == pid;
+			continue;
+		}
+		if (!in_proc)
+			continue;
+		sscanf(line, " node cache: %d hits, %d misses",
+		       &stats->node_hits, &stats->node_misses);
+		sscanf(line, " ref cache: %d hits, %d misses",
+		       &stats->ref_hits, &stats->ref_misses);
+	}
+	fclose(f);
+}
+
+static void print_rate(const char *what, int hits, int misses)
+{
+	int total = hits + misses;
+
+	printf("    %s cache: %d hits, %d misses, %d%% hit\n", what, hits,
+	       misses, total ? hits * 100 / total : 0);
+}
+
+static void print_phase(const char *name, uint64_t ns,
+			const struct cache_stats *owner_before,
+			const struct cache_stats *owner_after,
+			const struct cache_stats *service_before,
+			const struct cache_stats *service_after)
+{
+	printf("%s: %llu ns per call, %llu ns per object\n", name,
+	       (unsigned long long)ns / calls,
+	       (unsigned long long)ns / calls / per_call);
+	printf("  owner\n");
+	print_rate("node", owner_after->node_hits - owner_before->node_hits,
+		   owner_after->node_misses - owner_before->node_misses);
+	print_rate("ref", owner_after->ref_hits - owner_before->ref_hits,
+		   owner_after->ref_misses - owner_before->ref_misses);
+	printf("  service\n");
+	print_rate("node",
+		   service_after->node_hits - service_before->node_hits,
+		   service_after->node_misses - service_before->node_misses);
+	print_rate("ref", service_after->ref_hits - service_before->ref_hits,
+		   service_after->ref_misses - service_before->ref_misses);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-kmn]\n", prog);
+	puts("  -k --objects   objects the owner creates (default 4096)\n"
+	     "  -m --per-call  objects in each call, up to 256 (default 64)\n"
+	     "  -n --calls     calls in each phase (default 1000)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "objects",  1, 0, 'k' },
+		{ "per-call", 1, 0, 'm' },
+		{ "calls",    1, 0, 'n' },
+		{ NULL, 0, 0, 0 },
+	};
+	struct cache_stats owner_stats[3], service_stats[3];
+	struct shared *shared;
+	pid_t service_pid, owner_pid;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "k:m:n:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'k':
+			objects = atoi(optarg);
+			break;
+		case 'm':
+			per_call = atoi(optarg);
+			break;
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (objects <= 0 || objects > MAX_OBJECTS || per_call <= 0 ||
+	    per_call > MAX_PER_CALL || calls <= 0)
+		print_usage(argv[0]);
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		pabort("mmap");
+
+	service_pid = fork();
+	if (service_pid < 0)
+		pabort("fork");
+	if (!service_pid)
+		service(shared);
+	while (!shared->manager)
+		usleep(10000);
+	owner_pid = fork();
+	if (owner_pid < 0)
+		pabort("fork");
+	if (!owner_pid)
+		owner(shared);
+	while (!shared->ready)
+		usleep(10000);
+
+	read_cache_stats(owner_pid, &owner_stats[0]);
+	read_cache_stats(service_pid, &service_stats[0]);
+	shared->go_objects = 1;
+	while (!shared->done_objects)
+		usleep(10000);
+	read_cache_stats(owner_pid, &owner_stats[1]);
+	read_cache_stats(service_pid, &service_stats[1]);
+	shared->go_handles = 1;
+	while (!shared->done_handles)
+		usleep(10000);
+	read_cache_stats(owner_pid, &owner_stats[2]);
+	read_cache_stats(service_pid, &service_stats[2]);
+
+	kill(owner_pid, SIGKILL);
+	waitpid(owner_pid, NULL, 0);
+	kill(service_pid, SIGKILL);
+	waitpid(service_pid, NULL, 0);
+
+	printf("%d objects, %d per call, %d calls per phase\n", objects,
+	       per_call, calls);
+	print_phase("objects", shared->objects_ns, &owner_stats[0],
+		    &owner_stats[1], &service_stats[0], &service_stats[1]);
+	print_phase("handles", shared->handles_ns, &owner_stats[1],
+		    &owner_stats[2], &service_stats[1], &service_stats[2]);
+	return 0;
+}
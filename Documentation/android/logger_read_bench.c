@@ -0,0 +1,318 @@
+/*
+ * logger_read_bench - lines per second a log consumer keeps up with, reading
+ * through read() or through mmap
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Forks writers that write to the log as fast as they can while the parent
+ * consumes it, either one entry per read() (optionally batched with
+ * LOGGER_SET_BATCH) or by parsing the mapped buffer in place as described
+ * at struct logger_mmap_header. Reports the lines consumed per second and
+ * how many of the lines written the consumer lost to being lapped.
+ * Run it once per mode to compare them.
+ *
+ * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/types.h>
+#include <linux/logger.h>
+
+#define MAX_WRITERS 64
+#define rmb() __sync_synchronize()
+
+enum { MODE_READ, MODE_BATCH, MODE_MMAP };
+
+static const char *device = "/dev/log/main";
+static int mode = MODE_READ;
+static int writers = 2;
+static int seconds = 5;
+
+struct shared {
+	volatile int go;
+	volatile int stop;
+	unsigned long lines[MAX_WRITERS];
+};
+
+static void pabort(const char *s)
+{
+	perror(s);
+	abort();
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void writer(struct shared *shared, int n)
+{
+	unsigned char prio = 4;
+	char tag[] = "logbench";
+	char msg[] = "the quick brown fox jumps over the lazy dog";
+	struct iovec vec[3];
+	unsigned long lines = 0;
+	int fd;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0)
+		pabort("can't open the log");
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = tag;
+	vec[1].iov_len = sizeof(tag);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = sizeof(msg);
+
+	while (!shared->go)
+		;
+	while (!shared->stop) {
+		if (writev(fd, vec, 3) < 0)
+			pabort("writev");
+		lines++;
+	}
+	shared->lines[n] = lines;
+	exit(0);
+}
+
+/* what a consumer does with a line, so the payload is really read */
+static unsigned long consume(const unsigned char *msg, size_t len)
+{
+	unsigned long sum = 0;
+
+	while (len--)
+		sum += *msg++;
+	return sum;
+}
+
+static unsigned long read_log(int fd, struct shared *shared,
+			      unsigned long *sum)
+{
+	unsigned char buf[LOGGER_ENTRY_MAX_LEN * 4];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	unsigned long lines = 0;
+	int done = 0;
+
+	for (;;) {
+		ssize_t ret = read(fd, buf, sizeof(buf));
+		unsigned char *ptr = buf;
+
+		if (ret < 0) {
+			if (errno != EAGAIN)
+				pabort("read");
+			if (done)
+				break;
+			done = shared->stop;
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		/* a batched read returns as many entries as fit */
+		while (ptr < buf + ret) {
+			struct logger_entry *entry = (struct logger_entry *)ptr;
+
+			*sum += consume((unsigned char *)entry->msg, entry->len);
+			ptr += sizeof(*entry) + entry->len;
+			lines++;
+		}
+	}
+	return lines;
+}
+
+static void copy_from_ring(void *to, const unsigned char *ring, __u32 size,
+			   __u32 pos, size_t len)
+{
+	__u32 off = pos & (size - 1);
+	size_t first = len < size - off ? len : size - off;
+
+	memcpy(to, ring + off, first);
+	memcpy((char *)to + first, ring, len - first);
+}
+
+static unsigned long mmap_log(int fd, struct shared *shared,
+			      unsigned long *sum)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	volatile struct logger_mmap_header *hdr;
+	const unsigned char *ring;
+	unsigned char msg[LOGGER_ENTRY_MAX_PAYLOAD];
+	unsigned long lines = 0;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int size, done = 0;
+	__u32 pos;
+
+	size = ioctl(fd, LOGGER_GET_LOG_BUF_SIZE);
+	if (size < 0)
+		pabort("LOGGER_GET_LOG_BUF_SIZE");
+	hdr = mmap(NULL, pagesize + size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		pabort("can't map the log");
+	ring = (const unsigned char *)hdr + pagesize;
+	pos = hdr->w_off;
+
+	for (;;) {
+		__u32 w_off = hdr->w_off, start = pos;
+		unsigned long parsed = 0, parsed_sum = 0;
+
+		rmb();
+		if (pos == w_off) {
+			if (done)
+				break;
+			done = shared->stop;
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		while ((__s32)(w_off - pos) > 0) {
+			struct logger_entry entry;
+
+			copy_from_ring(&entry, ring, size, pos, sizeof(entry));
+			/* overwritten under us, the head check below sees it */
+			if (entry.len > LOGGER_ENTRY_MAX_PAYLOAD)
+				break;
+			copy_from_ring(msg, ring, size, pos + sizeof(entry),
+				       entry.len);
+			parsed_sum += consume(msg, entry.len);
+			pos += sizeof(entry) + entry.len;
+			parsed++;
+		}
+		rmb();
+		/* lapped while parsing, what we read may be garbage */
+		if ((__s32)(hdr->head - start) > 0) {
+			pos = hdr->head;
+			continue;
+		}
+		lines += parsed;
+		*sum += parsed_sum;
+	}
+	return lines;
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-Dmwt]\n", prog);
+	puts("  -D --device   log to read (default /dev/log/main)\n"
+	     "  -m --mode     read, batch or mmap (default read)\n"
+	     "  -w --writers  concurrent writers (default 2)\n"
+	     "  -t --time     seconds to run (default 5)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "device",  1, 0, 'D' },
+		{ "mode",    1, 0, 'm' },
+		{ "writers", 1, 0, 'w' },
+		{ "time",    1, 0, 't' },
+		{ NULL, 0, 0, 0 },
+	};
+	static const char *modes[] = { "read", "batch", "mmap" };
+	struct shared *shared;
+	unsigned long written = 0, lines, sum = 0;
+	unsigned char drain[LOGGER_ENTRY_MAX_LEN];
+	uint64_t start, ns;
+	pid_t pids[MAX_WRITERS];
+	int fd, i, c;
+
+	while ((c = getopt_long(argc, argv, "D:m:w:t:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'm':
+			for (mode = 0; mode < 3; mode++)
+				if (!strcmp(optarg, modes[mode]))
+					break;
+			if (mode == 3)
+				print_usage(argv[0]);
+			break;
+		case 'w':
+			writers = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (writers <= 0 || writers > MAX_WRITERS || seconds <= 0)
+		print_usage(argv[0]);
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		pabort("mmap");
+
+	fd = open(device, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		pabort("can't open the log");
+	if (mode == MODE_BATCH && ioctl(fd, LOGGER_SET_BATCH, 1) < 0)
+		pabort("LOGGER_SET_BATCH");
+	/* only count what is written from now on */
+	if (mode != MODE_MMAP)
+		while (read(fd, drain, sizeof(drain)) > 0)
+			;
+
+	for (i = 0; i < writers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			pabort("fork");
+		if (!pids[i])
+			writer(shared, i);
+	}
+	/* the writers stop on their own, after 'seconds' */
+	if (!fork()) {
+		sleep(1);
+		shared->go = 1;
+		sleep(seconds);
+		shared->stop = 1;
+		exit(0);
+	}
+
+	while (!shared->go)
+		;
+	start = now_ns();
+	if (mode == MODE_MMAP)
+		lines = mmap_log(fd, shared, &sum);
+	else
+		lines = read_log(fd, shared, &sum);
+	ns = now_ns() - start;
+
+	while (wait(NULL) > 0)
+		;
+	for (i = 0; i < writers; i++)
+		written += shared->lines[i];
+
+	printf("%s consumer, %d writers, %d s\n", modes[mode], writers,
+	       seconds);
+	printf("consumed %lu lines, %llu lines/s, lost %ld of %lu\n", lines,
+	       (unsigned long long)lines * 1000000000 / ns,
+	       (long)(written - lines), written);
+	return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * logger_write_bench - write throughput of concurrent writers to a log
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Forks N writers that each write lines to the log as fast as they can, the
+ * way liblog does: priority, tag and message in one writev(). They start
+ * together and stop after the given time; the total and per writer line
+ * rates are reported. Run it with 1, 2, 4... writers to see how writing
+ * scales, and whether a writer is ever held up by the others.
+ *
+ * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#define MAX_WRITERS 64
+
+static const char *device = "/dev/log/main";
+static int writers = 4;
+static int seconds = 5;
+static int msg_len = 64;
+static int prio = 4;	/* ANDROID_LOG_INFO */
+
+struct shared {
+	volatile int go;
+	volatile int stop;
+	unsigned long lines[MAX_WRITERS];
+};
+
+static void pabort(const char *s)
+{
+	perror(s);
+	abort();
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void writer(struct shared *shared, int n)
+{
+	unsigned char p = prio;
+	char tag[] = "logbench";
+	char *msg;
+	struct iovec vec[3];
+	unsigned long lines = 0;
+	int fd;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0)
+		pabort("can't open the log");
+	msg = malloc(msg_len + 1);
+	if (!msg)
+		pabort("malloc");
+	memset(msg, 'a' + n % 26, msg_len);
+	msg[msg_len] = '\0';
+
+	vec[0].iov_base = &p;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = tag;
+	vec[1].iov_len = sizeof(tag);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = msg_len + 1;
+
+	while (!shared->go)
+		;
+	/* counted locally, the writers mustn't share a cache line */
+	while (!shared->stop) {
+		if (writev(fd, vec, 3) < 0)
+			pabort("writev");
+		lines++;
+	}
+	shared->lines[n] = lines;
+	exit(0);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-Dwtlp]\n", prog);
+	puts("  -D --device   log to write (default /dev/log/main)\n"
+	     "  -w --writers  concurrent writers (default 4)\n"
+	     "  -t --time     seconds to run (default 5)\n"
+	     "  -l --length   message length (default 64)\n"
+	     "  -p --prio     priority of the lines (default 4, info)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "device",  1, 0, 'D' },
+		{ "writers", 1, 0, 'w' },
+		{ "time",    1, 0, 't' },
+		{ "length",  1, 0, 'l' },
+		{ "prio",    1, 0, 'p' },
+		{ NULL, 0, 0, 0 },
+	};
+	struct shared *shared;
+	unsigned long total = 0, slowest = ~0UL;
+	unsigned long long rate;
+	uint64_t start, ns;
+	pid_t pids[MAX_WRITERS];
+	int i, c;
+
+	while ((c = getopt_long(argc, argv, "D:w:t:l:p:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'w':
+			writers = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'l':
+			msg_len = atoi(optarg);
+			break;
+		case 'p':
+			prio = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (writers <= 0 || writers > MAX_WRITERS || seconds <= 0 ||
+	    msg_len <= 0 || msg_len > 4000)
+		print_usage(argv[0]);
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		pabort("mmap");
+
+	for (i = 0; i < writers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			pabort("fork");
+		if (!pids[i])
+			writer(shared, i);
+	}
+	/* let them all open the log first */
+	sleep(1);
+
+	start = now_ns();
+	shared->go = 1;
+	sleep(seconds);
+	shared->stop = 1;
+	ns = now_ns() - start;
+
+	for (i = 0; i < writers; i++)
+		waitpid(pids[i], NULL, 0);
+	for (i = 0; i < writers; i++) {
+		total += shared->lines[i];
+		if (shared->lines[i] < slowest)
+			slowest = shared->lines[i];
+	}
+
+	printf("%d writers, %d byte messages, %d s\n", writers, msg_len,
+	       seconds);
+	rate = (unsigned long long)total * 1000000000 / ns;
+	/* entry header, priority, tag and message with their terminators */
+	printf("total %llu lines/s, %llu KB/s\n", rate,
+	       rate * (20 + 1 + 9 + msg_len + 1) / 1024);
+	printf("per writer %llu lines/s, slowest %llu lines/s\n",
+	       rate / writers,
+	       (unsigned long long)slowest * 1000000000 / ns);
+	return 0;
+}
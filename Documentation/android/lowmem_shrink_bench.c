@@ -0,0 +1,215 @@
+/*
+ * lowmem_shrink_bench - cost of the low memory killer's shrinker calls as
+ * the number of processes grows
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Writing 2 to /proc/sys/vm/drop_caches runs shrink_slab, which calls every
+ * shrinker, lowmem_shrink included, at least once. This times a number of
+ * such writes, then forks the given number of idle processes, each with a
+ * few pages of its own, and times them again. The other shrinkers don't
+ * depend on the number of processes, so the difference between the two
+ * runs, divided by the number of processes, is what each process adds to
+ * the low memory killer's calls.
+ *
+ * Run it on kernels from before and after the oom_adj buckets. Before,
+ * every call walks the task list and reads the rss of each process, so the
+ * cost per process is well above zero. After, calls made above every
+ * minfree return without looking at any process and it should be close to
+ * zero. Only those calls, the common case, are timed here: free memory
+ * must stay above the minfree levels in
+ * /sys/module/lowmemorykiller/parameters/minfree while it runs. The
+ * children set their oom_adj to 15, so if it does drop below, they are
+ * the ones killed; they are counted and reported.
+ *
+ * drop_caches needs root.
+ *
+ * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_PROCS 4096
+
+static int procs = 500;
+static int drops = 100;
+static int pages = 16;
+
+struct shared {
+	volatile int ready;
+};
+
+static void pabort(const char *s)
+{
+	perror(s);
+	abort();
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void write_file(const char *path, const char *s)
+{
+	int fd = open(path, O_WRONLY);
+
+	if (fd < 0)
+		pabort(path);
+	if (write(fd, s, strlen(s)) != strlen(s))
+		pabort(path);
+	close(fd);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* times 'drops' writes to drop_caches, returns the average in ns */
+static uint64_t run(const char *what, uint64_t *ns)
+{
+	uint64_t start, total = 0;
+	int i;
+
+	/* the first one frees whatever the caches hold, leave it out */
+	write_file("/proc/sys/vm/drop_caches", "2\n");
+	for (i = 0; i < drops; i++) {
+		start = now_ns();
+		write_file("/proc/sys/vm/drop_caches", "2\n");
+		ns[i] = now_ns() - start;
+		total += ns[i];
+	}
+	qsort(ns, drops, sizeof(*ns), cmp_u64);
+	printf("%-22s %10llu %10llu %10llu\n", what,
+	       (unsigned long long)(total / drops),
+	       (unsigned long long)ns[drops * 99 / 100],
+	       (unsigned long long)ns[drops - 1]);
+	return total / drops;
+}
+
+/* touches its pages so it has an rss, and waits to be killed */
+static void child(struct shared *shared)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	char *p;
+	int i;
+
+	write_file("/proc/self/oom_adj", "15\n");
+	p = malloc(pages * pagesize);
+	if (!p)
+		pabort("malloc");
+	for (i = 0; i < pages; i++)
+		p[i * pagesize] = 1;
+	__sync_fetch_and_add(&shared->ready, 1);
+	for (;;)
+		pause();
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-psn]\n", prog);
+	puts("  -p --procs  idle processes to add (default 500)\n"
+	     "  -s --pages  pages each of them touches (default 16)\n"
+	     "  -n --drops  drop_caches writes timed per run (default 100)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "procs", 1, 0, 'p' },
+		{ "pages", 1, 0, 's' },
+		{ "drops", 1, 0, 'n' },
+		{ NULL, 0, 0, 0 },
+	};
+	static pid_t pids[MAX_PROCS];
+	struct shared *shared;
+	uint64_t *ns, before, after;
+	int i, c, killed = 0;
+
+	while ((c = getopt_long(argc, argv, "p:s:n:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			procs = atoi(optarg);
+			break;
+		case 's':
+			pages = atoi(optarg);
+			break;
+		case 'n':
+			drops = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (procs <= 0 || procs > MAX_PROCS || pages <= 0 || drops <= 0)
+		print_usage(argv[0]);
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		pabort("mmap");
+	ns = calloc(drops, sizeof(*ns));
+	if (!ns)
+		pabort("calloc");
+
+	printf("%d drop_caches writes per run, ns\n", drops);
+	printf("%-22s %10s %10s %10s\n", "", "avg", "99%", "max");
+	before = run("without the processes", ns);
+
+	for (i = 0; i < procs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			pabort("fork");
+		if (!pids[i])
+			child(shared);
+	}
+	while (shared->ready < procs)
+		usleep(10000);
+	after = run("with the processes", ns);
+
+	/* any that have already exited were killed by the killer */
+	for (i = 0; i < procs; i++)
+		if (waitpid(pids[i], NULL, WNOHANG) == pids[i])
+			pids[i] = 0;
+	for (i = 0; i < procs; i++) {
+		if (!pids[i]) {
+			killed++;
+			continue;
+		}
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+	}
+	printf("%lld ns per process per write\n",
+	       ((long long)after - (long long)before) / procs);
+	if (killed)
+		printf("%d processes were gone before the end, free memory "
+		       "dropped below a minfree\n", killed);
+	return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * pmem_alloc_bench - allocation latency of a fragmented pmem region
+ *
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The region is filled with one-page allocations and every other one is
+ * freed again, leaving nothing but one-page holes. The test then times
+ * allocating and freeing a page, which has to find a hole, and asking for
+ * two pages, which fails after looking at every free block there is.
+ * The fill allocations are pinned with PMEM_GET_SIZE, so compaction can't
+ * undo the fragmentation while the test runs.
+ *
+ * The kernel's own view is in the device's stats/alloc_latency in sysfs.
+ * Run this with nothing else using the region.
+ *
+ * Cross-compile with cross-gcc -I/path/to/cross-kernel/include
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/android_pmem.h>
+
+static const char *device = "/dev/pmem";
+static int iterations = 1000;
+
+static void pabort(const char *s)
+{
+	perror(s);
+	abort();
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int pmem_open(void)
+{
+	int fd = open(device, O_RDWR);
+
+	if (fd < 0)
+		pabort("can't open the pmem device");
+	return fd;
+}
+
+/* returns the size of the file's allocation, 0 if it has none */
+static unsigned long pmem_size(int fd)
+{
+	struct pmem_region region;
+
+	if (ioctl(fd, PMEM_GET_SIZE, &region) < 0)
+		pabort("PMEM_GET_SIZE");
+	return region.len;
+}
+
+static void report(const char *what, uint64_t ns, int ops)
+{
+	printf("%-20s %8d ops %10llu ns/op\n", what, ops,
+	       (unsigned long long)ns / ops);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-Di]\n", prog);
+	puts("  -D --device      pmem device to use (default /dev/pmem)\n"
+	     "  -i --iterations  allocations timed (default 1000)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "device",     1, 0, 'D' },
+		{ "iterations", 1, 0, 'i' },
+		{ NULL, 0, 0, 0 },
+	};
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct pmem_region total;
+	struct rlimit rlim;
+	uint64_t alloc_ns = 0, free_ns = 0, fail_ns = 0, start;
+	int *fds, nr_fds = 0, holes = 0, fd, i, c;
+	unsigned long max;
+
+	while ((c = getopt_long(argc, argv, "D:i:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (iterations <= 0)
+		print_usage(argv[0]);
+
+	fd = pmem_open();
+	if (ioctl(fd, PMEM_GET_TOTAL_SIZE, &total) < 0)
+		pabort("PMEM_GET_TOTAL_SIZE");
+	close(fd);
+	max = total.len / pagesize;
+
+	/* one fd per page of the region */
+	rlim.rlim_cur = rlim.rlim_max = max + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rlim) < 0)
+		pabort("can't raise the fd limit, run as root");
+	fds = malloc(max * sizeof(*fds));
+	if (!fds)
+		pabort("malloc");
+
+	while (nr_fds < max) {
+		fd = pmem_open();
+		ioctl(fd, PMEM_ALLOCATE, pagesize);
+		if (!pmem_size(fd)) {
+			close(fd);
+			break;
+		}
+		fds[nr_fds++] = fd;
+	}
+	for (i = 0; i < nr_fds; i += 2, holes++)
+		close(fds[i]);
+	printf("%s: %lu pages, %d allocated, %d one-page holes\n", device,
+	       max, nr_fds, holes);
+	if (!holes)
+		return 1;
+
+	for (i = 0; i < iterations; i++) {
+		fd = pmem_open();
+		start = now_ns();
+		ioctl(fd, PMEM_ALLOCATE, pagesize);
+		alloc_ns += now_ns() - start;
+		start = now_ns();
+		close(fd);
+		free_ns += now_ns() - start;
+
+		fd = pmem_open();
+		start = now_ns();
+		ioctl(fd, PMEM_ALLOCATE, 2 * pagesize);
+		fail_ns += now_ns() - start;
+		if (pmem_size(fd))
+			printf("two-page allocation unexpectedly succeeded\n");
+		close(fd);
+	}
+	report("alloc one page", alloc_ns, iterations);
+	report("free one page", free_ns, iterations);
+	report("alloc two (fails)", fail_ns, iterations);
+
+	for (i = 1; i < nr_fds; i += 2)
+		close(fds[i]);
+	return 0;
+}
@@ -15,11 +15,16 @@
  *
  */
 
+#include <asm/atomic.h>
 #include <asm/cacheflush.h>
+#include <linux/android_pmem.h>
 #include <linux/binder.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/hrtimer.h>
 #include <linux/list.h>
+#include <linux/marker.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
@@ -29,18 +34,60 @@
 #include <linux/proc_fs.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking
+ *
+ * There is no global lock on the transaction path. Each binder_proc has
+ * three locks, which must be acquired in the order shown:
+ *
+ *  1) proc->outer_lock: mutex protecting the refs_by_desc and refs_by_node
+ *     trees and the reference counts and death notification of each
+ *     binder_ref in them.
+ *  2) node->lock: spinlock protecting node->proc, node->refs and the async
+ *     state of a binder_node.
+ *  3) proc->inner_lock: spinlock protecting the threads and nodes trees,
+ *     all todo lists of the proc (proc->todo, thread->todo, node->async_todo
+ *     and proc->delivered_death), proc->waiting_threads, proc->stealable,
+ *     thread->transaction_stack, the looper state and the reference
+ *     counts of the nodes owned by the proc.
+ *
+ * A lock of one proc may be nested inside a lock of a higher level of
+ * another proc, never inside a lock of the same or a lower level.
+ * proc->alloc_lock protects the buffer allocator of a proc and is never
+ * taken with a spinlock held. t->lock protects t->from.
+ *
+ * Functions ending in _olocked, _ilocked and _nilocked must be called with
+ * the outer lock, the inner lock, or the node lock and the inner lock of
+ * node->proc held.
+ *
+ * binder_procs_lock, binder_context_mgr_node_lock and binder_dead_nodes_lock
+ * protect the corresponding globals. binder_context_mgr_node_lock may be
+ * held while taking any per-proc lock.
+ */
+static DEFINE_MUTEX(binder_procs_lock);
 static HLIST_HEAD(binder_procs);
+static DEFINE_MUTEX(binder_context_mgr_node_lock);
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct proc_dir_entry *binder_proc_dir_entry_root;
 static struct proc_dir_entry *binder_proc_dir_entry_proc;
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
 static struct hlist_head binder_dead_nodes;
 
+/*
+ * Pages of freed buffers stay mapped and are queued here, oldest first,
+ * until a new buffer reuses them or binder_shrink() hands them back to
+ * the system. binder_lru_lock nests inside proc->alloc_lock.
+ */
+static DEFINE_SPINLOCK(binder_lru_lock);
+static LIST_HEAD(binder_lru_pages);
+static int binder_lru_count;
+
 static int binder_read_proc_proc(
 	char *page, char **start, off_t off, int count, int *eof, void *data);
 
@@ -84,6 +131,10 @@ static uint32_t binder_debug_mask = BINDER_DEBUG_USER_ERROR |
 module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO)
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO)
+static int binder_sg_ref_min = 64 * 1024;
+module_param_named(sg_ref_min, binder_sg_ref_min, int, S_IWUSR | S_IRUGO);
+static int binder_async_sender_quota = 50;
+module_param_named(async_sender_quota, binder_async_sender_quota, int, S_IWUSR | S_IRUGO);
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 static int binder_set_stop_on_user_error(
@@ -118,14 +169,53 @@ enum {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_TRANSACTION_COMPLETE_ALMOST_FULL) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
+	atomic_t sg_transactions;
+	atomic_long_t sg_bytes_copied; /* gathered from the sender */
+	atomic_long_t sg_bytes_by_ref; /* passed as an fd */
 };
 
 static struct binder_stats binder_stats;
 
+/*
+ * Transaction latency histograms in log2 buckets of microseconds: bucket
+ * 0 counts latencies under 1us, bucket i those in [2^(i-1), 2^i) us and
+ * the last bucket everything longer.
+ */
+#define BINDER_LATENCY_BUCKETS 24
+
+enum {
+	BINDER_LATENCY_DEQUEUE, /* send to dequeue by the target */
+	BINDER_LATENCY_REPLY, /* dequeue to reply by the target */
+	BINDER_LATENCY_ROUND_TRIP, /* send to dequeue of the reply */
+	BINDER_LATENCY_COUNT
+};
+
+static const char *binder_latency_strings[] = {
+	"send-dequeue",
+	"dequeue-reply",
+	"round-trip"
+};
+
+struct binder_latency {
+	atomic_t hist[BINDER_LATENCY_COUNT][BINDER_LATENCY_BUCKETS];
+};
+
+static struct binder_latency binder_latency;
+
+static inline void binder_stats_deleted(int type)
+{
+	atomic_inc(&binder_stats.obj_deleted[type]);
+}
+
+static inline void binder_stats_created(int type)
+{
+	atomic_inc(&binder_stats.obj_created[type]);
+}
+
 struct binder_transaction_log_entry {
 	int debug_id;
 	int call_type;
@@ -139,24 +229,27 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-struct binder_transaction_log binder_transaction_log;
-struct binder_transaction_log binder_transaction_log_failed;
+struct binder_transaction_log binder_transaction_log = {
+	.cur = ATOMIC_INIT(~0U),
+};
+struct binder_transaction_log binder_transaction_log_failed = {
+	.cur = ATOMIC_INIT(~0U),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur);
+
+	if (cur >= ARRAY_SIZE(log->entry))
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -165,6 +258,7 @@ struct binder_work {
 	enum {
 		BINDER_WORK_TRANSACTION = 1,
 		BINDER_WORK_TRANSACTION_COMPLETE,
+		BINDER_WORK_TRANSACTION_COMPLETE_ALMOST_FULL,
 		BINDER_WORK_NODE,
 		BINDER_WORK_DEAD_BINDER,
 		BINDER_WORK_DEAD_BINDER_AND_CLEAR,
@@ -174,6 +268,7 @@ struct binder_work {
 
 struct binder_node {
 	int debug_id;
+	spinlock_t lock;
 	struct binder_work work;
 	union {
 		struct rb_node rb_node;
@@ -181,6 +276,7 @@ struct binder_node {
 	};
 	struct binder_proc *proc;
 	struct hlist_head refs;
+	int tmp_refs; /* kernel refs held without a lock, not seen by user */
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
@@ -228,19 +324,101 @@ struct binder_buffer {
 	unsigned debug_id : 29;
 
 	struct binder_transaction *transaction;
+	struct binder_slab *slab; /* NULL unless carved from a slab */
 
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
+	size_t extra_buffers_size; /* BINDER_TYPE_PTR buffers after offsets */
+	struct binder_async_sender *async_sender;
 	uint8_t data[0];
 };
 
+/*
+ * Async space a sender holds in a target proc. A sender may hold at most
+ * async_sender_quota percent of the async space of the target, so one
+ * chatty client cannot starve the others. Protected by proc->alloc_lock
+ * of the target.
+ */
+struct binder_async_sender {
+	struct rb_node rb_node;
+	int pid;
+	size_t size;
+};
+
+/*
+ * Small transactions are served from per-proc slabs: page sized buffers
+ * taken from the free tree once and cut into equal slots, each starting
+ * with its own struct binder_buffer. Slots are handed out and returned
+ * through a free list without touching the free tree or the page tables.
+ */
+#define BINDER_SLAB_SIZE	PAGE_SIZE
+#define BINDER_SLAB_CLASSES	3
+
+static const size_t binder_slab_class_size[BINDER_SLAB_CLASSES] = {
+	64, 128, 256
+};
+
+struct binder_slab {
+	struct list_head entry; /* on slab list of its class unless full */
+	struct binder_buffer *buffer; /* backing buffer from the free tree */
+	struct list_head free_slots;
+	size_t slot_size;
+	int size_class;
+	int nr_slots;
+	int nr_free;
+};
+
+struct binder_slab_list {
+	struct list_head slabs; /* partially used first, empty at the tail */
+	int empty; /* completely free slabs on the list */
+	int nr_slabs;
+	int in_use; /* allocated slots */
+};
+
+struct binder_lru_page {
+	struct list_head lru; /* on binder_lru_pages while cached */
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
+/*
+ * Scheduling policy and kernel priority (task->normal_prio) of a thread.
+ * Lower prio values are more important, so RT threads always compare
+ * below normal ones.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
+/*
+ * Object translation in binder_transaction looks up nodes by ptr and refs
+ * by desc and by node for every flattened object. A small direct-mapped
+ * cache per proc catches the repeated lookups before the rb-tree walk.
+ */
+#define BINDER_LOOKUP_CACHE_BITS 5
+#define BINDER_LOOKUP_CACHE_SIZE (1 << BINDER_LOOKUP_CACHE_BITS)
+
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex outer_lock;
+	spinlock_t inner_lock;
+	struct mutex alloc_lock;
+	int tmp_ref;
+	int is_dead;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
 	struct rb_root refs_by_node;
+	/* direct-mapped caches in front of the trees above */
+	struct binder_node *node_cache[BINDER_LOOKUP_CACHE_SIZE];
+	struct binder_ref *ref_desc_cache[BINDER_LOOKUP_CACHE_SIZE];
+	struct binder_ref *ref_node_cache[BINDER_LOOKUP_CACHE_SIZE];
+	int node_cache_hits;
+	int node_cache_misses;
+	int ref_cache_hits;
+	int ref_cache_misses;
 	int pid;
 	struct vm_area_struct *vma;
 	struct task_struct *tsk;
@@ -251,19 +429,34 @@ struct binder_proc {
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
-
-	struct page **pages;
+	size_t async_space;
+	struct rb_root async_senders;
+	int async_throttle; /* wants BR_TRANSACTION_COMPLETE_ALMOST_FULL */
+	atomic_t async_rejected; /* one-way transactions of this sender */
+	atomic_long_t async_rejected_bytes;
+	atomic_t async_almost_full;
+	struct binder_slab_list slabs[BINDER_SLAB_CLASSES];
+
+	struct binder_lru_page *pages;
+	int pages_allocated; /* mapped pages, including cached ones */
+	int pages_cached; /* mapped pages not used by any buffer */
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
+	struct list_head waiting_threads; /* most recently idle first */
+	struct list_head stealable; /* async work an idle thread may take */
 	struct binder_stats stats;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	int nr_wakeups; /* threads woken for proc work */
+	int nr_proc_work; /* proc work items handled */
+	int nr_stolen; /* async work taken from a sibling's todo */
+	struct binder_latency latency;
+	struct binder_priority default_priority;
 };
 
 enum {
@@ -279,7 +472,10 @@ struct binder_thread {
 	struct binder_proc *proc;
 	struct rb_node rb_node;
 	int pid;
+	struct task_struct *task;
 	int looper;
+	struct list_head waiting_thread_node;
+	int last_cpu; /* cpu it last went idle on */
 	struct binder_transaction *transaction_stack;
 	struct list_head todo;
 	uint32_t return_error; /* Write failed, return error code in read buf */
@@ -288,10 +484,13 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	atomic_t tmp_ref;
+	int is_dead;
 };
 
 struct binder_transaction {
 	int debug_id;
+	spinlock_t lock;
 	struct binder_work work;
 	struct binder_thread *from;
 	struct binder_transaction *from_parent;
@@ -300,15 +499,114 @@ struct binder_transaction {
 	struct binder_transaction *to_parent;
 	unsigned need_reply : 1;
 	/*unsigned is_dead : 1;*/ /* not used at the moment */
+	unsigned set_priority_called : 1; /* target boosted at enqueue */
 
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	send_time;
+	ktime_t	dequeue_time;
+	ktime_t	call_time; /* send_time of the call a reply answers */
+	/* on proc->stealable while on parked_on's todo, see
+	 * binder_find_async_work_ilocked */
+	struct list_head stealable_entry;
+	struct binder_thread *parked_on;
 };
 
+static inline void binder_proc_lock(struct binder_proc *proc)
+{
+	mutex_lock(&proc->outer_lock);
+}
+
+static inline void binder_proc_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->outer_lock);
+}
+
+static inline void binder_inner_proc_lock(struct binder_proc *proc)
+{
+	spin_lock(&proc->inner_lock);
+}
+
+static inline void binder_inner_proc_unlock(struct binder_proc *proc)
+{
+	spin_unlock(&proc->inner_lock);
+}
+
+static inline void binder_node_lock(struct binder_node *node)
+{
+	spin_lock(&node->lock);
+}
+
+static inline void binder_node_unlock(struct binder_node *node)
+{
+	spin_unlock(&node->lock);
+}
+
+/* node->proc can only be cleared with both locks held */
+static void binder_node_inner_lock(struct binder_node *node)
+{
+	spin_lock(&node->lock);
+	if (node->proc)
+		binder_inner_proc_lock(node->proc);
+}
+
+static void binder_node_inner_unlock(struct binder_node *node)
+{
+	if (node->proc)
+		binder_inner_proc_unlock(node->proc);
+	spin_unlock(&node->lock);
+}
+
+static s64
+binder_latency_add(struct binder_proc *proc, int type, ktime_t start,
+		   ktime_t now)
+{
+	s64 us = ktime_us_delta(now, start);
+	int bucket;
+
+	if (us <= 0)
+		bucket = 0;
+	else if (us >= 1LL << (BINDER_LATENCY_BUCKETS - 2))
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	else
+		bucket = fls((int)us);
+	atomic_inc(&binder_latency.hist[type][bucket]);
+	atomic_inc(&proc->latency.hist[type][bucket]);
+	return us;
+}
+
+/*
+ * Wake exactly one thread for new work on proc->todo: an idle looper that
+ * last ran on this cpu if there is one, else the one that went idle most
+ * recently. The thread is taken off waiting_threads so the next work item
+ * wakes a different one. With no idle looper, wake poll()ers instead.
+ */
+static void binder_wakeup_proc_ilocked(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *target = NULL;
+	int cpu = raw_smp_processor_id();
+
+	list_for_each_entry(thread, &proc->waiting_threads, waiting_thread_node) {
+		if (thread->last_cpu == cpu) {
+			target = thread;
+			break;
+		}
+		if (target == NULL)
+			target = thread;
+	}
+	if (target) {
+		list_del_init(&target->waiting_thread_node);
+		proc->nr_wakeups++;
+		wake_up_interruptible(&target->wait);
+	} else
+		wake_up_interruptible(&proc->wait);
+}
+
 /*
  * copied from get_unused_fd_flags
  */
@@ -468,6 +766,84 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static inline int binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static inline int binder_nice_to_prio(long nice)
+{
+	return MAX_RT_PRIO + nice + 20;
+}
+
+static inline long binder_prio_to_nice(int prio)
+{
+	return prio - MAX_RT_PRIO - 20;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	p.sched_policy = task->policy;
+	p.prio = task->normal_prio;
+	return p;
+}
+
+/*
+ * Give task the policy and priority in desired. RT priorities are lent
+ * without a permission check, they come from a caller that holds them.
+ * A nice value current may not set itself is capped at RLIMIT_NICE if
+ * verify is set; that is only used when task is current.
+ */
+static void binder_set_priority(struct task_struct *task,
+				struct binder_priority desired, int verify)
+{
+	struct sched_param params;
+
+	if (task->policy == desired.sched_policy &&
+	    task->normal_prio == desired.prio)
+		return;
+	if (binder_is_rt_policy(desired.sched_policy)) {
+		params.sched_priority = MAX_RT_PRIO - 1 - desired.prio;
+		sched_setscheduler_nocheck(task, desired.sched_policy, &params);
+		return;
+	}
+	if (task->policy != desired.sched_policy) {
+		params.sched_priority = 0;
+		sched_setscheduler_nocheck(task, desired.sched_policy, &params);
+	}
+	if (verify)
+		binder_set_nice(binder_prio_to_nice(desired.prio));
+	else
+		set_user_nice(task, binder_prio_to_nice(desired.prio));
+}
+
+/*
+ * Move the thread serving t to the priority of the caller, or to the
+ * min_priority of the node if that is higher. Like a PI chain, this goes
+ * on hop by hop: a call made while serving t carries the inherited
+ * priority. One-way calls are only raised to the node's min_priority.
+ */
+static void binder_transaction_priority(struct task_struct *task,
+					struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority desired = t->priority;
+	struct binder_priority node_prio;
+
+	node_prio.sched_policy = SCHED_NORMAL;
+	node_prio.prio = binder_nice_to_prio(node->min_priority);
+	if (t->flags & TF_ONE_WAY) {
+		if (t->saved_priority.prio > node_prio.prio)
+			binder_set_priority(task, node_prio, 1);
+		return;
+	}
+	if (desired.prio > node_prio.prio)
+		desired = node_prio;
+	binder_set_priority(task, desired, 1);
+}
+
 static size_t binder_buffer_size(
 	struct binder_proc *proc, struct binder_buffer *buffer)
 {
@@ -560,14 +936,39 @@ static struct binder_buffer *binder_buffer_lookup(
 	return NULL;
 }
 
+/* called with proc->alloc_lock held */
+static void binder_lru_add_range(struct binder_proc *proc,
+	void *start, void *end)
+{
+	void *page_addr;
+	struct binder_lru_page *page;
+
+	spin_lock(&binder_lru_lock);
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->page_ptr == NULL || !list_empty(&page->lru))
+			continue;
+		list_add_tail(&page->lru, &binder_lru_pages);
+		binder_lru_count++;
+		proc->pages_cached++;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
+/*
+ * Freeing a range only moves its pages to the lru, they stay mapped in
+ * the kernel and in userspace. Allocating a range takes cached pages back
+ * off the lru and only needs the mm for pages that are not mapped.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *start, void *end, struct vm_area_struct *vma)
 {
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
+	struct binder_lru_page *page;
 	struct mm_struct *mm;
+	int need_map = 0;
 
 	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
 		printk(KERN_INFO "binder: %d: %s pages %p-%p\n",
@@ -576,6 +977,28 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	if (allocate == 0) {
+		binder_lru_add_range(proc, start, end);
+		return 0;
+	}
+
+	spin_lock(&binder_lru_lock);
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->page_ptr == NULL) {
+			need_map = 1;
+			continue;
+		}
+		/* a mapped page in a new range must be unused */
+		BUG_ON(list_empty(&page->lru));
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		proc->pages_cached--;
+	}
+	spin_unlock(&binder_lru_lock);
+	if (!need_map)
+		return 0;
+
 	if (vma)
 		mm = NULL;
 	else
@@ -586,9 +1009,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -600,16 +1020,17 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr)
+			continue;
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -618,13 +1039,14 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_map_kernel_failed;
 		}
 		user_page_addr = (size_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
 			       proc->pid, user_page_addr);
 			goto err_vm_insert_page_failed;
 		}
+		proc->pages_allocated++;
 		/* vm_insert_page does not seem to increment the refcount */
 	}
 	if (mm) {
@@ -633,22 +1055,15 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (size_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
 err_no_vma:
+	/* whatever is mapped in the range is unused again */
+	binder_lru_add_range(proc, start, end);
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
@@ -656,8 +1071,217 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-	size_t data_size, size_t offsets_size, int is_async)
+/*
+ * Unmap and free one cached page. Called with binder_lru_lock held, which
+ * is dropped. The locks of the owning proc and its mm are only tried, as
+ * reclaim may run with either of them held.
+ */
+static int binder_lru_free_page(struct binder_lru_page *page)
+{
+	struct binder_proc *proc = page->proc;
+	void *page_addr;
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+
+	/* the proc cannot be freed while its page is on the lru */
+	if (!mutex_trylock(&proc->alloc_lock)) {
+		list_move_tail(&page->lru, &binder_lru_pages);
+		spin_unlock(&binder_lru_lock);
+		return 0;
+	}
+	list_del_init(&page->lru);
+	binder_lru_count--;
+	proc->pages_cached--;
+	spin_unlock(&binder_lru_lock);
+
+	page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		if (!down_write_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			binder_lru_add_range(proc, page_addr,
+					     page_addr + PAGE_SIZE);
+			mutex_unlock(&proc->alloc_lock);
+			return 0;
+		}
+		vma = proc->vma;
+		if (vma)
+			zap_page_range(vma, (size_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+	proc->pages_allocated--;
+	mutex_unlock(&proc->alloc_lock);
+	return 1;
+}
+
+static int binder_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	int count;
+
+	while (nr_to_scan-- > 0) {
+		spin_lock(&binder_lru_lock);
+		if (list_empty(&binder_lru_pages)) {
+			spin_unlock(&binder_lru_lock);
+			break;
+		}
+		binder_lru_free_page(list_first_entry(&binder_lru_pages,
+			struct binder_lru_page, lru));
+	}
+	spin_lock(&binder_lru_lock);
+	count = binder_lru_count;
+	spin_unlock(&binder_lru_lock);
+	return count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+	size_t data_size, size_t offsets_size, size_t extra_buffers_size,
+	int is_async);
+static void binder_free_buf_locked(
+	struct binder_proc *proc, struct binder_buffer *buffer);
+
+static int binder_slab_class(size_t size)
+{
+	int i;
+
+	for (i = 0; i < BINDER_SLAB_CLASSES - 1; i++)
+		if (size <= binder_slab_class_size[i])
+			break;
+	return i;
+}
+
+static struct binder_slab *binder_slab_create(
+	struct binder_proc *proc, int size_class)
+{
+	struct binder_slab_list *sl = &proc->slabs[size_class];
+	struct binder_slab *slab;
+	struct binder_buffer *buffer;
+	int i;
+
+	slab = kzalloc(sizeof(*slab), GFP_KERNEL);
+	if (slab == NULL)
+		return NULL;
+	/* larger than any slab class, so this comes from the free tree */
+	buffer = binder_alloc_buf_locked(proc, BINDER_SLAB_SIZE, 0, 0, 0);
+	if (buffer == NULL) {
+		kfree(slab);
+		return NULL;
+	}
+	/* slots are looked up in allocated_buffers, the backing buffer is not */
+	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
+	buffer->allow_user_free = 0;
+	buffer->transaction = NULL;
+	buffer->target_node = NULL;
+
+	slab->buffer = buffer;
+	slab->size_class = size_class;
+	slab->slot_size = ALIGN(sizeof(struct binder_buffer) +
+				binder_slab_class_size[size_class],
+				sizeof(void *));
+	slab->nr_slots = BINDER_SLAB_SIZE / slab->slot_size;
+	INIT_LIST_HEAD(&slab->free_slots);
+	for (i = 0; i < slab->nr_slots; i++) {
+		struct binder_buffer *slot = (void *)buffer->data +
+			i * slab->slot_size;
+
+		memset(slot, 0, sizeof(*slot));
+		slot->free = 1;
+		slot->slab = slab;
+		list_add_tail(&slot->entry, &slab->free_slots);
+	}
+	slab->nr_free = slab->nr_slots;
+	list_add_tail(&slab->entry, &sl->slabs);
+	sl->empty++;
+	sl->nr_slabs++;
+	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
+		printk(KERN_INFO "binder: %d: new slab %p, %d slots of %d\n",
+		       proc->pid, buffer, slab->nr_slots, slab->slot_size);
+	return slab;
+}
+
+static void binder_slab_destroy(
+	struct binder_proc *proc, struct binder_slab *slab)
+{
+	struct binder_slab_list *sl = &proc->slabs[slab->size_class];
+
+	BUG_ON(slab->nr_free != slab->nr_slots);
+	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
+		printk(KERN_INFO "binder: %d: free slab %p\n",
+		       proc->pid, slab->buffer);
+	list_del(&slab->entry);
+	sl->empty--;
+	sl->nr_slabs--;
+	binder_insert_allocated_buffer(proc, slab->buffer);
+	binder_free_buf_locked(proc, slab->buffer);
+	kfree(slab);
+}
+
+static struct binder_buffer *binder_slab_alloc(
+	struct binder_proc *proc, size_t size)
+{
+	int size_class = binder_slab_class(size);
+	struct binder_slab_list *sl = &proc->slabs[size_class];
+	struct binder_slab *slab;
+	struct binder_buffer *buffer;
+
+	if (list_empty(&sl->slabs)) {
+		slab = binder_slab_create(proc, size_class);
+		if (slab == NULL)
+			return NULL;
+	} else
+		slab = list_first_entry(&sl->slabs, struct binder_slab, entry);
+
+	if (slab->nr_free == slab->nr_slots)
+		sl->empty--;
+	buffer = list_first_entry(&slab->free_slots, struct binder_buffer,
+				  entry);
+	list_del_init(&buffer->entry);
+	if (--slab->nr_free == 0)
+		list_del_init(&slab->entry);
+	sl->in_use++;
+	buffer->free = 0;
+	binder_insert_allocated_buffer(proc, buffer);
+	return buffer;
+}
+
+/*
+ * One completely free slab per class is kept so that a proc doing one
+ * small transaction at a time does not create and destroy a slab (and
+ * map and unmap its page) on every call.
+ */
+static void binder_slab_free(
+	struct binder_proc *proc, struct binder_buffer *buffer)
+{
+	struct binder_slab *slab = buffer->slab;
+	struct binder_slab_list *sl = &proc->slabs[slab->size_class];
+
+	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
+	buffer->free = 1;
+	list_add(&buffer->entry, &slab->free_slots);
+	sl->in_use--;
+	if (slab->nr_free++ == 0)
+		list_add(&slab->entry, &sl->slabs);
+	if (slab->nr_free == slab->nr_slots) {
+		sl->empty++;
+		if (sl->empty > 1)
+			binder_slab_destroy(proc, slab);
+		else
+			list_move_tail(&slab->entry, &sl->slabs);
+	}
+}
+
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+	size_t data_size, size_t offsets_size, size_t extra_buffers_size,
+	int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -681,6 +1305,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			"size %d-%d\n", proc->pid, data_size, offsets_size);
 		return NULL;
 	}
+	size += ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < extra_buffers_size) {
+		binder_user_error("binder: %d: got transaction with invalid "
+			"extra buffers size %d\n", proc->pid,
+			extra_buffers_size);
+		return NULL;
+	}
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -690,6 +1321,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	if (size <= binder_slab_class_size[BINDER_SLAB_CLASSES - 1]) {
+		buffer = binder_slab_alloc(proc, size);
+		if (buffer)
+			goto got_buffer;
+		/* no room for a new slab, fall back to the free tree */
+	}
+
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
@@ -740,13 +1378,17 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		struct binder_buffer *new_buffer = (void *)buffer->data + size;
 		list_add(&new_buffer->entry, &buffer->entry);
 		new_buffer->free = 1;
+		new_buffer->slab = NULL;
 		binder_insert_free_buffer(proc, new_buffer);
 	}
+got_buffer:
 	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
 		printk(KERN_INFO "binder: %d: binder_alloc_buf size %d got "
 		       "%p\n", proc->pid, size, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
+	buffer->async_sender = NULL;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -759,6 +1401,96 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_async_sender *
+binder_get_async_sender_locked(struct binder_proc *proc, int pid)
+{
+	struct rb_node **p = &proc->async_senders.rb_node;
+	struct rb_node *parent = NULL;
+	struct binder_async_sender *sender;
+
+	while (*p) {
+		parent = *p;
+		sender = rb_entry(parent, struct binder_async_sender, rb_node);
+
+		if (pid < sender->pid)
+			p = &(*p)->rb_left;
+		else if (pid > sender->pid)
+			p = &(*p)->rb_right;
+		else
+			return sender;
+	}
+	sender = kzalloc(sizeof(*sender), GFP_KERNEL);
+	if (sender == NULL)
+		return NULL;
+	sender->pid = pid;
+	rb_link_node(&sender->rb_node, parent, p);
+	rb_insert_color(&sender->rb_node, &proc->async_senders);
+	return sender;
+}
+
+static void binder_put_async_sender_locked(struct binder_proc *proc,
+	struct binder_async_sender *sender)
+{
+	if (sender->size)
+		return;
+	rb_erase(&sender->rb_node, &proc->async_senders);
+	kfree(sender);
+}
+
+/*
+ * For a one-way transaction from sender_pid, also charge the sender's
+ * quota and set *almost_full if less than a quarter of that quota, or of
+ * the async space of proc, is left afterwards.
+ */
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+	size_t data_size, size_t offsets_size, size_t extra_buffers_size,
+	int is_async, int sender_pid, int *almost_full)
+{
+	struct binder_buffer *buffer;
+	struct binder_async_sender *sender = NULL;
+	size_t size = 0, quota = 0;
+
+	mutex_lock(&proc->alloc_lock);
+	if (is_async) {
+		size = ALIGN(data_size, sizeof(void *)) +
+			ALIGN(offsets_size, sizeof(void *)) +
+			ALIGN(extra_buffers_size, sizeof(void *)) +
+			sizeof(struct binder_buffer);
+		quota = proc->async_space * binder_async_sender_quota / 100;
+		sender = binder_get_async_sender_locked(proc, sender_pid);
+		if (sender == NULL) {
+			buffer = NULL;
+			goto out;
+		}
+		if (sender->size + size > quota ||
+		    sender->size + size < size) {
+			if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC_ASYNC)
+				printk(KERN_ERR "binder: %d: binder_alloc_buf "
+				       "size %d failed, sender %d holds %d of "
+				       "quota %d\n", proc->pid, size,
+				       sender_pid, sender->size, quota);
+			binder_put_async_sender_locked(proc, sender);
+			buffer = NULL;
+			goto out;
+		}
+	}
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 extra_buffers_size, is_async);
+	if (sender) {
+		if (buffer == NULL) {
+			binder_put_async_sender_locked(proc, sender);
+			goto out;
+		}
+		sender->size += size;
+		buffer->async_sender = sender;
+		*almost_full = quota - sender->size < quota / 4 ||
+			proc->free_async_space < proc->async_space / 4;
+	}
+out:
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((size_t)buffer & PAGE_MASK);
@@ -816,15 +1548,20 @@ static void binder_delete_free_buffer(
 	}
 }
 
-static void binder_free_buf(
+static void binder_free_buf_locked(
 	struct binder_proc *proc, struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
-	buffer_size = binder_buffer_size(proc, buffer);
+	if (buffer->slab)
+		buffer_size = buffer->slab->slot_size -
+			sizeof(struct binder_buffer);
+	else
+		buffer_size = binder_buffer_size(proc, buffer);
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		ALIGN(buffer->extra_buffers_size, sizeof(void *));
 	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
 		printk(KERN_INFO "binder: %d: binder_free_buf %p size %d buffer"
 		       "_size %d\n", proc->pid, buffer, size, buffer_size);
@@ -837,12 +1574,24 @@ static void binder_free_buf(
 
 	if (buffer->async_transaction) {
 		proc->free_async_space += size + sizeof(struct binder_buffer);
+		if (buffer->async_sender) {
+			buffer->async_sender->size -=
+				size + sizeof(struct binder_buffer);
+			binder_put_async_sender_locked(proc,
+						       buffer->async_sender);
+			buffer->async_sender = NULL;
+		}
 		if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC_ASYNC)
 			printk(KERN_INFO "binder: %d: binder_free_buf size %d "
 			       "async free %d\n", proc->pid, size,
 			       proc->free_async_space);
 	}
 
+	if (buffer->slab) {
+		binder_slab_free(proc, buffer);
+		return;
+	}
+
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((size_t)buffer->data),
 		(void *)(((size_t)buffer->data + buffer_size) & PAGE_MASK),
@@ -869,12 +1618,73 @@ static void binder_free_buf(
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(
+	struct binder_proc *proc, struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	binder_free_buf_locked(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
+/*
+ * Look up the buffer userspace wants to free and clear allow_user_free so
+ * that a second BC_FREE_BUFFER racing with this one cannot find it.
+ */
+static struct binder_buffer *binder_prepare_to_free(
+	struct binder_proc *proc, struct binder_thread *thread,
+	void __user *data_ptr)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = binder_buffer_lookup(proc, data_ptr);
+	if (buffer == NULL) {
+		binder_user_error("binder: %d:%d "
+			"BC_FREE_BUFFER u%p no match\n",
+			proc->pid, thread->pid, data_ptr);
+	} else if (!buffer->allow_user_free) {
+		binder_user_error("binder: %d:%d "
+			"BC_FREE_BUFFER u%p matched "
+			"unreturned buffer\n",
+			proc->pid, thread->pid, data_ptr);
+		buffer = NULL;
+	} else
+		buffer->allow_user_free = 0;
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
+static void binder_free_node(struct binder_node *node)
+{
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+static void binder_inc_node_tmpref_ilocked(struct binder_node *node)
+{
+	node->tmp_refs++;
+}
+
+static struct binder_node **
+binder_node_cache_slot(struct binder_proc *proc, void __user *ptr)
+{
+	return &proc->node_cache[hash_ptr((void *)ptr, BINDER_LOOKUP_CACHE_BITS)];
+}
+
 static struct binder_node *
-binder_get_node(struct binder_proc *proc, void __user *ptr)
+binder_get_node_ilocked(struct binder_proc *proc, void __user *ptr)
 {
+	struct binder_node **slot = binder_node_cache_slot(proc, ptr);
 	struct rb_node *n = proc->nodes.rb_node;
 	struct binder_node *node;
 
+	node = *slot;
+	if (node && node->ptr == ptr) {
+		proc->node_cache_hits++;
+		binder_inc_node_tmpref_ilocked(node);
+		return node;
+	}
+	proc->node_cache_misses++;
 	while (n) {
 		node = rb_entry(n, struct binder_node, rb_node);
 
@@ -882,19 +1692,54 @@ binder_get_node(struct binder_proc *proc, void __user *ptr)
 			n = n->rb_left;
 		else if (ptr > node->ptr)
 			n = n->rb_right;
-		else
+		else {
+			*slot = node;
+			binder_inc_node_tmpref_ilocked(node);
 			return node;
+		}
 	}
 	return NULL;
 }
 
+static void
+binder_erase_node_ilocked(struct binder_proc *proc, struct binder_node *node)
+{
+	struct binder_node **slot = binder_node_cache_slot(proc, node->ptr);
+
+	if (*slot == node)
+		*slot = NULL;
+	rb_erase(&node->rb_node, &proc->nodes);
+}
+
+/* returns the node with a tmp ref, drop it with binder_put_node */
+static struct binder_node *
+binder_get_node(struct binder_proc *proc, void __user *ptr)
+{
+	struct binder_node *node;
+
+	binder_inner_proc_lock(proc);
+	node = binder_get_node_ilocked(proc, ptr);
+	binder_inner_proc_unlock(proc);
+	return node;
+}
+
+/*
+ * Returns the node for ptr with a tmp ref, creating it if needed. If
+ * another thread created the node first, the existing node is returned.
+ */
 static struct binder_node *
-binder_new_node(struct binder_proc *proc, void __user *ptr, void __user *cookie)
+binder_new_node(struct binder_proc *proc, void __user *ptr, void __user *cookie,
+		unsigned long flags)
 {
 	struct rb_node **p = &proc->nodes.rb_node;
 	struct rb_node *parent = NULL;
-	struct binder_node *node;
+	struct binder_node *node, *new_node;
 
+	new_node = kzalloc(sizeof(*new_node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
+
+	binder_inner_proc_lock(proc);
 	while (*p) {
 		parent = *p;
 		node = rb_entry(parent, struct binder_node, rb_node);
@@ -903,23 +1748,29 @@ binder_new_node(struct binder_proc *proc, void __user *ptr, void __user *cookie)
 			p = &(*p)->rb_left;
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
-		else
-			return NULL;
+		else {
+			binder_inc_node_tmpref_ilocked(node);
+			binder_inner_proc_unlock(proc);
+			kfree(new_node);
+			return node;
+		}
 	}
-
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
-	binder_stats.obj_created[BINDER_STAT_NODE]++;
+	node = new_node;
+	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
+	spin_lock_init(&node->lock);
+	node->tmp_refs = 1;
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
+	node->min_priority = flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+	node->accept_fds = !!(flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 	node->work.type = BINDER_WORK_NODE;
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
+	binder_inner_proc_unlock(proc);
 	if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 		printk(KERN_INFO "binder: %d:%d node %d u%p c%p created\n",
 		       proc->pid, current->pid, node->debug_id,
@@ -928,8 +1779,8 @@ binder_new_node(struct binder_proc *proc, void __user *ptr, void __user *cookie)
 }
 
 static int
-binder_inc_node(struct binder_node *node, int strong, int internal,
-		struct list_head *target_list)
+binder_inc_node_nilocked(struct binder_node *node, int strong, int internal,
+			 struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -964,8 +1815,23 @@ binder_inc_node(struct binder_node *node, int strong, int internal,
 }
 
 static int
-binder_dec_node(struct binder_node *node, int strong, int internal)
+binder_inc_node(struct binder_node *node, int strong, int internal,
+		struct list_head *target_list)
 {
+	int ret;
+
+	binder_node_inner_lock(node);
+	ret = binder_inc_node_nilocked(node, strong, internal, target_list);
+	binder_node_inner_unlock(node);
+	return ret;
+}
+
+/* returns 1 if the node is no longer referenced and must be freed */
+static int
+binder_dec_node_nilocked(struct binder_node *node, int strong, int internal)
+{
+	struct binder_proc *proc = node->proc;
+
 	if (strong) {
 		if (internal)
 			node->internal_strong_refs--;
@@ -976,42 +1842,136 @@ binder_dec_node(struct binder_node *node, int strong, int internal)
 	} else {
 		if (!internal)
 			node->local_weak_refs--;
-		if (node->local_weak_refs || !hlist_empty(&node->refs))
+		if (node->local_weak_refs || node->tmp_refs ||
+		    !hlist_empty(&node->refs))
 			return 0;
 	}
-	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+	if (proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
-			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			list_add_tail(&node->work.entry, &proc->todo);
+			binder_wakeup_proc_ilocked(proc);
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
+		    !node->local_weak_refs && !node->tmp_refs) {
+			if (proc) {
+				list_del_init(&node->work.entry);
+				binder_erase_node_ilocked(proc, node);
 				if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 					printk(KERN_INFO "binder: refless node %d deleted\n", node->debug_id);
 			} else {
+				BUG_ON(!list_empty(&node->work.entry));
+				spin_lock(&binder_dead_nodes_lock);
+				/* the dead node list printer takes tmp refs */
+				if (node->tmp_refs) {
+					spin_unlock(&binder_dead_nodes_lock);
+					return 0;
+				}
 				hlist_del(&node->dead_node);
+				spin_unlock(&binder_dead_nodes_lock);
 				if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 					printk(KERN_INFO "binder: dead node %d deleted\n", node->debug_id);
 			}
-			kfree(node);
-			binder_stats.obj_deleted[BINDER_STAT_NODE]++;
+			return 1;
 		}
 	}
 
 	return 0;
 }
 
+static void
+binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	int free_node;
+
+	binder_node_inner_lock(node);
+	free_node = binder_dec_node_nilocked(node, strong, internal);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+/* tmp_refs of a dead node are protected by binder_dead_nodes_lock */
+static void binder_inc_node_tmpref(struct binder_node *node)
+{
+	binder_node_lock(node);
+	if (node->proc)
+		binder_inner_proc_lock(node->proc);
+	else
+		spin_lock(&binder_dead_nodes_lock);
+	binder_inc_node_tmpref_ilocked(node);
+	if (node->proc)
+		binder_inner_proc_unlock(node->proc);
+	else
+		spin_unlock(&binder_dead_nodes_lock);
+	binder_node_unlock(node);
+}
+
+static void binder_put_node(struct binder_node *node)
+{
+	int free_node;
+
+	binder_node_inner_lock(node);
+	if (!node->proc)
+		spin_lock(&binder_dead_nodes_lock);
+	node->tmp_refs--;
+	BUG_ON(node->tmp_refs < 0);
+	if (!node->proc)
+		spin_unlock(&binder_dead_nodes_lock);
+	/* a weak internal dec only checks whether the node is unused */
+	free_node = binder_dec_node_nilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+/*
+ * Take the strong ref a transaction holds on its target node, a tmp ref on
+ * the node and a tmp ref on the proc owning it. Returns NULL if the node is
+ * dead.
+ */
+static struct binder_node *binder_get_node_refs_for_txn(
+	struct binder_node *node, struct binder_proc **procp)
+{
+	struct binder_node *target_node = NULL;
+
+	binder_node_inner_lock(node);
+	if (node->proc) {
+		target_node = node;
+		binder_inc_node_nilocked(node, 1, 0, NULL);
+		binder_inc_node_tmpref_ilocked(node);
+		node->proc->tmp_ref++;
+		*procp = node->proc;
+	}
+	binder_node_inner_unlock(node);
+	return target_node;
+}
+
+static struct binder_ref **
+binder_ref_desc_cache_slot(struct binder_proc *proc, uint32_t desc)
+{
+	return &proc->ref_desc_cache[desc & (BINDER_LOOKUP_CACHE_SIZE - 1)];
+}
+
+static struct binder_ref **
+binder_ref_node_cache_slot(struct binder_proc *proc, struct binder_node *node)
+{
+	return &proc->ref_node_cache[hash_ptr(node, BINDER_LOOKUP_CACHE_BITS)];
+}
 
 static struct binder_ref *
-binder_get_ref(struct binder_proc *proc, uint32_t desc)
+binder_get_ref_olocked(struct binder_proc *proc, uint32_t desc)
 {
+	struct binder_ref **slot = binder_ref_desc_cache_slot(proc, desc);
 	struct rb_node *n = proc->refs_by_desc.rb_node;
 	struct binder_ref *ref;
 
+	ref = *slot;
+	if (ref && ref->desc == desc) {
+		proc->ref_cache_hits++;
+		return ref;
+	}
+	proc->ref_cache_misses++;
 	while (n) {
 		ref = rb_entry(n, struct binder_ref, rb_node_desc);
 
@@ -1019,20 +1979,30 @@ binder_get_ref(struct binder_proc *proc, uint32_t desc)
 			n = n->rb_left;
 		else if (desc > ref->desc)
 			n = n->rb_right;
-		else
+		else {
+			*slot = ref;
 			return ref;
+		}
 	}
 	return NULL;
 }
 
 static struct binder_ref *
-binder_get_ref_for_node(struct binder_proc *proc, struct binder_node *node)
+binder_get_ref_for_node_olocked(struct binder_proc *proc,
+				struct binder_node *node)
 {
+	struct binder_ref **slot = binder_ref_node_cache_slot(proc, node);
 	struct rb_node *n;
 	struct rb_node **p = &proc->refs_by_node.rb_node;
 	struct rb_node *parent = NULL;
 	struct binder_ref *ref, *new_ref;
 
+	ref = *slot;
+	if (ref && ref->node == node) {
+		proc->ref_cache_hits++;
+		return ref;
+	}
+	proc->ref_cache_misses++;
 	while (*p) {
 		parent = *p;
 		ref = rb_entry(parent, struct binder_ref, rb_node_node);
@@ -1041,14 +2011,16 @@ binder_get_ref_for_node(struct binder_proc *proc, struct binder_node *node)
 			p = &(*p)->rb_left;
 		else if (node > ref->node)
 			p = &(*p)->rb_right;
-		else
+		else {
+			*slot = ref;
 			return ref;
+		}
 	}
 	new_ref = kzalloc(sizeof(*ref), GFP_KERNEL);
 	if (new_ref == NULL)
 		return NULL;
-	binder_stats.obj_created[BINDER_STAT_REF]++;
-	new_ref->debug_id = ++binder_last_id;
+	binder_stats_created(BINDER_STAT_REF);
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1076,8 +2048,12 @@ binder_get_ref_for_node(struct binder_proc *proc, struct binder_node *node)
 	}
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
+	*slot = new_ref;
+	*binder_ref_desc_cache_slot(proc, new_ref->desc) = new_ref;
 	if (node) {
+		binder_node_lock(node);
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		binder_node_unlock(node);
 		if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 			printk(KERN_INFO "binder: %d new ref %d desc %d for "
 				"node %d\n", proc->pid, new_ref->debug_id,
@@ -1092,33 +2068,49 @@ binder_get_ref_for_node(struct binder_proc *proc, struct binder_node *node)
 }
 
 static void
-binder_delete_ref(struct binder_ref *ref)
+binder_delete_ref_olocked(struct binder_ref *ref)
 {
+	struct binder_node *node = ref->node;
+	struct binder_ref **slot;
+	int free_node;
+
 	if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 		printk(KERN_INFO "binder: %d delete ref %d desc %d for "
 			"node %d\n", ref->proc->pid, ref->debug_id,
-			ref->desc, ref->node->debug_id);
+			ref->desc, node->debug_id);
+	slot = binder_ref_desc_cache_slot(ref->proc, ref->desc);
+	if (*slot == ref)
+		*slot = NULL;
+	slot = binder_ref_node_cache_slot(ref->proc, node);
+	if (*slot == ref)
+		*slot = NULL;
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	binder_node_inner_lock(node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_nilocked(node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	free_node = binder_dec_node_nilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
 	if (ref->death) {
 		if (binder_debug_mask & BINDER_DEBUG_DEAD_BINDER)
 			printk(KERN_INFO "binder: %d delete ref %d desc %d "
 				"has death notification\n", ref->proc->pid,
 				ref->debug_id, ref->desc);
+		binder_inner_proc_lock(ref->proc);
 		list_del(&ref->death->work.entry);
+		binder_inner_proc_unlock(ref->proc);
 		kfree(ref->death);
-		binder_stats.obj_deleted[BINDER_STAT_DEATH]++;
+		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
 	kfree(ref);
-	binder_stats.obj_deleted[BINDER_STAT_REF]++;
+	binder_stats_deleted(BINDER_STAT_REF);
 }
 
 static int
-binder_inc_ref(
+binder_inc_ref_olocked(
 	struct binder_ref *ref, int strong, struct list_head *target_list)
 {
 	int ret;
@@ -1140,9 +2132,12 @@ binder_inc_ref(
 	return 0;
 }
 
-
+/*
+ * Returns 1 when the last reference is gone and the caller must delete
+ * the ref with binder_delete_ref_olocked.
+ */
 static int
-binder_dec_ref(struct binder_ref *ref, int strong)
+binder_dec_ref_olocked(struct binder_ref *ref, int strong)
 {
 	if (strong) {
 		if (ref->strong == 0) {
@@ -1150,46 +2145,115 @@ binder_dec_ref(struct binder_ref *ref, int strong)
 					  "ref %d desc %d s %d w %d\n",
 					  ref->proc->pid, ref->debug_id,
 					  ref->desc, ref->strong, ref->weak);
-			return -EINVAL;
+			return 0;
 		}
 		ref->strong--;
-		if (ref->strong == 0) {
-			int ret;
-			ret = binder_dec_node(ref->node, strong, 1);
-			if (ret)
-				return ret;
-		}
+		if (ref->strong == 0)
+			binder_dec_node(ref->node, strong, 1);
 	} else {
 		if (ref->weak == 0) {
 			binder_user_error("binder: %d invalid dec weak, "
 					  "ref %d desc %d s %d w %d\n",
 					  ref->proc->pid, ref->debug_id,
 					  ref->desc, ref->strong, ref->weak);
-			return -EINVAL;
+			return 0;
 		}
 		ref->weak--;
 	}
-	if (ref->strong == 0 && ref->weak == 0)
-		binder_delete_ref(ref);
-	return 0;
+	return ref->strong == 0 && ref->weak == 0;
+}
+
+static void binder_free_proc(struct binder_proc *proc);
+static void binder_free_thread(struct binder_thread *thread);
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	binder_inner_proc_lock(proc);
+	proc->tmp_ref--;
+	if (proc->is_dead && RB_EMPTY_ROOT(&proc->threads) &&
+	    !proc->tmp_ref) {
+		binder_inner_proc_unlock(proc);
+		binder_free_proc(proc);
+		return;
+	}
+	binder_inner_proc_unlock(proc);
+}
+
+/*
+ * tmp_ref is atomic so it can be raised under t->lock, it is only checked
+ * for zero under the inner lock once the thread is dead.
+ */
+static void binder_thread_dec_tmpref(struct binder_thread *thread)
+{
+	binder_inner_proc_lock(thread->proc);
+	if (atomic_dec_and_test(&thread->tmp_ref) && thread->is_dead) {
+		binder_inner_proc_unlock(thread->proc);
+		binder_free_thread(thread);
+		return;
+	}
+	binder_inner_proc_unlock(thread->proc);
+}
+
+/* returns t->from with a tmp ref, or NULL if the sender is gone */
+static struct binder_thread *binder_get_txn_from(struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	spin_lock(&t->lock);
+	from = t->from;
+	if (from)
+		atomic_inc(&from->tmp_ref);
+	spin_unlock(&t->lock);
+	return from;
+}
+
+/* as binder_get_txn_from, but also returns with from->proc inner locked */
+static struct binder_thread *binder_get_txn_from_and_acq_inner(
+	struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	from = binder_get_txn_from(t);
+	if (from == NULL)
+		return NULL;
+	binder_inner_proc_lock(from->proc);
+	if (t->from) {
+		BUG_ON(from != t->from);
+		return from;
+	}
+	binder_inner_proc_unlock(from->proc);
+	binder_thread_dec_tmpref(from);
+	return NULL;
 }
 
 static void
-binder_pop_transaction(
+binder_pop_transaction_ilocked(
 	struct binder_thread *target_thread, struct binder_transaction *t)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
-	}
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(target_thread->transaction_stack->from != target_thread);
+	target_thread->transaction_stack =
+		target_thread->transaction_stack->from_parent;
+	spin_lock(&t->lock);
+	t->from = NULL;
+	spin_unlock(&t->lock);
+}
+
+/* t->buffer and buffer->transaction are protected by t->to_proc */
+static void
+binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc = t->to_proc;
+
 	t->need_reply = 0;
-	if (t->buffer)
-		t->buffer->transaction = NULL;
+	if (target_proc) {
+		binder_inner_proc_lock(target_proc);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		binder_inner_proc_unlock(target_proc);
+	}
 	kfree(t);
-	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION]++;
+	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
 
 static void
@@ -1198,7 +2262,7 @@ binder_send_failed_reply(struct binder_transaction *t, uint32_t error_code)
 	struct binder_thread *target_thread;
 	BUG_ON(t->flags & TF_ONE_WAY);
 	while (1) {
-		target_thread = t->from;
+		target_thread = binder_get_txn_from_and_acq_inner(t);
 		if (target_thread) {
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
@@ -1211,15 +2275,20 @@ binder_send_failed_reply(struct binder_transaction *t, uint32_t error_code)
 					printk(KERN_INFO "binder: send failed reply for transaction %d to %d:%d\n",
 					       t->debug_id, target_thread->proc->pid, target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
+				binder_pop_transaction_ilocked(target_thread, t);
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
+				binder_inner_proc_unlock(target_thread->proc);
+				binder_thread_dec_tmpref(target_thread);
+				binder_free_transaction(t);
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
 					"already\n", target_thread->proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
+				binder_inner_proc_unlock(target_thread->proc);
+				binder_thread_dec_tmpref(target_thread);
 			}
 			return;
 		} else {
@@ -1230,7 +2299,7 @@ binder_send_failed_reply(struct binder_transaction *t, uint32_t error_code)
 					"for transaction %d, target dead\n",
 					t->debug_id);
 
-			binder_pop_transaction(target_thread, t);
+			binder_free_transaction(t);
 			if (next == NULL) {
 				if (binder_debug_mask & BINDER_DEBUG_DEAD_BINDER)
 					printk(KERN_INFO "binder: reply failed,"
@@ -1249,18 +2318,231 @@ static void
 binder_transaction_buffer_release(struct binder_proc *proc,
 			struct binder_buffer *buffer, size_t *failed_at);
 
+/*
+ * Queue t on the todo list of thread, or of proc if thread is NULL, and
+ * wake it up. If pending_wake is not NULL a wake-up of proc is left to the
+ * caller by setting *pending_wake. One-way transactions to a node that
+ * already has one in flight are parked on node->async_todo. Returns 0 if
+ * the target is dead.
+ */
+static int
+binder_proc_transaction(struct binder_transaction *t, struct binder_proc *proc,
+			struct binder_thread *thread, int *pending_wake)
+{
+	struct binder_node *node = t->buffer->target_node;
+	struct list_head *target_list;
+	wait_queue_head_t *target_wait;
+
+	BUG_ON(node == NULL);
+	binder_node_lock(node);
+	binder_inner_proc_lock(proc);
+	if (proc->is_dead || (thread && thread->is_dead)) {
+		binder_inner_proc_unlock(proc);
+		binder_node_unlock(node);
+		return 0;
+	}
+	if (thread) {
+		target_list = &thread->todo;
+		target_wait = &thread->wait;
+		/*
+		 * A thread that is blocked in a nested call is known to be
+		 * the one that will serve t, so an RT caller boosts it now,
+		 * before it is woken, instead of when it gets to run.
+		 */
+		if (binder_is_rt_policy(t->priority.sched_policy)) {
+			t->saved_priority = binder_get_priority(thread->task);
+			t->set_priority_called = 1;
+			if (t->priority.prio < t->saved_priority.prio)
+				binder_set_priority(thread->task, t->priority, 0);
+		}
+	} else {
+		target_list = &proc->todo;
+		target_wait = &proc->wait;
+	}
+	if (t->flags & TF_ONE_WAY) {
+		BUG_ON(thread);
+		if (node->has_async_transaction) {
+			target_list = &node->async_todo;
+			target_wait = NULL;
+		} else
+			node->has_async_transaction = 1;
+	}
+	t->work.type = BINDER_WORK_TRANSACTION;
+	list_add_tail(&t->work.entry, target_list);
+	if (target_wait == &proc->wait) {
+		if (pending_wake)
+			*pending_wake = 1;
+		else
+			binder_wakeup_proc_ilocked(proc);
+		target_wait = NULL;
+	}
+	binder_inner_proc_unlock(proc);
+	binder_node_unlock(node);
+	if (target_wait)
+		wake_up_interruptible(target_wait);
+	return 1;
+}
+
+/*
+ * Consecutive one-way BC_TRANSACTIONs in one write buffer that go to the
+ * same node share a single wake-up of the target, done when the run ends.
+ * The handle is still looked up for every one of them, another thread may
+ * have released it and had it reassigned in the meantime. The batch holds
+ * a tmp ref on the target node and its proc for that long.
+ */
+struct binder_txn_batch {
+	struct binder_node *node;
+	struct binder_proc *proc;
+	int wake;
+};
+
+static void binder_txn_batch_flush(struct binder_txn_batch *batch)
+{
+	if (batch->wake) {
+		binder_inner_proc_lock(batch->proc);
+		binder_wakeup_proc_ilocked(batch->proc);
+		binder_inner_proc_unlock(batch->proc);
+		batch->wake = 0;
+	}
+	if (batch->node) {
+		binder_put_node(batch->node);
+		binder_proc_dec_tmpref(batch->proc);
+		batch->node = NULL;
+		batch->proc = NULL;
+	}
+}
+
+static void binder_txn_batch_set(struct binder_txn_batch *batch,
+	struct binder_node *node, struct binder_proc *proc)
+{
+	binder_txn_batch_flush(batch);
+	binder_inc_node_tmpref(node);
+	binder_inner_proc_lock(proc);
+	proc->tmp_ref++;
+	binder_inner_proc_unlock(proc);
+	batch->node = node;
+	batch->proc = proc;
+}
+
+static void binder_stat_sg(struct binder_proc *proc,
+	struct binder_thread *thread, size_t copied, size_t by_ref)
+{
+	struct binder_stats *stats[] = {
+		&binder_stats, &proc->stats, &thread->stats
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(stats); i++) {
+		atomic_inc(&stats[i]->sg_transactions);
+		atomic_long_add(copied, &stats[i]->sg_bytes_copied);
+		atomic_long_add(by_ref, &stats[i]->sg_bytes_by_ref);
+	}
+}
+
+/*
+ * Can the buffer mapped by vma go to another process as an fd for its file?
+ * Only pmem: an ashmem mapping's vm_file is the raw shmem file behind it,
+ * and passing that would get around ashmem's prot_mask and pinning; any
+ * other file could end up with more access than the sender gave it. The
+ * sender must be able to read the buffer, and the fd can't be writable
+ * unless the mapping is, since the target gets the sender's f_mode.
+ */
+static int binder_sg_file_by_ref(struct vm_area_struct *vma)
+{
+	struct file *file = vma->vm_file;
+
+	if (!file || !(vma->vm_flags & VM_SHARED) || !is_pmem_file(file))
+		return 0;
+	if (!(vma->vm_flags & VM_READ) || !(file->f_mode & FMODE_READ))
+		return 0;
+	if ((file->f_mode & FMODE_WRITE) && !(vma->vm_flags & VM_WRITE))
+		return 0;
+	return 1;
+}
+
+/*
+ * Deliver the user buffer of a BINDER_TYPE_PTR object to target_proc.
+ * A buffer of at least sg_ref_min bytes that lies in one pmem mapping goes
+ * by reference as an fd for the pmem file if the target accepts fds, see
+ * binder_sg_file_by_ref. Anything else is copied once, straight from the
+ * sender into the extra buffers area of the target buffer at *sg_bufp.
+ * Returns the number of bytes copied or passed by reference in *copied or
+ * *by_ref.
+ */
+static int
+binder_gather_buffer(struct binder_proc *target_proc,
+		     struct binder_buffer_object *bp, int allow_fds,
+		     void **sg_bufp, void *sg_buf_end,
+		     size_t *copied, size_t *by_ref)
+{
+	unsigned long ubuf = (unsigned long)bp->buffer;
+	size_t len = bp->length;
+	size_t room = sg_buf_end - *sg_bufp;
+
+	bp->flags &= ~BINDER_BUFFER_FLAG_REF;
+	if (allow_fds && len >= binder_sg_ref_min && ubuf + len > ubuf) {
+		struct mm_struct *mm = current->mm;
+		struct vm_area_struct *vma;
+		struct file *file = NULL;
+		unsigned long offset = 0;
+		int fd;
+
+		down_read(&mm->mmap_sem);
+		vma = find_vma(mm, ubuf);
+		if (vma && vma->vm_start <= ubuf && ubuf + len <= vma->vm_end &&
+		    binder_sg_file_by_ref(vma)) {
+			file = vma->vm_file;
+			get_file(file);
+			/* pmem_mmap only takes vm_pgoff 0 and then sets it
+			 * to the physical pfn, so don't hand that out */
+			offset = ubuf - vma->vm_start;
+		}
+		up_read(&mm->mmap_sem);
+		if (file) {
+			fd = task_get_unused_fd_flags(target_proc->tsk, O_CLOEXEC);
+			if (fd < 0) {
+				fput(file);
+				return fd;
+			}
+			task_fd_install(target_proc->tsk, fd, file);
+			if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
+				printk(KERN_INFO "        buffer %p size %d -> "
+				       "fd %d offset %lx\n", bp->buffer, len,
+				       fd, offset);
+			bp->flags |= BINDER_BUFFER_FLAG_REF;
+			bp->handle = fd;
+			bp->buffer = (void *)offset;
+			*by_ref += len;
+			return 0;
+		}
+	}
+	if (len > room || ALIGN(len, sizeof(void *)) > room)
+		return -ENOSPC;
+	if (copy_from_user(*sg_bufp, bp->buffer, len))
+		return -EFAULT;
+	if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
+		printk(KERN_INFO "        buffer %p size %d -> %p\n",
+		       bp->buffer, len, *sg_bufp);
+	bp->buffer = *sg_bufp + target_proc->user_buffer_offset;
+	*sg_bufp += ALIGN(len, sizeof(void *));
+	*copied += len;
+	return 0;
+}
+
 static void
 binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
-	struct binder_transaction_data *tr, int reply)
+	struct binder_transaction_data *tr, int reply,
+	size_t extra_buffers_size, struct binder_txn_batch *batch)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
-	struct binder_proc *target_proc;
+	void *sg_bufp, *sg_buf_end;
+	size_t sg_copied = 0, sg_by_ref = 0;
+	int almost_full = 0;
+	struct binder_proc *target_proc = NULL;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
-	struct list_head *target_list;
-	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
 	uint32_t return_error;
@@ -1274,15 +2556,16 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		binder_inner_proc_lock(proc);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			binder_inner_proc_unlock(proc);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1292,12 +2575,15 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			binder_inner_proc_unlock(proc);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
-		target_thread = in_reply_to->from;
+		binder_inner_proc_unlock(proc);
+		binder_set_priority(current, in_reply_to->saved_priority, 0);
+		target_thread = binder_get_txn_from_and_acq_inner(in_reply_to);
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
@@ -1310,55 +2596,79 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			binder_inner_proc_unlock(target_thread->proc);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
+			binder_thread_dec_tmpref(target_thread);
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
 		target_proc = target_thread->proc;
+		target_proc->tmp_ref++;
+		binder_inner_proc_unlock(target_thread->proc);
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
-			ref = binder_get_ref(proc, tr->target.handle);
+			binder_proc_lock(proc);
+			ref = binder_get_ref_olocked(proc, tr->target.handle);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
 				return_error = BR_FAILED_REPLY;
 				goto err_invalid_target_handle;
 			}
-			target_node = ref->node;
+			target_node = binder_get_node_refs_for_txn(ref->node,
+								   &target_proc);
+			binder_proc_unlock(proc);
 		} else {
+			mutex_lock(&binder_context_mgr_node_lock);
 			target_node = binder_context_mgr_node;
 			if (target_node == NULL) {
+				mutex_unlock(&binder_context_mgr_node_lock);
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
+			target_node = binder_get_node_refs_for_txn(target_node,
+								   &target_proc);
+			mutex_unlock(&binder_context_mgr_node_lock);
 		}
-		e->to_node = target_node->debug_id;
-		target_proc = target_node->proc;
-		if (target_proc == NULL) {
+		if (target_node == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		if (batch && batch->node != target_node)
+			binder_txn_batch_set(batch, target_node, target_proc);
+		e->to_node = target_node->debug_id;
+		binder_inner_proc_lock(proc);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
-			struct binder_transaction *tmp;
+			struct binder_transaction *tmp, *match = NULL;
+			struct binder_thread *from;
+
 			tmp = thread->transaction_stack;
 			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
+				spin_lock(&tmp->lock);
+				from = tmp->from;
+				if (from && from->proc == target_proc)
+					match = tmp;
+				spin_unlock(&tmp->lock);
 				tmp = tmp->from_parent;
 			}
+			if (match) {
+				spin_lock(&match->lock);
+				from = match->from;
+				if (from) {
+					atomic_inc(&from->tmp_ref);
+					target_thread = from;
+				}
+				spin_unlock(&match->lock);
+			}
 		}
+		binder_inner_proc_unlock(proc);
 	}
-	if (target_thread) {
+	if (target_thread)
 		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1367,16 +2677,18 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 		return_error = BR_FAILED_REPLY;
 		goto err_alloc_t_failed;
 	}
-	binder_stats.obj_created[BINDER_STAT_TRANSACTION]++;
+	binder_stats_created(BINDER_STAT_TRANSACTION);
+	spin_lock_init(&t->lock);
+	INIT_LIST_HEAD(&t->stealable_entry);
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_alloc_tcomplete_failed;
 	}
-	binder_stats.obj_created[BINDER_STAT_TRANSACTION_COMPLETE]++;
+	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (binder_debug_mask & BINDER_DEBUG_TRANSACTION) {
@@ -1405,10 +2717,17 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY), proc->pid, &almost_full);
 	if (t->buffer == NULL) {
+		if (!reply && (t->flags & TF_ONE_WAY)) {
+			atomic_inc(&proc->async_rejected);
+			atomic_long_add(tr->data_size + tr->offsets_size +
+					extra_buffers_size,
+					&proc->async_rejected_bytes);
+		}
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
@@ -1416,8 +2735,6 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
@@ -1434,6 +2751,9 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 		goto err_copy_data_failed;
 	}
 	off_end = (void *)offp + tr->offsets_size;
+	sg_bufp = (void *)t->buffer->data + ALIGN(tr->data_size, sizeof(void *)) +
+		ALIGN(tr->offsets_size, sizeof(void *));
+	sg_buf_end = sg_bufp + ALIGN(extra_buffers_size, sizeof(void *));
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
 		if (*offp > t->buffer->data_size - sizeof(*fp)) {
@@ -1450,13 +2770,12 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			struct binder_ref *ref;
 			struct binder_node *node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
-				node = binder_new_node(proc, fp->binder, fp->cookie);
+				node = binder_new_node(proc, fp->binder,
+						       fp->cookie, fp->flags);
 				if (node == NULL) {
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
-				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1464,10 +2783,15 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				binder_put_node(node);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
-			ref = binder_get_ref_for_node(target_proc, node);
+			binder_proc_lock(target_proc);
+			ref = binder_get_ref_for_node_olocked(target_proc, node);
 			if (ref == NULL) {
+				binder_proc_unlock(target_proc);
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1476,15 +2800,23 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			else
 				fp->type = BINDER_TYPE_WEAK_HANDLE;
 			fp->handle = ref->desc;
-			binder_inc_ref(ref, fp->type == BINDER_TYPE_HANDLE, &thread->todo);
+			binder_inc_ref_olocked(ref, fp->type == BINDER_TYPE_HANDLE, &thread->todo);
 			if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
 				printk(KERN_INFO "        node %d u%p -> ref %d desc %d\n",
 				       node->debug_id, node->ptr, ref->debug_id, ref->desc);
+			binder_proc_unlock(target_proc);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+			struct binder_node *node;
+			int ref_debug_id, ref_desc;
+
+			binder_proc_lock(proc);
+			ref = binder_get_ref_olocked(proc, fp->handle);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1492,30 +2824,45 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
-			if (ref->node->proc == target_proc) {
+			node = ref->node;
+			ref_debug_id = ref->debug_id;
+			ref_desc = ref->desc;
+			binder_inc_node_tmpref(node);
+			binder_proc_unlock(proc);
+			binder_node_lock(node);
+			if (node->proc == target_proc) {
 				if (fp->type == BINDER_TYPE_HANDLE)
 					fp->type = BINDER_TYPE_BINDER;
 				else
 					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				fp->binder = node->ptr;
+				fp->cookie = node->cookie;
+				binder_inner_proc_lock(target_proc);
+				binder_inc_node_nilocked(node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				binder_inner_proc_unlock(target_proc);
+				binder_node_unlock(node);
 				if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
 					printk(KERN_INFO "        ref %d desc %d -> node %d u%p\n",
-					       ref->debug_id, ref->desc, ref->node->debug_id, ref->node->ptr);
+					       ref_debug_id, ref_desc, node->debug_id, node->ptr);
 			} else {
 				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
+				binder_node_unlock(node);
+				binder_proc_lock(target_proc);
+				new_ref = binder_get_ref_for_node_olocked(target_proc, node);
 				if (new_ref == NULL) {
+					binder_proc_unlock(target_proc);
+					binder_put_node(node);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_get_ref_for_node_failed;
 				}
 				fp->handle = new_ref->desc;
-				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
+				binder_inc_ref_olocked(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
 				if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
 					printk(KERN_INFO "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					       ref->debug_id, ref->desc, new_ref->debug_id, new_ref->desc, ref->node->debug_id);
+					       ref_debug_id, ref_desc, new_ref->debug_id, new_ref->desc, node->debug_id);
+				binder_proc_unlock(target_proc);
 			}
+			binder_put_node(node);
 		} break;
 
 		case BINDER_TYPE_FD: {
@@ -1556,6 +2903,37 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			fp->handle = target_fd;
 		} break;
 
+		case BINDER_TYPE_PTR: {
+			struct binder_buffer_object *bp;
+			int allow_fds;
+			int ret;
+
+			if (t->buffer->data_size < sizeof(*bp) ||
+			    *offp > t->buffer->data_size - sizeof(*bp)) {
+				binder_user_error("binder: %d:%d got transaction with "
+					"invalid offset, %d\n",
+					proc->pid, thread->pid, *offp);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_offset;
+			}
+			bp = (struct binder_buffer_object *)fp;
+			if (reply)
+				allow_fds = in_reply_to->flags & TF_ACCEPT_FDS;
+			else
+				allow_fds = target_node->accept_fds;
+			ret = binder_gather_buffer(target_proc, bp, allow_fds,
+						   &sg_bufp, sg_buf_end,
+						   &sg_copied, &sg_by_ref);
+			if (ret < 0) {
+				binder_user_error("binder: %d:%d got transaction with "
+					"bad buffer %p size %d, %d\n",
+					proc->pid, thread->pid, bp->buffer,
+					bp->length, ret);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_buffer;
+			}
+		} break;
+
 		default:
 			binder_user_error("binder: %d:%d got transactio"
 				"n with invalid object type, %lx\n",
@@ -1564,31 +2942,77 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			goto err_bad_object_type;
 		}
 	}
+	if (sg_copied || sg_by_ref)
+		binder_stat_sg(proc, thread, sg_copied, sg_by_ref);
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	if (almost_full) {
+		atomic_inc(&proc->async_almost_full);
+		if (proc->async_throttle)
+			tcomplete->type =
+				BINDER_WORK_TRANSACTION_COMPLETE_ALMOST_FULL;
+	}
+	t->send_time = ktime_get();
+	trace_mark(binder_transaction_enqueue,
+		   "debug_id %d from %d:%d to %d:%d node %d reply %d flags %x",
+		   t->debug_id, proc->pid, thread->pid, target_proc->pid,
+		   target_thread ? target_thread->pid : 0,
+		   target_node ? target_node->debug_id : 0, reply, t->flags);
 	if (reply) {
+		s64 us;
+
+		t->call_time = in_reply_to->send_time;
+		us = binder_latency_add(proc, BINDER_LATENCY_REPLY,
+					in_reply_to->dequeue_time, t->send_time);
+		trace_mark(binder_transaction_reply,
+			   "debug_id %d call %d proc %d thread %d latency_us %lld",
+			   t->debug_id, in_reply_to->debug_id, proc->pid,
+			   thread->pid, (long long)us);
+		binder_inner_proc_lock(target_proc);
+		if (target_thread->is_dead) {
+			binder_inner_proc_unlock(target_proc);
+			goto err_dead_proc_or_thread;
+		}
 		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
+		binder_pop_transaction_ilocked(target_thread, in_reply_to);
+		t->work.type = BINDER_WORK_TRANSACTION;
+		list_add_tail(&t->work.entry, &target_thread->todo);
+		binder_inner_proc_unlock(target_proc);
+		wake_up_interruptible(&target_thread->wait);
+		binder_free_transaction(in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		binder_inner_proc_lock(proc);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+		binder_inner_proc_unlock(proc);
+		if (!binder_proc_transaction(t, target_proc, target_thread,
+					     NULL)) {
+			binder_inner_proc_lock(proc);
+			binder_pop_transaction_ilocked(thread, t);
+			binder_inner_proc_unlock(proc);
+			goto err_dead_proc_or_thread;
+		}
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
-		if (target_node->has_async_transaction) {
-			target_list = &target_node->async_todo;
-			target_wait = NULL;
-		} else
-			target_node->has_async_transaction = 1;
+		if (!binder_proc_transaction(t, target_proc, NULL,
+					     batch ? &batch->wake : NULL))
+			goto err_dead_proc_or_thread;
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	binder_inner_proc_lock(proc);
 	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
+	binder_inner_proc_unlock(proc);
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	binder_proc_dec_tmpref(target_proc);
+	if (target_node)
+		binder_put_node(target_node);
 	return;
 
+err_dead_proc_or_thread:
+	return_error = BR_DEAD_REPLY;
+err_bad_buffer:
 err_get_unused_fd_failed:
 err_fget_failed:
 err_fd_not_allowed:
@@ -1599,20 +3023,31 @@ err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	if (target_node)
+		binder_put_node(target_node);
+	target_node = NULL;
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
-	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
+	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
 	kfree(t);
-	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION]++;
+	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
 err_bad_call_stack:
 err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
 err_no_context_mgr_node:
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (target_proc)
+		binder_proc_dec_tmpref(target_proc);
+	if (target_node) {
+		binder_dec_node(target_node, 1, 0);
+		binder_put_node(target_node);
+	}
 	if (binder_debug_mask & BINDER_DEBUG_FAILED_TRANSACTION)
 		printk(KERN_INFO "binder: %d:%d transaction failed %d, size %d-%d\n",
 			   proc->pid, thread->pid, return_error,
@@ -1624,12 +3059,16 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
+	binder_inner_proc_lock(proc);
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
 		thread->return_error = BR_TRANSACTION_COMPLETE;
+		binder_inner_proc_unlock(proc);
 		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	} else {
 		thread->return_error = return_error;
+		binder_inner_proc_unlock(proc);
+	}
 }
 
 static void
@@ -1670,18 +3109,25 @@ binder_transaction_buffer_release(struct binder_proc *proc, struct binder_buffer
 				printk(KERN_INFO "        node %d u%p\n",
 				       node->debug_id, node->ptr);
 			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			binder_proc_lock(proc);
+			ref = binder_get_ref_olocked(proc, fp->handle);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				printk(KERN_ERR "binder: transaction release %d bad handle %ld\n", debug_id, fp->handle);
 				break;
 			}
 			if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
 				printk(KERN_INFO "        ref %d desc %d (node %d)\n",
 				       ref->debug_id, ref->desc, ref->node->debug_id);
-			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
+			if (binder_dec_ref_olocked(ref, fp->type == BINDER_TYPE_HANDLE))
+				binder_delete_ref_olocked(ref);
+			binder_proc_unlock(proc);
 		} break;
 
 		case BINDER_TYPE_FD:
@@ -1691,6 +3137,20 @@ binder_transaction_buffer_release(struct binder_proc *proc, struct binder_buffer
 				task_close_fd(proc->tsk, fp->handle);
 			break;
 
+		case BINDER_TYPE_PTR: {
+			struct binder_buffer_object *bp;
+
+			if (buffer->data_size < sizeof(*bp) ||
+			    *offp > buffer->data_size - sizeof(*bp))
+				break;
+			bp = (struct binder_buffer_object *)fp;
+			if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
+				printk(KERN_INFO "        buffer %p size %d\n",
+				       bp->buffer, bp->length);
+			if (failed_at && (bp->flags & BINDER_BUFFER_FLAG_REF))
+				task_close_fd(proc->tsk, bp->handle);
+		} break;
+
 		default:
 			printk(KERN_ERR "binder: transaction release %d bad object type %lx\n", debug_id, fp->type);
 			break;
@@ -1698,9 +3158,10 @@ binder_transaction_buffer_release(struct binder_proc *proc, struct binder_buffer
 	}
 }
 
-int
-binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
-		    void __user *buffer, int size, signed long *consumed)
+static int
+binder_thread_write_cmds(struct binder_proc *proc, struct binder_thread *thread,
+			 void __user *buffer, int size, signed long *consumed,
+			 struct binder_txn_batch *batch)
 {
 	uint32_t cmd;
 	void __user *ptr = buffer + *consumed;
@@ -1710,10 +3171,12 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 		if (get_user(cmd, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
+		if (cmd != BC_TRANSACTION && cmd != BC_TRANSACTION_SG)
+			binder_txn_batch_flush(batch);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1723,25 +3186,35 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			uint32_t target;
 			struct binder_ref *ref;
 			const char *debug_string;
+			int delete_ref = 0;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (target == 0 && binder_context_mgr_node &&
+			if (target == 0 &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
-				ref = binder_get_ref_for_node(proc,
-					       binder_context_mgr_node);
-				if (ref->desc != target) {
-					binder_user_error("binder: %d:"
-						"%d tried to acquire "
-						"reference to desc 0, "
-						"got %d instead\n",
-						proc->pid, thread->pid,
-						ref->desc);
-				}
-			} else
-				ref = binder_get_ref(proc, target);
+				mutex_lock(&binder_context_mgr_node_lock);
+				binder_proc_lock(proc);
+				if (binder_context_mgr_node) {
+					ref = binder_get_ref_for_node_olocked(proc,
+						       binder_context_mgr_node);
+					if (ref && ref->desc != target) {
+						binder_user_error("binder: %d:"
+							"%d tried to acquire "
+							"reference to desc 0, "
+							"got %d instead\n",
+							proc->pid, thread->pid,
+							ref->desc);
+					}
+				} else
+					ref = binder_get_ref_olocked(proc, target);
+				mutex_unlock(&binder_context_mgr_node_lock);
+			} else {
+				binder_proc_lock(proc);
+				ref = binder_get_ref_olocked(proc, target);
+			}
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1750,25 +3223,28 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			switch (cmd) {
 			case BC_INCREFS:
 				debug_string = "IncRefs";
-				binder_inc_ref(ref, 0, NULL);
+				binder_inc_ref_olocked(ref, 0, NULL);
 				break;
 			case BC_ACQUIRE:
 				debug_string = "Acquire";
-				binder_inc_ref(ref, 1, NULL);
+				binder_inc_ref_olocked(ref, 1, NULL);
 				break;
 			case BC_RELEASE:
 				debug_string = "Release";
-				binder_dec_ref(ref, 1);
+				delete_ref = binder_dec_ref_olocked(ref, 1);
 				break;
 			case BC_DECREFS:
 			default:
 				debug_string = "DecRefs";
-				binder_dec_ref(ref, 0);
+				delete_ref = binder_dec_ref_olocked(ref, 0);
 				break;
 			}
 			if (binder_debug_mask & BINDER_DEBUG_USER_REFS)
 				printk(KERN_INFO "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				       proc->pid, thread->pid, debug_string, ref->debug_id, ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			if (delete_ref)
+				binder_delete_ref_olocked(ref);
+			binder_proc_unlock(proc);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1802,8 +3278,10 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				binder_put_node(node);
 				break;
 			}
+			binder_node_inner_lock(node);
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
 					binder_user_error("binder: %d:%d "
@@ -1811,6 +3289,8 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1821,14 +3301,19 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			/* our tmp ref keeps the node alive */
+			binder_dec_node_nilocked(node, cmd == BC_ACQUIRE_DONE, 0);
 			if (binder_debug_mask & BINDER_DEBUG_USER_REFS)
 				printk(KERN_INFO "binder: %d:%d %s node %d ls %d lw %d\n",
 				       proc->pid, thread->pid, cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE", node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			binder_node_inner_unlock(node);
+			binder_put_node(node);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1846,20 +3331,11 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
-			buffer = binder_buffer_lookup(proc, data_ptr);
-			if (buffer == NULL) {
-				binder_user_error("binder: %d:%d "
-					"BC_FREE_BUFFER u%p no match\n",
-					proc->pid, thread->pid, data_ptr);
-				break;
-			}
-			if (!buffer->allow_user_free) {
-				binder_user_error("binder: %d:%d "
-					"BC_FREE_BUFFER u%p matched "
-					"unreturned buffer\n",
-					proc->pid, thread->pid, data_ptr);
+			buffer = binder_prepare_to_free(proc, thread, data_ptr);
+			if (buffer == NULL)
 				break;
-			}
+
+			binder_inner_proc_lock(proc);
 			if (binder_debug_mask & BINDER_DEBUG_FREE_BUFFER)
 				printk(KERN_INFO "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				       proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1869,12 +3345,29 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
+			binder_inner_proc_unlock(proc);
 			if (buffer->async_transaction && buffer->target_node) {
-				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
-					buffer->target_node->has_async_transaction = 0;
-				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+				struct binder_node *buf_node = buffer->target_node;
+
+				binder_node_inner_lock(buf_node);
+				BUG_ON(!buf_node->has_async_transaction);
+				BUG_ON(buf_node->proc != proc);
+				if (list_empty(&buf_node->async_todo))
+					buf_node->has_async_transaction = 0;
+				else {
+					struct binder_transaction *next;
+
+					next = list_first_entry(&buf_node->async_todo,
+								struct binder_transaction,
+								work.entry);
+					list_move_tail(&next->work.entry, &thread->todo);
+					/* this thread is busy, let an idle one steal it */
+					next->parked_on = thread;
+					list_add_tail(&next->stealable_entry,
+						      &proc->stealable);
+					binder_wakeup_proc_ilocked(proc);
+				}
+				binder_node_inner_unlock(buf_node);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
@@ -1888,7 +3381,34 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			if (cmd == BC_TRANSACTION && (tr.flags & TF_ONE_WAY)) {
+				binder_transaction(proc, thread, &tr, 0, 0, batch);
+			} else {
+				binder_txn_batch_flush(batch);
+				binder_transaction(proc, thread, &tr,
+						   cmd == BC_REPLY, 0, NULL);
+			}
+			break;
+		}
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			if (cmd == BC_TRANSACTION_SG &&
+			    (tr.transaction_data.flags & TF_ONE_WAY)) {
+				binder_transaction(proc, thread,
+						   &tr.transaction_data, 0,
+						   tr.buffers_size, batch);
+			} else {
+				binder_txn_batch_flush(batch);
+				binder_transaction(proc, thread,
+						   &tr.transaction_data,
+						   cmd == BC_REPLY_SG,
+						   tr.buffers_size, NULL);
+			}
 			break;
 		}
 
@@ -1896,6 +3416,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (binder_debug_mask & BINDER_DEBUG_THREADS)
 				printk(KERN_INFO "binder: %d:%d BC_REGISTER_LOOPER\n",
 				       proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -1913,11 +3434,13 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			binder_inner_proc_unlock(proc);
 			break;
 		case BC_ENTER_LOOPER:
 			if (binder_debug_mask & BINDER_DEBUG_THREADS)
 				printk(KERN_INFO "binder: %d:%d BC_ENTER_LOOPER\n",
 				       proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -1926,12 +3449,15 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			binder_inner_proc_unlock(proc);
 			break;
 		case BC_EXIT_LOOPER:
 			if (binder_debug_mask & BINDER_DEBUG_THREADS)
 				printk(KERN_INFO "binder: %d:%d BC_EXIT_LOOPER\n",
 				       proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			binder_inner_proc_unlock(proc);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -1939,7 +3465,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			uint32_t target;
 			void __user *cookie;
 			struct binder_ref *ref;
-			struct binder_ref_death *death;
+			struct binder_ref_death *death = NULL;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -1947,7 +3473,22 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
-			ref = binder_get_ref(proc, target);
+			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+				/* allocate before taking any of our locks */
+				death = kzalloc(sizeof(*death), GFP_KERNEL);
+				if (death == NULL) {
+					binder_inner_proc_lock(proc);
+					thread->return_error = BR_ERROR;
+					binder_inner_proc_unlock(proc);
+					if (binder_debug_mask & BINDER_DEBUG_FAILED_TRANSACTION)
+						printk(KERN_INFO "binder: %d:%d "
+							"BC_REQUEST_DEATH_NOTIFICATION failed\n",
+							proc->pid, thread->pid);
+					break;
+				}
+			}
+			binder_proc_lock(proc);
+			ref = binder_get_ref_olocked(proc, target);
 			if (ref == NULL) {
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
@@ -1956,6 +3497,8 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_REQUEST_DEATH_NOTIFICATION" :
 					"BC_CLEAR_DEATH_NOTIFICATION",
 					target);
+				binder_proc_unlock(proc);
+				kfree(death);
 				break;
 			}
 
@@ -1968,6 +3511,11 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				       cookie, ref->debug_id, ref->desc,
 				       ref->strong, ref->weak, ref->node->debug_id);
 
+			/*
+			 * ref->death is read by binder_node_release() under
+			 * the node lock, so it is only changed with it held.
+			 */
+			binder_node_lock(ref->node);
 			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
 				if (ref->death) {
 					binder_user_error("binder: %d:%"
@@ -1975,29 +3523,25 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
+					binder_node_unlock(ref->node);
+					binder_proc_unlock(proc);
+					kfree(death);
 					break;
 				}
-				death = kzalloc(sizeof(*death), GFP_KERNEL);
-				if (death == NULL) {
-					thread->return_error = BR_ERROR;
-					if (binder_debug_mask & BINDER_DEBUG_FAILED_TRANSACTION)
-						printk(KERN_INFO "binder: %d:%d "
-							"BC_REQUEST_DEATH_NOTIFICATION failed\n",
-							proc->pid, thread->pid);
-					break;
-				}
-				binder_stats.obj_created[BINDER_STAT_DEATH]++;
+				binder_stats_created(BINDER_STAT_DEATH);
 				INIT_LIST_HEAD(&death->work.entry);
 				death->cookie = cookie;
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					binder_inner_proc_lock(proc);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc_ilocked(proc);
 					}
+					binder_inner_proc_unlock(proc);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2006,6 +3550,8 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					binder_node_unlock(ref->node);
+					binder_proc_unlock(proc);
 					break;
 				}
 				death = ref->death;
@@ -2017,22 +3563,28 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					binder_node_unlock(ref->node);
+					binder_proc_unlock(proc);
 					break;
 				}
 				ref->death = NULL;
+				binder_inner_proc_lock(proc);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc_ilocked(proc);
 					}
 				} else {
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				binder_inner_proc_unlock(proc);
 			}
+			binder_node_unlock(ref->node);
+			binder_proc_unlock(proc);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2042,6 +3594,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			binder_inner_proc_lock(proc);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2053,6 +3606,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				printk(KERN_INFO "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				       proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				binder_inner_proc_unlock(proc);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2066,9 +3620,10 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_add_tail(&death->work.entry, &thread->todo);
 				} else {
 					list_add_tail(&death->work.entry, &proc->todo);
-					wake_up_interruptible(&proc->wait);
+					binder_wakeup_proc_ilocked(proc);
 				}
 			}
+			binder_inner_proc_unlock(proc);
 		} break;
 
 		default:
@@ -2080,27 +3635,137 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 	return 0;
 }
 
+int
+binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
+		    void __user *buffer, int size, signed long *consumed)
+{
+	struct binder_txn_batch batch;
+	int ret;
+
+	memset(&batch, 0, sizeof(batch));
+	ret = binder_thread_write_cmds(proc, thread, buffer, size, consumed,
+				       &batch);
+	binder_txn_batch_flush(&batch);
+	return ret;
+}
+
 void
 binder_stat_br(struct binder_proc *proc, struct binder_thread *thread, uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
+static int
+binder_has_proc_work_ilocked(struct binder_proc *proc,
+			     struct binder_thread *thread)
+{
+	return !list_empty(&proc->todo) || !list_empty(&thread->todo) ||
+		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
+}
+
+/*
+ * BC_FREE_BUFFER moves the next one-way transaction of a node onto the
+ * todo list of the freeing thread. Let an idle thread take it if that
+ * thread has not come back for it yet. The work is not bound to a thread
+ * and the node still has only one async transaction in flight, so this
+ * keeps the per-node ordering.
+ *
+ * Such work is also kept on proc->stealable until some thread dequeues it,
+ * so idle threads find it without looking at the todo list of every other
+ * thread.
+ */
+static struct binder_transaction *
+binder_find_async_work_ilocked(struct binder_proc *proc,
+			       struct binder_thread *thread)
+{
+	struct binder_transaction *t;
+
+	list_for_each_entry(t, &proc->stealable, stealable_entry)
+		if (t->parked_on != thread)
+			return t;
+	return NULL;
+}
+
+static int
+binder_steal_async_work_ilocked(struct binder_proc *proc,
+				struct binder_thread *thread)
+{
+	struct binder_transaction *t = binder_find_async_work_ilocked(proc, thread);
+
+	if (t == NULL)
+		return 0;
+	list_move_tail(&t->work.entry, &thread->todo);
+	list_del_init(&t->stealable_entry);
+	proc->nr_stolen++;
+	return 1;
+}
+
+/*
+ * Only looks; poll and non-blocking reads must not move work around. The
+ * read that follows steals it.
+ */
 static int
 binder_has_proc_work(struct binder_proc *proc, struct binder_thread *thread)
 {
-	return !list_empty(&proc->todo) || (thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
+	int has_work;
+
+	binder_inner_proc_lock(proc);
+	has_work = binder_has_proc_work_ilocked(proc, thread) ||
+		binder_find_async_work_ilocked(proc, thread) != NULL;
+	binder_inner_proc_unlock(proc);
+	return has_work;
+}
+
+/*
+ * Sleep on thread->wait until there is proc work. While asleep the thread
+ * is on proc->waiting_threads so binder_wakeup_proc_ilocked can pick it;
+ * it puts itself back there whenever it wakes up to find nothing to do.
+ */
+static int
+binder_wait_for_proc_work(struct binder_proc *proc, struct binder_thread *thread)
+{
+	DEFINE_WAIT(wait);
+	int ret = 0;
+
+	binder_inner_proc_lock(proc);
+	for (;;) {
+		prepare_to_wait(&thread->wait, &wait, TASK_INTERRUPTIBLE);
+		if (binder_has_proc_work_ilocked(proc, thread) ||
+		    binder_steal_async_work_ilocked(proc, thread))
+			break;
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		thread->last_cpu = raw_smp_processor_id();
+		if (list_empty(&thread->waiting_thread_node))
+			list_add(&thread->waiting_thread_node,
+				 &proc->waiting_threads);
+		binder_inner_proc_unlock(proc);
+		schedule();
+		binder_inner_proc_lock(proc);
+	}
+	list_del_init(&thread->waiting_thread_node);
+	finish_wait(&thread->wait, &wait);
+	binder_inner_proc_unlock(proc);
+	return ret;
 }
 
 static int
 binder_has_thread_work(struct binder_thread *thread)
 {
-	return !list_empty(&thread->todo) || thread->return_error != BR_OK ||
+	int has_work;
+
+	binder_inner_proc_lock(thread->proc);
+	has_work = !list_empty(&thread->todo) ||
+		thread->return_error != BR_OK ||
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
+	binder_inner_proc_unlock(thread->proc);
+	return has_work;
 }
 
 static int
@@ -2120,21 +3785,30 @@ binder_thread_read(struct binder_proc *proc, struct binder_thread *thread,
 	}
 
 retry:
+	binder_inner_proc_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL && list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
-		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+		uint32_t return_error = thread->return_error;
+		uint32_t return_error2 = thread->return_error2;
+
+		binder_inner_proc_unlock(proc);
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
 			if (ptr == end)
 				goto done;
+			binder_inner_proc_lock(proc);
 			thread->return_error2 = BR_OK;
+			binder_inner_proc_unlock(proc);
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
+		if (put_user(return_error, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
+		binder_inner_proc_lock(proc);
 		thread->return_error = BR_OK;
+		binder_inner_proc_unlock(proc);
 		goto done;
 	}
 
@@ -2142,7 +3816,7 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	binder_inner_proc_unlock(proc);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2152,12 +3826,12 @@ retry:
 				proc->pid, thread->pid, thread->looper);
 			wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_priority(current, proc->default_priority, 1);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
 		} else
-			ret = wait_event_interruptible_exclusive(proc->wait, binder_has_proc_work(proc, thread));
+			ret = binder_wait_for_proc_work(proc, thread);
 	} else {
 		if (non_block) {
 			if (!binder_has_thread_work(thread))
@@ -2165,10 +3839,11 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	binder_inner_proc_lock(proc);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	binder_inner_proc_unlock(proc);
 
 	if (ret)
 		return ret;
@@ -2177,111 +3852,168 @@ retry:
 		uint32_t cmd;
 		struct binder_transaction_data tr;
 		struct binder_work *w;
+		struct list_head *list;
 		struct binder_transaction *t = NULL;
+		struct binder_thread *t_from;
+		ktime_t now;
+		s64 us;
 
+		/*
+		 * Work is taken off its list under the inner lock and then
+		 * copied out without it; on a fault it is put back at the
+		 * head of the list it came from.
+		 */
+		binder_inner_proc_lock(proc);
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
+		else if (wait_for_proc_work &&
+			   binder_steal_async_work_ilocked(proc, thread))
+			list = &thread->todo;
 		else {
+			binder_inner_proc_unlock(proc);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			binder_inner_proc_unlock(proc);
 			break;
+		}
+		w = list_first_entry(list, struct binder_work, entry);
+		list_del_init(&w->entry);
+		if (list == &proc->todo)
+			proc->nr_proc_work++;
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			t = container_of(w, struct binder_transaction, work);
+			list_del_init(&t->stealable_entry);
+			binder_inner_proc_unlock(proc);
 		} break;
-		case BINDER_WORK_TRANSACTION_COMPLETE: {
-			cmd = BR_TRANSACTION_COMPLETE;
-			if (put_user(cmd, (uint32_t __user *)ptr))
+		case BINDER_WORK_TRANSACTION_COMPLETE:
+		case BINDER_WORK_TRANSACTION_COMPLETE_ALMOST_FULL: {
+			binder_inner_proc_unlock(proc);
+			if (w->type == BINDER_WORK_TRANSACTION_COMPLETE)
+				cmd = BR_TRANSACTION_COMPLETE;
+			else
+				cmd = BR_TRANSACTION_COMPLETE_ALMOST_FULL;
+			if (put_user(cmd, (uint32_t __user *)ptr)) {
+				binder_inner_proc_lock(proc);
+				list_add(&w->entry, list);
+				binder_inner_proc_unlock(proc);
 				return -EFAULT;
+			}
 			ptr += sizeof(uint32_t);
 
 			binder_stat_br(proc, thread, cmd);
 			if (binder_debug_mask & BINDER_DEBUG_TRANSACTION_COMPLETE)
-				printk(KERN_INFO "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
-				       proc->pid, thread->pid);
+				printk(KERN_INFO "binder: %d:%d %s\n",
+				       proc->pid, thread->pid,
+				       cmd == BR_TRANSACTION_COMPLETE ?
+				       "BR_TRANSACTION_COMPLETE" :
+				       "BR_TRANSACTION_COMPLETE_ALMOST_FULL");
 
-			list_del(&w->entry);
 			kfree(w);
-			binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
-			uint32_t cmd = BR_NOOP;
-			const char *cmd_name;
+			uint32_t cmds[2];
+			const char *cmd_names[2];
+			int ncmds = 0;
+			int i;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+			int node_debug_id = node->debug_id;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
-			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
+			int weak = !hlist_empty(&node->refs) || node->local_weak_refs ||
+				node->tmp_refs || strong;
+
+			/*
+			 * Settle all state changes while locked; at most two
+			 * commands (INCREFS+ACQUIRE or RELEASE+DECREFS) result.
+			 */
 			if (weak && !node->has_weak_ref) {
-				cmd = BR_INCREFS;
-				cmd_name = "BR_INCREFS";
+				cmds[ncmds] = BR_INCREFS;
+				cmd_names[ncmds++] = "BR_INCREFS";
 				node->has_weak_ref = 1;
 				node->pending_weak_ref = 1;
 				node->local_weak_refs++;
-			} else if (strong && !node->has_strong_ref) {
-				cmd = BR_ACQUIRE;
-				cmd_name = "BR_ACQUIRE";
+			}
+			if (strong && !node->has_strong_ref) {
+				cmds[ncmds] = BR_ACQUIRE;
+				cmd_names[ncmds++] = "BR_ACQUIRE";
 				node->has_strong_ref = 1;
 				node->pending_strong_ref = 1;
 				node->local_strong_refs++;
-			} else if (!strong && node->has_strong_ref) {
-				cmd = BR_RELEASE;
-				cmd_name = "BR_RELEASE";
+			}
+			if (!strong && node->has_strong_ref) {
+				cmds[ncmds] = BR_RELEASE;
+				cmd_names[ncmds++] = "BR_RELEASE";
 				node->has_strong_ref = 0;
-			} else if (!weak && node->has_weak_ref) {
-				cmd = BR_DECREFS;
-				cmd_name = "BR_DECREFS";
+			}
+			if (!weak && node->has_weak_ref) {
+				cmds[ncmds] = BR_DECREFS;
+				cmd_names[ncmds++] = "BR_DECREFS";
 				node->has_weak_ref = 0;
 			}
-			if (cmd != BR_NOOP) {
-				if (put_user(cmd, (uint32_t __user *)ptr))
+			if (!weak && !strong) {
+				if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
+					printk(KERN_INFO "binder: %d:%d node %d u%p c%p deleted\n",
+					       proc->pid, thread->pid, node_debug_id, node_ptr, node_cookie);
+				binder_erase_node_ilocked(proc, node);
+				binder_inner_proc_unlock(proc);
+				/* wait for anyone still inside node->lock */
+				binder_node_lock(node);
+				binder_node_unlock(node);
+				binder_free_node(node);
+			} else {
+				binder_inner_proc_unlock(proc);
+				if (ncmds == 0 && (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS))
+					printk(KERN_INFO "binder: %d:%d node %d u%p c%p state unchanged\n",
+					       proc->pid, thread->pid, node_debug_id, node_ptr, node_cookie);
+			}
+			for (i = 0; i < ncmds; i++) {
+				if (put_user(cmds[i], (uint32_t __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
+				if (put_user(node_ptr, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
+				if (put_user(node_cookie, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
 
-				binder_stat_br(proc, thread, cmd);
+				binder_stat_br(proc, thread, cmds[i]);
 				if (binder_debug_mask & BINDER_DEBUG_USER_REFS)
 					printk(KERN_INFO "binder: %d:%d %s %d u%p c%p\n",
-					       proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
-			} else {
-				list_del_init(&w->entry);
-				if (!weak && !strong) {
-					if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
-						printk(KERN_INFO "binder: %d:%d node %d u%p c%p deleted\n",
-						       proc->pid, thread->pid, node->debug_id, node->ptr, node->cookie);
-					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats.obj_deleted[BINDER_STAT_NODE]++;
-				} else {
-					if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
-						printk(KERN_INFO "binder: %d:%d node %d u%p c%p state unchanged\n",
-						       proc->pid, thread->pid, node->debug_id, node->ptr, node->cookie);
-				}
+					       proc->pid, thread->pid, cmd_names[i], node_debug_id, node_ptr, node_cookie);
 			}
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death = container_of(w, struct binder_ref_death, work);
+			void __user *cookie = death->cookie;
 			uint32_t cmd;
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
+
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
-			else
+				binder_inner_proc_unlock(proc);
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			} else {
 				cmd = BR_DEAD_BINDER;
+				list_add_tail(&w->entry, &proc->delivered_death);
+				binder_inner_proc_unlock(proc);
+			}
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 			if (binder_debug_mask & BINDER_DEBUG_DEATH_NOTIFICATION)
@@ -2290,17 +4022,14 @@ retry:
 				       cmd == BR_DEAD_BINDER ?
 				       "BR_DEAD_BINDER" :
 				       "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				       death->cookie);
+				       cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats.obj_deleted[BINDER_STAT_DEATH]++;
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
+		default:
+			binder_inner_proc_unlock(proc);
+			break;
 		}
 
 		if (!t)
@@ -2311,13 +4040,6 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2328,8 +4050,9 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
-		if (t->from) {
-			struct task_struct *sender = t->from->proc->tsk;
+		t_from = binder_get_txn_from(t);
+		if (t_from) {
+			struct task_struct *sender = t_from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender, current->nsproxy->pid_ns);
 		} else {
 			tr.sender_pid = 0;
@@ -2340,33 +4063,64 @@ retry:
 		tr.data.ptr.buffer = (void *)((void *)t->buffer->data + proc->user_buffer_offset);
 		tr.data.ptr.offsets = tr.data.ptr.buffer + ALIGN(t->buffer->data_size, sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
+		if (put_user(cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), &tr, sizeof(tr))) {
+			if (t_from)
+				binder_thread_dec_tmpref(t_from);
+			binder_inner_proc_lock(proc);
+			list_add(&t->work.entry, list);
+			binder_inner_proc_unlock(proc);
 			return -EFAULT;
+		}
 		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
 		ptr += sizeof(tr);
 
+		/*
+		 * Only once t is ours for good: if the copy fails it goes back
+		 * on the list and saved_priority must still be the real one
+		 * when it is picked up again.
+		 */
+		if (cmd == BR_TRANSACTION && !t->set_priority_called) {
+			t->saved_priority = binder_get_priority(current);
+			binder_transaction_priority(current, t,
+						    t->buffer->target_node);
+		}
+
 		binder_stat_br(proc, thread, cmd);
+		now = ktime_get();
+		if (cmd == BR_TRANSACTION) {
+			t->dequeue_time = now;
+			us = binder_latency_add(proc, BINDER_LATENCY_DEQUEUE,
+						t->send_time, now);
+		} else
+			us = binder_latency_add(proc, BINDER_LATENCY_ROUND_TRIP,
+						t->call_time, now);
+		trace_mark(binder_transaction_dequeue,
+			   "debug_id %d proc %d thread %d reply %d latency_us %lld",
+			   t->debug_id, proc->pid, thread->pid, cmd == BR_REPLY,
+			   (long long)us);
 		if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
 			printk(KERN_INFO "binder: %d:%d %s %d %d:%d, cmd %d size %d-%d ptr %p-%p\n",
 			       proc->pid, thread->pid,
 			       (cmd == BR_TRANSACTION) ? "BR_TRANSACTION" : "BR_REPLY",
-			       t->debug_id, t->from ? t->from->proc->pid : 0,
-			       t->from ? t->from->pid : 0, cmd,
+			       t->debug_id, t_from ? t_from->proc->pid : 0,
+			       t_from ? t_from->pid : 0, cmd,
 			       t->buffer->data_size, t->buffer->offsets_size,
 			       tr.data.ptr.buffer, tr.data.ptr.offsets);
+		if (t_from)
+			binder_thread_dec_tmpref(t_from);
 
-		list_del(&t->work.entry);
+		mutex_lock(&proc->alloc_lock);
 		t->buffer->allow_user_free = 1;
+		mutex_unlock(&proc->alloc_lock);
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
+			binder_inner_proc_lock(proc);
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
+			binder_inner_proc_unlock(proc);
 		} else {
-			t->buffer->transaction = NULL;
-			kfree(t);
-			binder_stats.obj_deleted[BINDER_STAT_TRANSACTION]++;
+			binder_free_transaction(t);
 		}
 		break;
 	}
@@ -2374,36 +4128,58 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
+	binder_inner_proc_lock(proc);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		binder_inner_proc_unlock(proc);
 		if (binder_debug_mask & BINDER_DEBUG_THREADS)
 			printk(KERN_INFO "binder: %d:%d BR_SPAWN_LOOPER\n",
 			       proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		binder_inner_proc_unlock(proc);
 	return 0;
 }
 
-static void binder_release_work(struct list_head *list)
+static void binder_release_work(struct binder_proc *proc, struct list_head *list)
 {
 	struct binder_work *w;
-	while (!list_empty(list)) {
+
+	while (1) {
+		binder_inner_proc_lock(proc);
+		if (list_empty(list)) {
+			binder_inner_proc_unlock(proc);
+			break;
+		}
 		w = list_first_entry(list, struct binder_work, entry);
 		list_del_init(&w->entry);
+		if (w->type == BINDER_WORK_TRANSACTION)
+			list_del_init(&container_of(w, struct binder_transaction,
+						    work)->stealable_entry);
+		binder_inner_proc_unlock(proc);
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			struct binder_transaction *t = container_of(w, struct binder_transaction, work);
 			if (t->buffer->target_node && !(t->flags & TF_ONE_WAY))
 				binder_send_failed_reply(t, BR_DEAD_REPLY);
+			else
+				binder_free_transaction(t);
 		} break;
-		case BINDER_WORK_TRANSACTION_COMPLETE: {
+		case BINDER_WORK_TRANSACTION_COMPLETE:
+		case BINDER_WORK_TRANSACTION_COMPLETE_ALMOST_FULL: {
 			kfree(w);
-			binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+		} break;
+		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
+		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
+			/* the ref no longer points at a cleared death */
+			kfree(container_of(w, struct binder_ref_death, work));
+			binder_stats_deleted(BINDER_STAT_DEATH);
 		} break;
 		default:
 			break;
@@ -2412,7 +4188,8 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+static struct binder_thread *binder_get_thread_ilocked(
+	struct binder_proc *proc, struct binder_thread *new_thread)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
@@ -2427,37 +4204,151 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
-	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats.obj_created[BINDER_STAT_THREAD]++;
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+			return thread;
 	}
+	if (new_thread == NULL)
+		return NULL;
+	thread = new_thread;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	get_task_struct(current);
+	thread->task = current;
+	atomic_set(&thread->tmp_ref, 0);
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	INIT_LIST_HEAD(&thread->waiting_thread_node);
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
+	return thread;
+}
+
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *new_thread;
+
+	binder_inner_proc_lock(proc);
+	thread = binder_get_thread_ilocked(proc, NULL);
+	binder_inner_proc_unlock(proc);
+	if (thread)
+		return thread;
+
+	new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+	if (new_thread == NULL)
+		return NULL;
+	binder_inner_proc_lock(proc);
+	thread = binder_get_thread_ilocked(proc, new_thread);
+	binder_inner_proc_unlock(proc);
+	if (thread != new_thread)
+		kfree(new_thread);
 	return thread;
 }
 
-static int binder_free_thread(struct binder_proc *proc, struct binder_thread *thread)
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct rb_node *n;
+	struct binder_transaction *t;
+	int buffers, page_count;
+	int i;
+
+	BUG_ON(!list_empty(&proc->todo));
+	BUG_ON(!list_empty(&proc->delivered_death));
+
+	mutex_lock(&proc->alloc_lock);
+	buffers = 0;
+	while ((n = rb_first(&proc->allocated_buffers))) {
+		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer, rb_node);
+		t = buffer->transaction;
+		if (t) {
+			t->buffer = NULL;
+			buffer->transaction = NULL;
+			printk(KERN_ERR "binder: release proc %d, transaction %d, not freed\n", proc->pid, t->debug_id);
+			/*BUG();*/
+		}
+		binder_free_buf_locked(proc, buffer);
+		buffers++;
+	}
+	for (i = 0; i < BINDER_SLAB_CLASSES; i++) {
+		while (!list_empty(&proc->slabs[i].slabs))
+			binder_slab_destroy(proc, list_first_entry(
+				&proc->slabs[i].slabs, struct binder_slab,
+				entry));
+	}
+
+	page_count = 0;
+	if (proc->pages) {
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			struct binder_lru_page *page = &proc->pages[i];
+
+			if (page->page_ptr == NULL)
+				continue;
+			spin_lock(&binder_lru_lock);
+			if (!list_empty(&page->lru)) {
+				list_del_init(&page->lru);
+				binder_lru_count--;
+				proc->pages_cached--;
+			} else if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
+				printk(KERN_INFO "binder_release: %d: page %d at %p not freed\n", proc->pid, i, proc->buffer + i * PAGE_SIZE);
+			spin_unlock(&binder_lru_lock);
+			__free_page(page->page_ptr);
+			page_count++;
+		}
+		kfree(proc->pages);
+		vfree(proc->buffer);
+	}
+	mutex_unlock(&proc->alloc_lock);
+
+	put_task_struct(proc->tsk);
+
+	if (binder_debug_mask & BINDER_DEBUG_OPEN_CLOSE)
+		printk(KERN_INFO "binder_release: %d buffers %d, pages %d\n",
+		       proc->pid, buffers, page_count);
+
+	kfree(proc);
+	binder_stats_deleted(BINDER_STAT_PROC);
+}
+
+static void binder_free_thread(struct binder_thread *thread)
+{
+	BUG_ON(!list_empty(&thread->todo));
+	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_proc_dec_tmpref(thread->proc);
+	put_task_struct(thread->task);
+	kfree(thread);
+}
+
+static int binder_thread_release(struct binder_proc *proc,
+				 struct binder_thread *thread)
 {
 	struct binder_transaction *t;
 	struct binder_transaction *send_reply = NULL;
 	int active_transactions = 0;
+	struct binder_transaction *last_t = NULL;
 
+	binder_inner_proc_lock(proc);
+	/*
+	 * take a ref on the proc so it survives after we remove this
+	 * thread from proc->threads, and a ref on the thread so it
+	 * survives until we are done walking its transaction stack
+	 */
+	proc->tmp_ref++;
+	atomic_inc(&thread->tmp_ref);
 	rb_erase(&thread->rb_node, &proc->threads);
+	list_del_init(&thread->waiting_thread_node);
 	t = thread->transaction_stack;
-	if (t && t->to_thread == thread)
-		send_reply = t;
+	if (t) {
+		spin_lock(&t->lock);
+		if (t->to_thread == thread)
+			send_reply = t;
+	}
+	thread->is_dead = 1;
+
 	while (t) {
+		last_t = t;
 		active_transactions++;
 		if (binder_debug_mask & BINDER_DEBUG_DEAD_TRANSACTION)
 			printk(KERN_INFO "binder: release %d:%d transaction %d %s, still active\n",
@@ -2475,12 +4366,16 @@ static int binder_free_thread(struct binder_proc *proc, struct binder_thread *th
 			t = t->from_parent;
 		} else
 			BUG();
+		spin_unlock(&last_t->lock);
+		if (t)
+			spin_lock(&t->lock);
 	}
+	binder_inner_proc_unlock(proc);
+
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
-	binder_release_work(&thread->todo);
-	kfree(thread);
-	binder_stats.obj_deleted[BINDER_STAT_THREAD]++;
+	binder_release_work(proc, &thread->todo);
+	binder_thread_dec_tmpref(thread);
 	return active_transactions;
 }
 
@@ -2490,12 +4385,14 @@ static unsigned int binder_poll(struct file *filp, struct poll_table_struct *wai
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
+	if (thread == NULL)
+		return POLLERR;
 
+	binder_inner_proc_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_inner_proc_unlock(proc);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2513,6 +4410,46 @@ static unsigned int binder_poll(struct file *filp, struct poll_table_struct *wai
 	return 0;
 }
 
+static int binder_ioctl_set_ctx_mgr(struct binder_proc *proc)
+{
+	int ret = 0;
+	struct binder_node *new_node;
+
+	mutex_lock(&binder_context_mgr_node_lock);
+	if (binder_context_mgr_node != NULL) {
+		printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
+		ret = -EBUSY;
+		goto out;
+	}
+	if (binder_context_mgr_uid != -1) {
+		if (binder_context_mgr_uid != current->euid) {
+			printk(KERN_ERR "binder: BINDER_SET_"
+			       "CONTEXT_MGR bad uid %d != %d\n",
+			       current->euid,
+			       binder_context_mgr_uid);
+			ret = -EPERM;
+			goto out;
+		}
+	} else
+		binder_context_mgr_uid = current->euid;
+	new_node = binder_new_node(proc, NULL, NULL, 0);
+	if (new_node == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	binder_node_inner_lock(new_node);
+	new_node->local_weak_refs++;
+	new_node->local_strong_refs++;
+	new_node->has_strong_ref = 1;
+	new_node->has_weak_ref = 1;
+	binder_context_mgr_node = new_node;
+	binder_node_inner_unlock(new_node);
+	binder_put_node(new_node);
+out:
+	mutex_unlock(&binder_context_mgr_node_lock);
+	return ret;
+}
+
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
@@ -2527,7 +4464,6 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2559,8 +4495,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		if (bwr.read_size > 0) {
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+			binder_inner_proc_lock(proc);
 			if (!list_empty(&proc->todo))
-				wake_up_interruptible(&proc->wait);
+				binder_wakeup_proc_ilocked(proc);
+			binder_inner_proc_unlock(proc);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2576,44 +4514,42 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		binder_inner_proc_lock(proc);
+		proc->max_threads = max_threads;
+		binder_inner_proc_unlock(proc);
 		break;
-	case BINDER_SET_CONTEXT_MGR:
-		if (binder_context_mgr_node != NULL) {
-			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
-			ret = -EBUSY;
+	}
+	case BINDER_SET_ASYNC_THROTTLE: {
+		int enable;
+
+		if (size != sizeof(int)) {
+			ret = -EINVAL;
 			goto err;
 		}
-		if (binder_context_mgr_uid != -1) {
-			if (binder_context_mgr_uid != current->euid) {
-				printk(KERN_ERR "binder: BINDER_SET_"
-				       "CONTEXT_MGR bad uid %d != %d\n",
-				       current->euid,
-				       binder_context_mgr_uid);
-				ret = -EPERM;
-				goto err;
-			}
-		} else
-			binder_context_mgr_uid = current->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
-			ret = -ENOMEM;
+		if (copy_from_user(&enable, ubuf, sizeof(enable))) {
+			ret = -EINVAL;
 			goto err;
 		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
+		proc->async_throttle = !!enable;
+		break;
+	}
+	case BINDER_SET_CONTEXT_MGR:
+		ret = binder_ioctl_set_ctx_mgr(proc);
+		if (ret)
+			goto err;
 		break;
 	case BINDER_THREAD_EXIT:
 		if (binder_debug_mask & BINDER_DEBUG_THREADS)
 			printk(KERN_INFO "binder: %d:%d exit\n",
 			       proc->pid, thread->pid);
-		binder_free_thread(proc, thread);
+		binder_thread_release(proc, thread);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2632,9 +4568,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		binder_inner_proc_lock(proc);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		binder_inner_proc_unlock(proc);
+	}
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2668,6 +4606,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2682,6 +4621,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	}
 	vma->vm_flags = (vma->vm_flags | VM_DONTCOPY) & ~VM_MAYWRITE;
 
+	mutex_lock(&proc->alloc_lock);
 	area = get_vm_area(vma->vm_end - vma->vm_start, VM_IOREMAP);
 	if (area == NULL) {
 		ret = -ENOMEM;
@@ -2706,6 +4646,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2721,8 +4665,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
 	proc->free_async_space = proc->buffer_size / 2;
+	proc->async_space = proc->free_async_space;
 	barrier();
 	proc->vma = vma;
+	mutex_unlock(&proc->alloc_lock);
 
 	/*printk(KERN_INFO "binder_mmap: %d %lx-%lx maps %p\n", proc->pid, vma->vm_start, vma->vm_end, proc->buffer);*/
 	return 0;
@@ -2732,7 +4678,7 @@ err_alloc_small_buf_failed:
 err_alloc_pages_failed:
 	vfree(proc->buffer);
 err_get_vm_area_failed:
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&proc->alloc_lock);
 err_bad_arg:
 	printk(KERN_ERR "binder_mmap: %d %lx-%lx %s failed %d\n", proc->pid, vma->vm_start, vma->vm_end, failure_string, ret);
 	return ret;
@@ -2741,6 +4687,7 @@ err_bad_arg:
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	if (binder_debug_mask & BINDER_DEBUG_OPEN_CLOSE)
 		printk(KERN_INFO "binder_open: %d:%d\n", current->group_leader->pid, current->pid);
@@ -2750,16 +4697,23 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->outer_lock);
+	spin_lock_init(&proc->inner_lock);
+	mutex_init(&proc->alloc_lock);
 	INIT_LIST_HEAD(&proc->todo);
+	INIT_LIST_HEAD(&proc->waiting_threads);
+	INIT_LIST_HEAD(&proc->stealable);
+	for (i = 0; i < BINDER_SLAB_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->slabs[i].slabs);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats.obj_created[BINDER_STAT_PROC]++;
-	hlist_add_head(&proc->proc_node, &binder_procs);
+	proc->default_priority = binder_get_priority(current);
+	binder_stats_created(BINDER_STAT_PROC);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	mutex_lock(&binder_procs_lock);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
@@ -2776,7 +4730,7 @@ static int binder_flush(struct file *filp, fl_owner_t id)
 	struct binder_proc *proc = filp->private_data;
 	int wake_count = 0;
 
-	mutex_lock(&binder_lock);
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2786,7 +4740,7 @@ static int binder_flush(struct file *filp, fl_owner_t id)
 		}
 	}
 	wake_up_interruptible_all(&proc->wait);
-	mutex_unlock(&binder_lock);
+	binder_inner_proc_unlock(proc);
 
 	if (binder_debug_mask & BINDER_DEBUG_OPEN_CLOSE)
 		printk(KERN_INFO "binder_flush: %d woke %d threads\n", proc->pid, wake_count);
@@ -2794,33 +4748,95 @@ static int binder_flush(struct file *filp, fl_owner_t id)
 	return 0;
 }
 
-static int binder_release(struct inode *nodp, struct file *filp)
+/*
+ * Called with a tmp ref held on node, which has already been erased from
+ * its proc's nodes tree. Returns refs plus the number of incoming refs.
+ */
+static int binder_node_release(struct binder_node *node, int refs)
 {
+	struct binder_ref *ref;
 	struct hlist_node *pos;
-	struct binder_transaction *t;
+	struct binder_proc *proc = node->proc;
+	int death = 0;
+
+	binder_node_lock(node);
+	binder_inner_proc_lock(proc);
+	list_del_init(&node->work.entry);
+	if (hlist_empty(&node->refs) && node->tmp_refs == 1) {
+		binder_inner_proc_unlock(proc);
+		binder_node_unlock(node);
+		binder_free_node(node);
+		return refs;
+	}
+	node->proc = NULL;
+	node->local_strong_refs = 0;
+	node->local_weak_refs = 0;
+	binder_inner_proc_unlock(proc);
+
+	spin_lock(&binder_dead_nodes_lock);
+	hlist_add_head(&node->dead_node, &binder_dead_nodes);
+	spin_unlock(&binder_dead_nodes_lock);
+
+	hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
+		refs++;
+		if (!ref->death)
+			continue;
+		death++;
+		binder_inner_proc_lock(ref->proc);
+		if (list_empty(&ref->death->work.entry)) {
+			ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+			list_add_tail(&ref->death->work.entry, &ref->proc->todo);
+			binder_wakeup_proc_ilocked(ref->proc);
+		} else
+			BUG();
+		binder_inner_proc_unlock(ref->proc);
+	}
+	if (binder_debug_mask & BINDER_DEBUG_DEAD_BINDER)
+		printk(KERN_INFO "binder: node %d now dead, refs %d, death %d\n", node->debug_id, refs, death);
+	binder_node_unlock(node);
+	binder_put_node(node);
+	return refs;
+}
+
+static int binder_release(struct inode *nodp, struct file *filp)
+{
 	struct rb_node *n;
 	struct binder_proc *proc = filp->private_data;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
 		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
 		remove_proc_entry(strbuf, binder_proc_dir_entry_proc);
 	}
-	mutex_lock(&binder_lock);
+	mutex_lock(&binder_procs_lock);
 	hlist_del(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
+
+	mutex_lock(&binder_context_mgr_node_lock);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		if (binder_debug_mask & BINDER_DEBUG_DEAD_BINDER)
 			printk(KERN_INFO "binder_release: %d context_mgr_node gone\n", proc->pid);
 		binder_context_mgr_node = NULL;
 	}
+	mutex_unlock(&binder_context_mgr_node_lock);
 
+	binder_inner_proc_lock(proc);
+	/*
+	 * The proc is freed by the last binder_proc_dec_tmpref() once it is
+	 * dead and all of its threads are gone.
+	 */
+	proc->tmp_ref++;
+	proc->is_dead = 1;
 	threads = 0;
 	active_transactions = 0;
 	while ((n = rb_first(&proc->threads))) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
+
+		binder_inner_proc_unlock(proc);
 		threads++;
-		active_transactions += binder_free_thread(proc, thread);
+		active_transactions += binder_thread_release(proc, thread);
+		binder_inner_proc_lock(proc);
 	}
 	nodes = 0;
 	incoming_refs = 0;
@@ -2828,96 +4844,57 @@ static int binder_release(struct inode *nodp, struct file *filp)
 		struct binder_node *node = rb_entry(n, struct binder_node, rb_node);
 
 		nodes++;
-		rb_erase(&node->rb_node, &proc->nodes);
-		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats.obj_deleted[BINDER_STAT_NODE]++;
-		} else {
-			struct binder_ref *ref;
-			int death = 0;
-
-			node->proc = NULL;
-			node->local_strong_refs = 0;
-			node->local_weak_refs = 0;
-			hlist_add_head(&node->dead_node, &binder_dead_nodes);
-
-			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
-				incoming_refs++;
-				if (ref->death) {
-					death++;
-					if (list_empty(&ref->death->work.entry)) {
-						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
-						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
-					} else
-						BUG();
-				}
-			}
-			if (binder_debug_mask & BINDER_DEBUG_DEAD_BINDER)
-				printk(KERN_INFO "binder: node %d now dead, refs %d, death %d\n", node->debug_id, incoming_refs, death);
-		}
+		binder_inc_node_tmpref_ilocked(node);
+		binder_erase_node_ilocked(proc, node);
+		binder_inner_proc_unlock(proc);
+		incoming_refs = binder_node_release(node, incoming_refs);
+		binder_inner_proc_lock(proc);
 	}
+	binder_inner_proc_unlock(proc);
+
 	outgoing_refs = 0;
+	binder_proc_lock(proc);
 	while ((n = rb_first(&proc->refs_by_desc))) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref, rb_node_desc);
 		outgoing_refs++;
-		binder_delete_ref(ref);
-	}
-	binder_release_work(&proc->todo);
-	buffers = 0;
-
-	while ((n = rb_first(&proc->allocated_buffers))) {
-		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer, rb_node);
-		t = buffer->transaction;
-		if (t) {
-			t->buffer = NULL;
-			buffer->transaction = NULL;
-			printk(KERN_ERR "binder: release proc %d, transaction %d, not freed\n", proc->pid, t->debug_id);
-			/*BUG();*/
-		}
-		binder_free_buf(proc, buffer);
-		buffers++;
-	}
-
-	binder_stats.obj_deleted[BINDER_STAT_PROC]++;
-	mutex_unlock(&binder_lock);
-
-	page_count = 0;
-	if (proc->pages) {
-		int i;
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
-					printk(KERN_INFO "binder_release: %d: page %d at %p not freed\n", proc->pid, i, proc->buffer + i * PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
-			}
-		}
-		kfree(proc->pages);
-		vfree(proc->buffer);
+		binder_delete_ref_olocked(ref);
 	}
-
-	put_task_struct(proc->tsk);
+	binder_proc_unlock(proc);
+	binder_release_work(proc, &proc->todo);
+	binder_release_work(proc, &proc->delivered_death);
 
 	if (binder_debug_mask & BINDER_DEBUG_OPEN_CLOSE)
-		printk(KERN_INFO "binder_release: %d threads %d, nodes %d (ref %d), refs %d, active transactions %d, buffers %d, pages %d\n",
-		       proc->pid, threads, nodes, incoming_refs, outgoing_refs, active_transactions, buffers, page_count);
+		printk(KERN_INFO "binder_release: %d threads %d, nodes %d (ref %d), refs %d, active transactions %d\n",
+		       proc->pid, threads, nodes, incoming_refs, outgoing_refs, active_transactions);
 
-	kfree(proc);
+	binder_proc_dec_tmpref(proc);
 	return 0;
 }
 
-static char *print_binder_transaction(char *buf, char *end, const char *prefix, struct binder_transaction *t)
+/* called with proc->inner_lock held, proc being the proc being printed */
+static char *print_binder_transaction_ilocked(char *buf, char *end,
+	struct binder_proc *proc, const char *prefix,
+	struct binder_transaction *t)
 {
-	buf += snprintf(buf, end - buf, "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+	struct binder_proc *to_proc;
+
+	spin_lock(&t->lock);
+	to_proc = t->to_proc;
+	buf += snprintf(buf, end - buf, "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %d:%d r%d",
 			prefix, t->debug_id, t, t->from ? t->from->proc->pid : 0,
 			t->from ? t->from->pid : 0,
-			t->to_proc ? t->to_proc->pid : 0,
+			to_proc ? to_proc->pid : 0,
 			t->to_thread ? t->to_thread->pid : 0,
-			t->code, t->flags, t->priority, t->need_reply);
+			t->code, t->flags, t->priority.sched_policy,
+			t->priority.prio, t->need_reply);
+	spin_unlock(&t->lock);
 	if (buf >= end)
 		return buf;
+	if (proc != to_proc) {
+		/* t->buffer is protected by the inner lock of to_proc */
+		buf += snprintf(buf, end - buf, "\n");
+		return buf;
+	}
 	if (t->buffer == NULL) {
 		buf += snprintf(buf, end - buf, " buffer free\n");
 		return buf;
@@ -2943,7 +4920,8 @@ static char *print_binder_buffer(char *buf, char *end, const char *prefix, struc
 	return buf;
 }
 
-static char *print_binder_work(char *buf, char *end, const char *prefix,
+static char *print_binder_work_ilocked(char *buf, char *end,
+	struct binder_proc *proc, const char *prefix,
 	const char *transaction_prefix, struct binder_work *w)
 {
 	struct binder_node *node;
@@ -2952,12 +4930,17 @@ static char *print_binder_work(char *buf, char *end, const char *prefix,
 	switch (w->type) {
 	case BINDER_WORK_TRANSACTION:
 		t = container_of(w, struct binder_transaction, work);
-		buf = print_binder_transaction(buf, end, transaction_prefix, t);
+		buf = print_binder_transaction_ilocked(buf, end, proc,
+						       transaction_prefix, t);
 		break;
 	case BINDER_WORK_TRANSACTION_COMPLETE:
 		buf += snprintf(buf, end - buf,
 				"%stransaction complete\n", prefix);
 		break;
+	case BINDER_WORK_TRANSACTION_COMPLETE_ALMOST_FULL:
+		buf += snprintf(buf, end - buf,
+				"%stransaction complete, almost full\n", prefix);
+		break;
 	case BINDER_WORK_NODE:
 		node = container_of(w, struct binder_node, work);
 		buf += snprintf(buf, end - buf, "%snode work %d: u%p c%p\n",
@@ -2982,8 +4965,9 @@ static char *print_binder_work(char *buf, char *end, const char *prefix,
 	return buf;
 }
 
-static char *print_binder_thread(char *buf, char *end, struct binder_thread *thread, int print_always)
+static char *print_binder_thread_ilocked(char *buf, char *end, struct binder_thread *thread, int print_always)
 {
+	struct binder_proc *proc = thread->proc;
 	struct binder_transaction *t;
 	struct binder_work *w;
 	char *start_buf = buf;
@@ -2996,28 +4980,29 @@ static char *print_binder_thread(char *buf, char *end, struct binder_thread *thr
 		if (buf >= end)
 			break;
 		if (t->from == thread) {
-			buf = print_binder_transaction(buf, end, "    outgoing transaction", t);
+			buf = print_binder_transaction_ilocked(buf, end, proc, "    outgoing transaction", t);
 			t = t->from_parent;
 		} else if (t->to_thread == thread) {
-			buf = print_binder_transaction(buf, end, "    incoming transaction", t);
+			buf = print_binder_transaction_ilocked(buf, end, proc, "    incoming transaction", t);
 			t = t->to_parent;
 		} else {
-			buf = print_binder_transaction(buf, end, "    bad transaction", t);
+			buf = print_binder_transaction_ilocked(buf, end, proc, "    bad transaction", t);
 			t = NULL;
 		}
 	}
 	list_for_each_entry(w, &thread->todo, entry) {
 		if (buf >= end)
 			break;
-		buf = print_binder_work(buf, end, "    ",
-					"    pending transaction", w);
+		buf = print_binder_work_ilocked(buf, end, proc, "    ",
+						"    pending transaction", w);
 	}
 	if (!print_always && buf == header_buf)
 		buf = start_buf;
 	return buf;
 }
 
-static char *print_binder_node(char *buf, char *end, struct binder_node *node)
+/* called with the node lock and, for a live node, its proc's inner lock */
+static char *print_binder_node_nilocked(char *buf, char *end, struct binder_node *node)
 {
 	struct binder_ref *ref;
 	struct hlist_node *pos;
@@ -3048,17 +5033,19 @@ static char *print_binder_node(char *buf, char *end, struct binder_node *node)
 	list_for_each_entry(w, &node->async_todo, entry) {
 		if (buf >= end)
 			break;
-		buf = print_binder_work(buf, end, "    ",
-					"    pending async transaction", w);
+		buf = print_binder_work_ilocked(buf, end, node->proc, "    ",
+						"    pending async transaction", w);
 	}
 	return buf;
 }
 
-static char *print_binder_ref(char *buf, char *end, struct binder_ref *ref)
+static char *print_binder_ref_olocked(char *buf, char *end, struct binder_ref *ref)
 {
+	binder_node_lock(ref->node);
 	buf += snprintf(buf, end - buf, "  ref %d: desc %d %snode %d s %d w %d d %p\n",
 			ref->debug_id, ref->desc, ref->node->proc ? "" : "dead ",
 			ref->node->debug_id, ref->strong, ref->weak, ref->death);
+	binder_node_unlock(ref->node);
 	return buf;
 }
 
@@ -3066,30 +5053,55 @@ static char *print_binder_proc(char *buf, char *end, struct binder_proc *proc, i
 {
 	struct binder_work *w;
 	struct rb_node *n;
+	struct binder_node *last_node = NULL;
 	char *start_buf = buf;
 	char *header_buf;
 
 	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
 	header_buf = buf;
 
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL && buf < end; n = rb_next(n))
-		buf = print_binder_thread(buf, end, rb_entry(n, struct binder_thread, rb_node), print_all);
+		buf = print_binder_thread_ilocked(buf, end, rb_entry(n, struct binder_thread, rb_node), print_all);
 	for (n = rb_first(&proc->nodes); n != NULL && buf < end; n = rb_next(n)) {
 		struct binder_node *node = rb_entry(n, struct binder_node, rb_node);
-		if (print_all || node->has_async_transaction)
-			buf = print_binder_node(buf, end, node);
+		if (!print_all && !node->has_async_transaction)
+			continue;
+		/*
+		 * The node lock nests outside the inner lock, so pin the
+		 * node with a tmp ref while we drop and retake the locks.
+		 */
+		binder_inc_node_tmpref_ilocked(node);
+		binder_inner_proc_unlock(proc);
+		if (last_node)
+			binder_put_node(last_node);
+		binder_node_inner_lock(node);
+		buf = print_binder_node_nilocked(buf, end, node);
+		binder_node_inner_unlock(node);
+		last_node = node;
+		binder_inner_proc_lock(proc);
 	}
+	binder_inner_proc_unlock(proc);
+	if (last_node)
+		binder_put_node(last_node);
 	if (print_all) {
+		binder_proc_lock(proc);
 		for (n = rb_first(&proc->refs_by_desc); n != NULL && buf < end; n = rb_next(n))
-			buf = print_binder_ref(buf, end, rb_entry(n, struct binder_ref, rb_node_desc));
+			buf = print_binder_ref_olocked(buf, end, rb_entry(n, struct binder_ref, rb_node_desc));
+		binder_proc_unlock(proc);
 	}
+	mutex_lock(&proc->alloc_lock);
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL && buf < end; n = rb_next(n))
 		buf = print_binder_buffer(buf, end, "  buffer", rb_entry(n, struct binder_buffer, rb_node));
+	binder_inner_proc_unlock(proc);
+	mutex_unlock(&proc->alloc_lock);
+	binder_inner_proc_lock(proc);
 	list_for_each_entry(w, &proc->todo, entry) {
 		if (buf >= end)
 			break;
-		buf = print_binder_work(buf, end, "  ",
-					"  pending transaction", w);
+		buf = print_binder_work_ilocked(buf, end, proc, "  ",
+						"  pending transaction", w);
 	}
 	list_for_each_entry(w, &proc->delivered_death, entry) {
 		if (buf >= end)
@@ -3097,6 +5109,7 @@ static char *print_binder_proc(char *buf, char *end, struct binder_proc *proc, i
 		buf += snprintf(buf, end - buf, "  has delivered dead binder\n");
 		break;
 	}
+	binder_inner_proc_unlock(proc);
 	if (!print_all && buf == header_buf)
 		buf = start_buf;
 	return buf;
@@ -3120,7 +5133,8 @@ static const char *binder_return_strings[] = {
 	"BR_FINISHED",
 	"BR_DEAD_BINDER",
 	"BR_CLEAR_DEATH_NOTIFICATION_DONE",
-	"BR_FAILED_REPLY"
+	"BR_FAILED_REPLY",
+	"BR_TRANSACTION_COMPLETE_ALMOST_FULL"
 };
 
 static const char *binder_command_strings[] = {
@@ -3140,7 +5154,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3159,18 +5175,22 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix, struct
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) != ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_command_strings[i], stats->bc[i]);
+					binder_command_strings[i], temp);
 		if (buf >= end)
 			return buf;
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) != ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_return_strings[i], stats->br[i]);
+					binder_return_strings[i], temp);
 		if (buf >= end)
 			return buf;
 	}
@@ -3178,14 +5198,32 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix, struct
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) != ARRAY_SIZE(binder_objstat_strings));
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) != ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			buf += snprintf(buf, end - buf, "%s%s: active %d total %d\n", prefix,
 					binder_objstat_strings[i],
-					stats->obj_created[i] - stats->obj_deleted[i],
-					stats->obj_created[i]);
+					created - deleted, created);
 		if (buf >= end)
 			return buf;
 	}
+
+	/*
+	 * Relative to flattening a buffer into the parcel and copying that,
+	 * a gathered buffer saves one copy and a buffer passed by reference
+	 * saves both.
+	 */
+	i = atomic_read(&stats->sg_transactions);
+	if (i) {
+		long copied = atomic_long_read(&stats->sg_bytes_copied);
+		long by_ref = atomic_long_read(&stats->sg_bytes_by_ref);
+
+		buf += snprintf(buf, end - buf, "%ssg transactions: %d, "
+				"gathered %ld, by reference %ld, saved %ld per "
+				"transaction\n", prefix, i, copied, by_ref,
+				(copied + 2 * by_ref) / i);
+	}
 	return buf;
 }
 
@@ -3194,50 +5232,98 @@ static char *print_binder_proc_stats(char *buf, char *end, struct binder_proc *p
 	struct binder_work *w;
 	struct rb_node *n;
 	int count, strong, weak;
+	int i;
 
 	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
 	if (buf >= end)
 		return buf;
 	count = 0;
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
 	buf += snprintf(buf, end - buf, "  threads: %d\n", count);
-	if (buf >= end)
+	if (buf >= end) {
+		binder_inner_proc_unlock(proc);
 		return buf;
+	}
 	buf += snprintf(buf, end - buf, "  requested threads: %d+%d/%d\n"
 			"  ready threads %d\n"
 			"  free async space %d\n", proc->requested_threads,
 			proc->requested_threads_started, proc->max_threads,
 			proc->ready_threads, proc->free_async_space);
-	if (buf >= end)
+	if (buf >= end) {
+		binder_inner_proc_unlock(proc);
+		return buf;
+	}
+	buf += snprintf(buf, end - buf, "  async rejected %d (%ld bytes), "
+			"almost full %d\n", atomic_read(&proc->async_rejected),
+			atomic_long_read(&proc->async_rejected_bytes),
+			atomic_read(&proc->async_almost_full));
+	if (buf >= end) {
+		binder_inner_proc_unlock(proc);
+		return buf;
+	}
+	buf += snprintf(buf, end - buf, "  wakeups %d, proc work %d, "
+			"stolen %d\n", proc->nr_wakeups, proc->nr_proc_work,
+			proc->nr_stolen);
+	if (buf >= end) {
+		binder_inner_proc_unlock(proc);
+		return buf;
+	}
+	buf += snprintf(buf, end - buf, "  node cache: %d hits, %d misses\n"
+			"  ref cache: %d hits, %d misses\n",
+			proc->node_cache_hits, proc->node_cache_misses,
+			proc->ref_cache_hits, proc->ref_cache_misses);
+	if (buf >= end) {
+		binder_inner_proc_unlock(proc);
 		return buf;
+	}
 	count = 0;
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
+	binder_inner_proc_unlock(proc);
 	buf += snprintf(buf, end - buf, "  nodes: %d\n", count);
 	if (buf >= end)
 		return buf;
 	count = 0;
 	strong = 0;
 	weak = 0;
+	binder_proc_lock(proc);
 	for (n = rb_first(&proc->refs_by_desc); n != NULL; n = rb_next(n)) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref, rb_node_desc);
 		count++;
 		strong += ref->strong;
 		weak += ref->weak;
 	}
+	binder_proc_unlock(proc);
 	buf += snprintf(buf, end - buf, "  refs: %d s %d w %d\n", count, strong, weak);
 	if (buf >= end)
 		return buf;
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
 	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
+	buf += snprintf(buf, end - buf, "  pages: %d in use, %d cached\n",
+			proc->pages_allocated - proc->pages_cached,
+			proc->pages_cached);
+	for (i = 0; i < BINDER_SLAB_CLASSES && buf < end; i++) {
+		struct binder_slab_list *sl = &proc->slabs[i];
+
+		if (!sl->nr_slabs)
+			continue;
+		buf += snprintf(buf, end - buf,
+				"  slab %d: slabs %d (%d empty), in use %d\n",
+				binder_slab_class_size[i], sl->nr_slabs,
+				sl->empty, sl->in_use);
+	}
+	mutex_unlock(&proc->alloc_lock);
 	if (buf >= end)
 		return buf;
 
 	count = 0;
+	binder_inner_proc_lock(proc);
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION:
@@ -3247,6 +5333,7 @@ static char *print_binder_proc_stats(char *buf, char *end, struct binder_proc *p
 			break;
 		}
 	}
+	binder_inner_proc_unlock(proc);
 	buf += snprintf(buf, end - buf, "  pending transactions: %d\n", count);
 	if (buf >= end)
 		return buf;
@@ -3263,6 +5350,7 @@ static int binder_read_proc_state(
 	struct binder_proc *proc;
 	struct hlist_node *pos;
 	struct binder_node *node;
+	struct binder_node *last_node = NULL;
 	int len = 0;
 	char *buf = page;
 	char *end = page + PAGE_SIZE;
@@ -3271,26 +5359,41 @@ static int binder_read_proc_state(
 	if (off)
 		return 0;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	buf += snprintf(buf, end - buf, "binder state:\n");
 
+	spin_lock(&binder_dead_nodes_lock);
 	if (!hlist_empty(&binder_dead_nodes))
 		buf += snprintf(buf, end - buf, "dead nodes:\n");
 	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node) {
 		if (buf >= end)
 			break;
-		buf = print_binder_node(buf, end, node);
+		/*
+		 * Dead nodes have no proc, binder_dead_nodes_lock protects
+		 * their tmp refs; the tmp ref keeps the node on the list.
+		 */
+		node->tmp_refs++;
+		spin_unlock(&binder_dead_nodes_lock);
+		if (last_node)
+			binder_put_node(last_node);
+		binder_node_lock(node);
+		buf = print_binder_node_nilocked(buf, end, node);
+		binder_node_unlock(node);
+		last_node = node;
+		spin_lock(&binder_dead_nodes_lock);
 	}
+	spin_unlock(&binder_dead_nodes_lock);
+	if (last_node)
+		binder_put_node(last_node);
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (buf >= end)
 			break;
 		buf = print_binder_proc(buf, end, proc, 1);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3318,7 +5421,7 @@ static int binder_read_proc_stats(
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_procs_lock);
 
 	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
 
@@ -3330,7 +5433,7 @@ static int binder_read_proc_stats(
 		p = print_binder_proc_stats(p, page + PAGE_SIZE, proc);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
 
@@ -3359,7 +5462,7 @@ static int binder_read_proc_transactions(
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_procs_lock);
 
 	buf += snprintf(buf, end - buf, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
@@ -3368,7 +5471,7 @@ static int binder_read_proc_transactions(
 		buf = print_binder_proc(buf, end, proc, 0);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3395,11 +5498,11 @@ static int binder_read_proc_proc(
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_procs_lock);
 	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
 	p = print_binder_proc(p, page + PAGE_SIZE, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
@@ -3414,6 +5517,81 @@ static int binder_read_proc_proc(
 	return len < count ? len  : count;
 }
 
+static char *print_binder_latency(char *buf, char *end, const char *prefix,
+				  struct binder_latency *latency)
+{
+	int i, j;
+
+	for (i = 0; i < BINDER_LATENCY_COUNT; i++) {
+		int total = 0;
+
+		for (j = 0; j < BINDER_LATENCY_BUCKETS; j++)
+			total += atomic_read(&latency->hist[i][j]);
+		if (total == 0)
+			continue;
+		buf += snprintf(buf, end - buf, "%s%s: %d", prefix,
+				binder_latency_strings[i], total);
+		for (j = 0; j < BINDER_LATENCY_BUCKETS; j++) {
+			int temp = atomic_read(&latency->hist[i][j]);
+
+			if (buf >= end)
+				return buf;
+			if (temp == 0)
+				continue;
+			if (j < BINDER_LATENCY_BUCKETS - 1)
+				buf += snprintf(buf, end - buf, " <%u:%d",
+						1U << j, temp);
+			else
+				buf += snprintf(buf, end - buf, " >=%u:%d",
+						1U << (j - 1), temp);
+		}
+		buf += snprintf(buf, end - buf, "\n");
+		if (buf >= end)
+			return buf;
+	}
+	return buf;
+}
+
+static int binder_read_proc_latency(
+	char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int len = 0;
+	char *buf = page;
+	char *end = page + PAGE_SIZE;
+	int do_lock = !binder_debug_no_lock;
+
+	if (off)
+		return 0;
+
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
+
+	buf += snprintf(buf, end - buf, "binder latency (us):\n");
+	buf = print_binder_latency(buf, end, "", &binder_latency);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (buf >= end)
+			break;
+		buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
+		buf = print_binder_latency(buf, end, "  ", &proc->latency);
+	}
+	if (do_lock)
+		mutex_unlock(&binder_procs_lock);
+	if (buf > page + PAGE_SIZE)
+		buf = page + PAGE_SIZE;
+
+	*start = page + off;
+
+	len = buf - page;
+	if (len > off)
+		len -= off;
+	else
+		len = 0;
+
+	return len < count ? len  : count;
+}
+
 static char *print_binder_transaction_log_entry(char *buf, char *end, struct binder_transaction_log_entry *e)
 {
 	buf += snprintf(buf, end - buf, "%d: %s from %d:%d to %d:%d node %d handle %d size %d:%d\n",
@@ -3432,18 +5610,23 @@ static int binder_read_proc_transaction_log(
 	int i;
 	char *buf = page;
 	char *end = page + PAGE_SIZE;
+	unsigned int log_cur;
+	unsigned int next;
 
 	if (off)
 		return 0;
 
+	log_cur = atomic_read(&log->cur);
+	next = (log_cur + 1) % ARRAY_SIZE(log->entry);
+
 	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++) {
+		for (i = next; i < ARRAY_SIZE(log->entry); i++) {
 			if (buf >= end)
 				break;
 			buf = print_binder_transaction_log_entry(buf, end, &log->entry[i]);
 		}
 	}
-	for (i = 0; i < log->next; i++) {
+	for (i = 0; i < next; i++) {
 		if (buf >= end)
 			break;
 		buf = print_binder_transaction_log_entry(buf, end, &log->entry[i]);
@@ -3484,9 +5667,11 @@ static int __init binder_init(void)
 	if (binder_proc_dir_entry_root)
 		binder_proc_dir_entry_proc = proc_mkdir("proc", binder_proc_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_proc_dir_entry_root) {
 		create_proc_read_entry("state", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_state, NULL);
 		create_proc_read_entry("stats", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_stats, NULL);
+		create_proc_read_entry("latency", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_latency, NULL);
 		create_proc_read_entry("transactions", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_transactions, NULL);
 		create_proc_read_entry("transaction_log", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_transaction_log, &binder_transaction_log);
 		create_proc_read_entry("failed_transaction_log", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_transaction_log, &binder_transaction_log_failed);
@@ -23,26 +23,89 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/proc_fs.h>
+#include <linux/hrtimer.h>
+#include <linux/lzo.h>
 #include <linux/logger.h>
 
 #include <asm/ioctls.h>
+#include <asm/cacheflush.h>
+#include <asm/shmparam.h>
+
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+/*
+ * struct logger_history - the compressed history behind a log
+ *
+ * Published entries are compressed, a LOGGER_HISTORY_CHUNK at a time, by a
+ * worker, before the writers come around and overwrite them. The chunks are
+ * kept oldest first, up to CONFIG_ANDROID_LOGGER_HISTORY_SIZE kilobytes of
+ * compressed data per log, and readers that ask for it get them back before
+ * what's left in the log itself. Protected by the log's 'mutex'.
+ */
+struct logger_history {
+	struct work_struct	work;	/* compresses what's been published */
+	struct list_head	chunks;	/* the compressed chunks, oldest first */
+	size_t			pos;	/* everything before is compressed */
+	size_t			bytes;	/* compressed bytes held in chunks */
+
+	/* statistics, for /proc/logger_history */
+	unsigned long		nr_chunks;	/* chunks compressed */
+	unsigned long		raw_bytes;	/* bytes compressed */
+	unsigned long		comp_bytes;	/* bytes they compressed to */
+	unsigned long		lost_bytes;	/* overwritten before we got them */
+	u64			ns;		/* time spent compressing */
+};
+
+/*
+ * struct logger_chunk - a run of whole entries in a log's history
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in the history's list */
+	size_t			start;	/* position of the first entry */
+	size_t			len;	/* length of the entries */
+	size_t			clen;	/* length compressed */
+	unsigned char		data[0]; /* the entries, compressed */
+};
+
+#define LOGGER_HISTORY_CHUNK	(16*1024)
+#endif
 
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers never take 'mutex', which only serializes readers. They reserve
+ * their space under 'lock', held just long enough to bump 'w_res' and to pull
+ * 'head' past the entries about to be overwritten, then copy their entry in
+ * with no lock held and publish it by moving 'w_off', in reservation order.
+ *
+ * The offsets are positions in the stream of everything ever written, they
+ * only ever grow; logger_offset() turns them into offsets in the buffer.
  */
 struct logger_log {
 	unsigned char *		buffer;	/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex serializing readers */
+	spinlock_t		lock;	/* lock protecting w_res and head */
+	size_t			w_off;	/* end of the published entries */
+	size_t			w_res;	/* end of the reserved entries */
+	size_t			head;	/* oldest entry, new readers start here */
 	size_t			size;	/* size of the log */
+	int			min_prio; /* writes below this are dropped */
+	struct logger_mmap_header * mmap_hdr; /* header page for mmap readers */
+	atomic_t		mapped;	/* uncached mappings, writers clean */
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+	struct logger_history	history; /* compressed older entries */
+#endif
 };
 
 /*
@@ -50,11 +113,22 @@ struct logger_log {
  *
  * This object lives from open to release, so we don't need additional
  * reference counting. The structure is protected by log->mutex.
+ *
+ * Writers don't know about readers; a reader that the writers lapped finds
+ * out itself, by 'r_off' falling behind log->head, see fix_up_reader().
  */
 struct logger_reader {
 	struct logger_log *	log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	int			mapped;	/* reads through mmap, see logger_poll */
+	int			batch;	/* read() returns as many entries as fit */
+	struct logger_filter *	filter;	/* entries to read, NULL for all */
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+	int			history; /* read the history first */
+	unsigned char *		hist_buf; /* the last chunk decompressed */
+	size_t			hist_start; /* its position, if hist_len */
+	size_t			hist_len; /* its length */
+#endif
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -85,9 +159,10 @@ static inline struct logger_log * file_get_log(struct file *file)
 
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * from 'off', an offset in the buffer.
  *
- * Caller needs to hold log->mutex.
+ * Readers must check with logger_lapped() that the entry wasn't overwritten
+ * under them before trusting the result.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -106,25 +181,60 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * logger_lapped - has a writer reserved the space of the entry at 'off' since
+ * the caller looked at it? Call after reading the entry, to know whether what
+ * was read can be trusted.
+ *
+ * Comparing with the head alone stops working once 'off' is 2^31 bytes behind
+ * it, as it is for a reader stopped long enough; whatever is more than the
+ * size of the log behind the reservations has been written over too.
+ */
+static inline int logger_lapped(struct logger_log *log, size_t off)
+{
+	/* order the reads of the entry before the reads of the heads */
+	smp_rmb();
+	return (long) (log->head - off) > 0 || log->w_res - off > log->size;
+}
+
+/*
+ * fix_up_reader - pull a reader that was lapped by the writers forward to the
+ * oldest entry still in the log. Returns nonzero if, after that, there is
+ * nothing for the reader to read.
+ *
+ * Caller must hold log->mutex.
+ */
+static int fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	if (logger_lapped(log, reader->r_off))
+		reader->r_off = log->head;
+	if (log->w_off == reader->r_off)
+		return 1;
+	/* order the read of the write head before the reads of the entry */
+	smp_rmb();
+	return 0;
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes from 'log', starting at
+ * position 'off', into the user-space buffer 'buf'. Returns 'count' on
+ * success.
  *
  * Caller must hold log->mutex.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
+				   char __user *buf, size_t count)
 {
 	size_t len;
 
+	off = logger_offset(off);
+
 	/*
 	 * We read from the log in two disjoint operations. First, we read from
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -135,11 +245,361 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+/*
+ * do_read_log - copies 'count' bytes from 'log', starting at position 'off',
+ * to 'buf'.
+ */
+static void do_read_log(struct logger_log *log, size_t off, void *buf,
+			size_t count)
+{
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+/*
+ * The most of an entry filter_pass() looks at: the header, the priority and
+ * a tag as long as any the filter can hold.
+ */
+#define LOGGER_FILTER_PREFIX	\
+	(sizeof(struct logger_entry) + 1 + LOGGER_FILTER_TAG_LEN)
+
+/*
+ * filter_pass - does the filter 'filter' let the entry 'entry' through? The
+ * entry's payload is the priority byte, then the tag, NUL terminated, then
+ * the message; 'len' may cover only a prefix of the entry.
+ */
+static int filter_pass(const struct logger_filter *filter,
+		       const unsigned char *entry, size_t len)
+{
+	const unsigned char *payload = entry + sizeof(struct logger_entry);
+	struct logger_entry hdr;
+	size_t tag_len;
+	int i;
+
+	/* entries needn't be aligned in the log */
+	memcpy(&hdr, entry, sizeof(hdr));
+	len = min_t(size_t, len - sizeof(hdr), hdr.len);
+
+	if (filter->nr_pids) {
+		for (i = 0; i < filter->nr_pids; i++)
+			if (filter->pids[i] == hdr.pid)
+				break;
+		if (i == filter->nr_pids)
+			return 0;
+	}
+
+	if (filter->min_prio && (!len || payload[0] < filter->min_prio))
+		return 0;
+
+	if (filter->nr_tags) {
+		if (!len)
+			return 0;
+		tag_len = strnlen((const char *) payload + 1, len - 1);
+		for (i = 0; i < filter->nr_tags; i++)
+			if (strlen(filter->tags[i]) == tag_len &&
+			    !memcmp(filter->tags[i], payload + 1, tag_len))
+				break;
+		if (i == filter->nr_tags)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * next_entry_len - returns the length of the next entry for 'reader',
+ * skipping the ones its filter drops, or 0 if there is nothing to read.
+ *
+ * Caller must hold log->mutex.
+ */
+static size_t next_entry_len(struct logger_log *log,
+			     struct logger_reader *reader)
+{
+	unsigned char prefix[LOGGER_FILTER_PREFIX];
+	size_t len, n;
+	int pass = 1;
+
+	for (;;) {
+		if (fix_up_reader(log, reader))
+			return 0;
+		len = get_entry_len(log, logger_offset(reader->r_off));
+		if (reader->filter) {
+			n = min_t(size_t, len, LOGGER_FILTER_PREFIX);
+			do_read_log(log, reader->r_off, prefix, n);
+			pass = filter_pass(reader->filter, prefix, n);
+		}
+		if (logger_lapped(log, reader->r_off))
+			continue;
+		if (pass)
+			return len;
+		reader->r_off += len;
+	}
+}
+
+/*
+ * do_read_filtered_to_user - the batch mode of logger_read() for a reader
+ * with a filter: the entries it passes aren't next to each other, so copy
+ * them one by one.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t do_read_filtered_to_user(struct logger_log *log,
+					struct logger_reader *reader,
+					char __user *buf, size_t count)
+{
+	size_t done = 0, len;
+
+	while ((len = next_entry_len(log, reader)) && done + len <= count) {
+		if (do_read_log_to_user(log, reader->r_off, buf + done, len) < 0)
+			return done ? done : -EFAULT;
+		if (logger_lapped(log, reader->r_off))
+			continue;
+		reader->r_off += len;
+		done += len;
+	}
+
+	return done;
+}
+
+/*
+ * get_batch_len - returns the length of the run of whole entries starting at
+ * position 'off' that fits in 'count' bytes, without going past the write
+ * head.
+ *
+ * Like get_entry_len(), check logger_lapped() before trusting the result.
+ */
+static size_t get_batch_len(struct logger_log *log, size_t off, size_t count)
+{
+	size_t w_off = log->w_off;
+	size_t len = 0;
+
+	smp_rmb();
+	while (off + len != w_off) {
+		size_t nr = get_entry_len(log, logger_offset(off + len));
+
+		if (len + nr > count)
+			break;
+		len += nr;
+	}
+
+	return len;
+}
+
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+/*
+ * The scratch space for compressing, shared by the logs' workers under
+ * logger_history_mutex: the LZO work memory is too big to have per log.
+ */
+static DEFINE_MUTEX(logger_history_mutex);
+static unsigned char *logger_history_raw;
+static unsigned char *logger_history_comp;
+static void *logger_history_wrkmem;
+
+/*
+ * history_compress - compress the next chunk of 'log' into its history.
+ * Returns nonzero if there's no whole chunk to compress yet.
+ *
+ * Caller must hold logger_history_mutex and log->mutex.
+ */
+static int history_compress(struct logger_log *log)
+{
+	struct logger_history *history = &log->history;
+	struct logger_chunk *chunk;
+	size_t len, clen;
+	ktime_t start;
+
+	if (log->w_off - history->pos < LOGGER_HISTORY_CHUNK)
+		return 1;
+
+	/* a storm outran us, what's been overwritten is gone */
+	if (logger_lapped(log, history->pos)) {
+		history->lost_bytes += log->head - history->pos;
+		history->pos = log->head;
+		return 0;
+	}
+
+	len = get_batch_len(log, history->pos, LOGGER_HISTORY_CHUNK);
+	do_read_log(log, history->pos, logger_history_raw, len);
+	if (logger_lapped(log, history->pos))
+		return 0;
+
+	start = ktime_get();
+	if (lzo1x_1_compress(logger_history_raw, len, logger_history_comp,
+			     &clen, logger_history_wrkmem) != LZO_E_OK) {
+		history->lost_bytes += len;
+		history->pos += len;
+		return 0;
+	}
+	history->ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	chunk = kmalloc(sizeof(struct logger_chunk) + clen, GFP_KERNEL);
+	if (!chunk) {
+		history->lost_bytes += len;
+		history->pos += len;
+		return 0;
+	}
+	chunk->start = history->pos;
+	chunk->len = len;
+	chunk->clen = clen;
+	memcpy(chunk->data, logger_history_comp, clen);
+	list_add_tail(&chunk->list, &history->chunks);
+
+	history->pos += len;
+	history->bytes += clen;
+	history->nr_chunks++;
+	history->raw_bytes += len;
+	history->comp_bytes += clen;
+
+	/* make room by dropping the oldest chunks */
+	while (history->bytes > CONFIG_ANDROID_LOGGER_HISTORY_SIZE * 1024) {
+		chunk = list_first_entry(&history->chunks, struct logger_chunk,
+					 list);
+		list_del(&chunk->list);
+		history->bytes -= chunk->clen;
+		kfree(chunk);
+	}
+
+	return 0;
+}
+
+static void history_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      history.work);
+	int done;
+
+	mutex_lock(&logger_history_mutex);
+	do {
+		mutex_lock(&log->mutex);
+		done = history_compress(log);
+		mutex_unlock(&log->mutex);
+	} while (!done);
+	mutex_unlock(&logger_history_mutex);
+}
+
+/*
+ * history_kick - called by writers after publishing, to get a chunk's worth
+ * of entries compressed. Costs a subtraction unless there is one.
+ */
+static inline void history_kick(struct logger_log *log)
+{
+	if (unlikely(log->w_off - log->history.pos >= LOGGER_HISTORY_CHUNK))
+		schedule_work(&log->history.work);
+}
+
+/*
+ * history_flush - drop the whole history, for LOGGER_FLUSH_LOG
+ *
+ * Caller must hold log->mutex.
+ */
+static void history_flush(struct logger_log *log)
+{
+	struct logger_history *history = &log->history;
+	struct logger_chunk *chunk, *next;
+
+	list_for_each_entry_safe(chunk, next, &history->chunks, list) {
+		list_del(&chunk->list);
+		kfree(chunk);
+	}
+	history->bytes = 0;
+	history->pos = log->head;
+}
+
+/*
+ * read_history - the history side of logger_read(), for a reader positioned
+ * before the head of the log. Returns 0 if the history holds nothing for the
+ * reader at or after its position, meaning it should read from the log.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t read_history(struct logger_log *log,
+			    struct logger_reader *reader,
+			    char __user *buf, size_t count)
+{
+	struct logger_chunk *chunk;
+	size_t off, len, done;
+	__u16 val;
+
+again:
+	list_for_each_entry(chunk, &log->history.chunks, list)
+		if ((long) (chunk->start + chunk->len - reader->r_off) > 0)
+			goto found;
+	return 0;
+
+found:
+	/* skip whatever was dropped or lost in between */
+	if ((long) (chunk->start - reader->r_off) > 0)
+		reader->r_off = chunk->start;
+
+	if (!reader->hist_len || reader->hist_start != chunk->start) {
+		if (!reader->hist_buf) {
+			reader->hist_buf = kmalloc(LOGGER_HISTORY_CHUNK,
+						   GFP_KERNEL);
+			if (!reader->hist_buf)
+				return -ENOMEM;
+		}
+		len = LOGGER_HISTORY_CHUNK;
+		if (lzo1x_decompress_safe(chunk->data, chunk->clen,
+					  reader->hist_buf, &len) != LZO_E_OK ||
+		    len != chunk->len) {
+			reader->hist_len = 0;
+			return -EIO;
+		}
+		reader->hist_start = chunk->start;
+		reader->hist_len = len;
+	}
+
+	/* one entry, or as many as fit in batch mode, that pass the filter */
+	done = 0;
+	off = reader->r_off - chunk->start;
+	while (off < reader->hist_len) {
+		unsigned char *entry = reader->hist_buf + off;
+
+		memcpy(&val, entry, sizeof(val));
+		len = sizeof(struct logger_entry) + val;
+		if (!reader->filter ||
+		    filter_pass(reader->filter, entry, len)) {
+			if (done + len > count)
+				break;
+			if (copy_to_user(buf + done, entry, len))
+				return -EFAULT;
+			done += len;
+			if (!reader->batch) {
+				off += len;
+				break;
+			}
+		}
+		off += len;
+	}
+	reader->r_off = chunk->start + off;
+
+	if (!done) {
+		if (off < reader->hist_len)
+			return -EINVAL;
+		/* the filter passed nothing in this chunk */
+		goto again;
+	}
+
+	return done;
+}
+#else
+static inline void history_kick(struct logger_log *log)
+{
+}
+
+static inline void history_flush(struct logger_log *log)
+{
+}
+#endif
+
 /*
  * logger_read - our log's read() method
  *
@@ -147,7 +607,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or, after LOGGER_SET_BATCH,
+ * 	  as many whole entries as fit in the buffer
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -164,9 +625,7 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
 
@@ -189,21 +648,53 @@ start:
 
 	mutex_lock(&log->mutex);
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+	if (reader->history && logger_lapped(log, reader->r_off)) {
+		ret = read_history(log, reader, buf, count);
+		if (ret)
+			goto out;
+	}
+#endif
+
+retry:
+	/*
+	 * get the size of the next entry; is there still something to read,
+	 * that the filter passes, or did we race?
+	 */
+	ret = next_entry_len(log, reader);
+	if (unlikely(!ret)) {
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
-
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (reader->batch && reader->filter) {
+		ret = do_read_filtered_to_user(log, reader, buf, count);
+		if (unlikely(!ret))
+			goto retry;
+		goto out;
+	}
+
+	if (reader->batch) {
+		ret = get_batch_len(log, reader->r_off, count);
+		if (unlikely(logger_lapped(log, reader->r_off)))
+			goto retry;
+	}
+
+	/*
+	 * get exactly one entry, or the batch, from the log; if a writer got to
+	 * it while we were copying, what the user got is garbage, so go again
+	 * with the oldest entry, overwriting it
+	 */
+	ret = do_read_log_to_user(log, reader->r_off, buf, ret);
+	if (ret < 0)
+		goto out;
+	if (unlikely(logger_lapped(log, reader->r_off)))
+		goto retry;
+	reader->r_off += ret;
 
 out:
 	mutex_unlock(&log->mutex);
@@ -212,171 +703,222 @@ out:
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
+ * Entries are staged here, with preemption disabled, before they go into a
+ * log, so that copying into the log is a memcpy that cannot fault or sleep
+ * while other writers wait for it to be published.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
-{
-	size_t count = 0;
-
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
+struct logger_stage {
+	struct logger_entry	entry;
+	char			msg[LOGGER_ENTRY_MAX_PAYLOAD];
+};
+static DEFINE_PER_CPU(struct logger_stage, logger_stage);
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * flush_mapped - writes back the cache lines over 'len' bytes at 'addr' while
+ * the log is mapped uncached, see logger_mmap. Those readers only see what
+ * reached memory; the cached kernel alias must not hold on to it.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static void flush_mapped(struct logger_log *log, const void *addr, size_t len)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+	if (likely(!atomic_read(&log->mapped)) || !len)
+		return;
 
-	return 0;
+	dmac_clean_range(addr, addr + len);
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller must have preemption disabled, the writers after us spin until
+ * we publish.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	size_t start, off, len;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	spin_lock(&log->lock);
+
+	/*
+	 * Writers copying in still own the space between w_off and w_res. Very
+	 * unlikely, but never reserve over that; they're on other CPUs and
+	 * will be done in a moment.
+	 */
+	while (unlikely(log->w_res + count - log->w_off > log->size)) {
+		spin_unlock(&log->lock);
+		cpu_relax();
+		spin_lock(&log->lock);
+	}
+
+	/*
+	 * Pull the head forward to the first entry after what we're about to
+	 * overwrite. We do this now, before touching the buffer, so a reader
+	 * that sees the head still behind its entry after reading it knows
+	 * the entry is intact.
+	 */
+	start = log->w_res;
+	log->w_res = start + count;
+	while (log->w_res - log->head > log->size)
+		log->head += get_entry_len(log, logger_offset(log->head));
+	log->mmap_hdr->head = log->head;
+	smp_wmb();
+
+	spin_unlock(&log->lock);
+
+	flush_mapped(log, &log->mmap_hdr->head, sizeof(log->mmap_hdr->head));
+
+	off = logger_offset(start);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
+	flush_mapped(log, log->buffer + off, len);
+
+	if (count != len) {
+		memcpy(log->buffer, buf + len, count - len);
+		flush_mapped(log, log->buffer, count - len);
+	}
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	/*
+	 * Publish, after everything reserved before us. The header is ours
+	 * until we move w_off, the next writer is spinning on it.
+	 */
+	while (log->w_off != start)
+		cpu_relax();
+	smp_wmb();
+	log->mmap_hdr->w_off = start + count;
+	log->mmap_hdr->seq++;
+	flush_mapped(log, log->mmap_hdr, sizeof(*log->mmap_hdr));
+	smp_wmb();
+	log->w_off = start + count;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_stage_log_from_user - gathers 'count' bytes of the vector 'iov' into
+ * 'buf'. If 'atomic', we have preemption disabled and must not fault.
  *
- * The caller needs to hold log->mutex.
+ * Returns zero on success, -EFAULT on failure.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static int do_stage_log_from_user(void *buf, const struct iovec *iov,
+				  unsigned long nr_segs, size_t count,
+				  int atomic)
 {
-	size_t len;
+	while (count && nr_segs-- > 0) {
+		size_t len;
+		unsigned long left;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, count);
+
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, len))
+				return -EFAULT;
+			pagefault_disable();
+			left = __copy_from_user_inatomic(buf, iov->iov_base,
+							 len);
+			pagefault_enable();
+		} else
+			left = copy_from_user(buf, iov->iov_base, len);
+		if (left)
+			return -EFAULT;
 
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+		buf += len;
+		count -= len;
+		iov++;
+	}
 
-	log->w_off = logger_offset(log->w_off + count);
-	
+	return 0;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * below_min_prio - is the entry in 'iov' below the log's minimum priority?
+ * The priority is the first byte of the payload.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int below_min_prio(struct logger_log *log, const struct iovec *iov,
+			  unsigned long nr_segs)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
-
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	unsigned char prio;
 
-	log->w_off = logger_offset(log->w_off + count);
+	while (nr_segs && !iov->iov_len) {
+		iov++;
+		nr_segs--;
+	}
+	if (!nr_segs || get_user(prio, (unsigned char __user *) iov->iov_base))
+		return 0;
 
-	return count;
+	return prio < log->min_prio;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * Writers don't sleep and don't wait on each other, except for the moment it
+ * takes another CPU to memcpy an entry reserved ahead of ours.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	struct logger_entry *entry;
+	unsigned char *slow = NULL;
 	struct timespec now;
-	ssize_t ret = 0;
+	size_t len;
 
 	now = current_kernel_time();
 
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	/* so do the ones we drop for their priority */
+	if (unlikely(log->min_prio) && below_min_prio(log, iov, nr_segs))
+		return len;
 
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Stage the entry in this CPU's buffer. If the user's pages aren't
+	 * there, fall back to a buffer of our own that we can fault them into.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	entry = &get_cpu_var(logger_stage).entry;
+	if (unlikely(do_stage_log_from_user(entry->msg, iov, nr_segs, len,
+					    1))) {
+		put_cpu_var(logger_stage);
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		slow = kmalloc(sizeof(struct logger_entry) + len, GFP_KERNEL);
+		if (!slow)
+			return -ENOMEM;
+		entry = (struct logger_entry *) slow;
+		if (do_stage_log_from_user(entry->msg, iov, nr_segs, len, 0)) {
+			kfree(slow);
+			return -EFAULT;
 		}
 
-		iov++;
-		ret += nr;
+		preempt_disable();
 	}
 
-	mutex_unlock(&log->mutex);
+	entry->len = len;
+	entry->__pad = 0;
+	entry->pid = current->tgid;
+	entry->tid = current->pid;
+	entry->sec = now.tv_sec;
+	entry->nsec = now.tv_nsec;
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	do_write_log(log, entry, sizeof(struct logger_entry) + len);
 
-	return ret;
+	if (unlikely(slow)) {
+		preempt_enable();
+		kfree(slow);
+	} else
+		put_cpu_var(logger_stage);
+
+	history_kick(log);
+
+	/* wake up any blocked readers; they check w_off after queueing */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
+
+	return len;
 }
 
 static struct logger_log * get_log_from_minor(int);
@@ -407,12 +949,15 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
 		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		reader->mapped = 0;
+		reader->batch = 0;
+		reader->filter = NULL;
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+		reader->history = 0;
+		reader->hist_buf = NULL;
+		reader->hist_len = 0;
+#endif
 
 		file->private_data = reader;
 	} else
@@ -430,13 +975,104 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+		kfree(reader->hist_buf);
+#endif
+		kfree(reader->filter);
 		kfree(reader);
 	}
 
 	return 0;
 }
 
+/*
+ * Writers only clean the cache while some uncached mapping of the log is
+ * left; these count them, including the copies made by fork() and by
+ * splitting a vma.
+ */
+static void logger_vma_open(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_inc(&log->mapped);
+}
+
+static void logger_vma_close(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_dec(&log->mapped);
+}
+
+static struct vm_operations_struct logger_vm_ops = {
+	.open = logger_vma_open,
+	.close = logger_vma_close,
+};
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Readers can map the log read-only and parse the entries in place: the
+ * header page comes first, the buffer right after it, see
+ * struct logger_mmap_header for how to walk it.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/*
+	 * The header and the buffer sit at the same cache colours in the
+	 * kernel as in a mapping at an SHMLBA aligned address, which
+	 * arch_get_unmapped_area gives file mappings on aliasing caches. A
+	 * VIPT cache then keeps the two aliases coherent by itself and the
+	 * mapping stays cached. A VIVT cache can't: map uncached there, have
+	 * writers clean from now on and write back what the cache still holds.
+	 */
+	if (cache_is_vivt()) {
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+		atomic_inc(&log->mapped);
+		smp_mb__after_atomic_inc();
+		flush_mapped(log, log->mmap_hdr, PAGE_SIZE + log->size);
+	} else if (cache_is_vipt_aliasing() &&
+		   (vma->vm_start & (SHMLBA - 1))) {
+		return -EINVAL;
+	}
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      page_to_pfn(virt_to_page(log->mmap_hdr)),
+			      PAGE_SIZE + log->size, vma->vm_page_prot);
+	if (ret) {
+		if (cache_is_vivt())
+			atomic_dec(&log->mapped);
+		return -EAGAIN;
+	}
+	if (cache_is_vivt()) {
+		vma->vm_ops = &logger_vm_ops;
+		vma->vm_private_data = log;
+	}
+
+	mutex_lock(&log->mutex);
+	reader->mapped = 1;
+	mutex_unlock(&log->mutex);
+
+	return 0;
+}
+
 /*
  * logger_poll - the log's poll file operation, for poll/select/epoll
  *
@@ -445,6 +1081,9 @@ static int logger_release(struct inode *ignored, struct file *file)
  * guarantee that the log is readable without blocking, as there is a small
  * chance that the writer can lap the reader in the interim between poll()
  * returning and the read() request.
+ *
+ * We don't see how far a reader reading through mmap got, so for those
+ * POLLIN means there is something new since poll last returned POLLIN.
  */
 static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
@@ -461,13 +1100,52 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (log->w_off != reader->r_off) {
 		ret |= POLLIN | POLLRDNORM;
+		if (reader->mapped)
+			reader->r_off = log->w_off;
+	}
 	mutex_unlock(&log->mutex);
-	
+
 	return ret;
 }
 
+/*
+ * set_filter - install the filter at 'arg' on 'reader'; one that passes
+ * everything removes the reader's filter.
+ *
+ * Caller must hold log->mutex.
+ */
+static long set_filter(struct logger_reader *reader, void __user *arg)
+{
+	struct logger_filter *filter;
+	int i;
+
+	filter = kmalloc(sizeof(*filter), GFP_KERNEL);
+	if (!filter)
+		return -ENOMEM;
+	if (copy_from_user(filter, arg, sizeof(*filter))) {
+		kfree(filter);
+		return -EFAULT;
+	}
+	if (filter->nr_tags > LOGGER_FILTER_MAX_TAGS ||
+	    filter->nr_pids > LOGGER_FILTER_MAX_PIDS) {
+		kfree(filter);
+		return -EINVAL;
+	}
+	for (i = 0; i < filter->nr_tags; i++)
+		filter->tags[i][LOGGER_FILTER_TAG_LEN - 1] = '\0';
+
+	kfree(reader->filter);
+	reader->filter = filter;
+	if (!filter->min_prio && !filter->nr_tags && !filter->nr_pids) {
+		kfree(filter);
+		reader->filter = NULL;
+	}
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
@@ -486,10 +1164,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		fix_up_reader(log, reader);
+		ret = log->w_off - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -497,21 +1173,60 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		ret = next_entry_len(log, reader);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
+		/* readers find themselves behind the head and catch up */
+		spin_lock(&log->lock);
 		log->head = log->w_off;
+		log->mmap_hdr->head = log->head;
+		spin_unlock(&log->lock);
+		flush_mapped(log, &log->mmap_hdr->head,
+			     sizeof(log->mmap_hdr->head));
+		history_flush(log);
 		ret = 0;
 		break;
+	case LOGGER_SET_BATCH:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
+		break;
+	case LOGGER_SET_FILTER:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = set_filter(reader, (void __user *) arg);
+		break;
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+	case LOGGER_SET_HISTORY:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->history = !!arg;
+		/* go back to the oldest entry we still have */
+		if (reader->history && !list_empty(&log->history.chunks)) {
+			struct logger_chunk *chunk;
+
+			chunk = list_first_entry(&log->history.chunks,
+						 struct logger_chunk, list);
+			if ((long) (reader->r_off - chunk->start) > 0)
+				reader->r_off = chunk->start;
+		}
+		ret = 0;
+		break;
+#endif
 	}
 
 	mutex_unlock(&log->mutex);
@@ -524,6 +1239,7 @@ static struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -532,13 +1248,17 @@ static struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN and PAGE_SIZE,
+ * and less than LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The mmap header page
+ * comes first and the buffer right after it, at the cache colours they get
+ * in a reader's mapping, see logger_mmap.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[PAGE_SIZE + SIZE] \
+	__attribute__((aligned(SHMLBA))); \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.mmap_hdr = (struct logger_mmap_header *) _buf_ ## VAR, \
+	.buffer = _buf_ ## VAR + PAGE_SIZE, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -546,17 +1266,27 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.w_res = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.mapped = ATOMIC_INIT(0), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
 DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
 DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024)
 
+/*
+ * Writes below these priorities are dropped, before they cost anything. The
+ * events log's payload is binary, it has no priority.
+ */
+module_param_named(main_min_prio, log_main.min_prio, int, S_IWUSR | S_IRUGO);
+module_param_named(radio_min_prio, log_radio.min_prio, int,
+		   S_IWUSR | S_IRUGO);
+
 static struct logger_log * get_log_from_minor(int minor)
 {
 	if (log_main.misc.minor == minor)
@@ -568,10 +1298,67 @@ static struct logger_log * get_log_from_minor(int minor)
 	return NULL;
 }
 
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+static int logger_read_proc_history(char *page, char **start, off_t off,
+				    int count, int *eof, void *data)
+{
+	struct logger_log *logs[] = { &log_main, &log_events, &log_radio };
+	int i, len = 0;
+
+	if (off)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(logs); i++) {
+		struct logger_history *history = &logs[i]->history;
+
+		mutex_lock(&logs[i]->mutex);
+		len += snprintf(page + len, PAGE_SIZE - len,
+				"%s: held %zu chunks %lu raw %lu "
+				"compressed %lu lost %lu ns %llu\n",
+				logs[i]->misc.name, history->bytes,
+				history->nr_chunks, history->raw_bytes,
+				history->comp_bytes, history->lost_bytes,
+				(unsigned long long) history->ns);
+		mutex_unlock(&logs[i]->mutex);
+	}
+
+	*start = page + off;
+
+	return len < count ? len  : count;
+}
+
+static int __init init_history(void)
+{
+	logger_history_raw = vmalloc(LOGGER_HISTORY_CHUNK);
+	logger_history_comp =
+		vmalloc(lzo1x_worst_compress(LOGGER_HISTORY_CHUNK));
+	logger_history_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (!logger_history_raw || !logger_history_comp ||
+	    !logger_history_wrkmem) {
+		vfree(logger_history_raw);
+		vfree(logger_history_comp);
+		vfree(logger_history_wrkmem);
+		return -ENOMEM;
+	}
+
+	create_proc_read_entry("logger_history", S_IRUGO, NULL,
+			       logger_read_proc_history, NULL);
+
+	return 0;
+}
+#endif
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+	INIT_WORK(&log->history.work, history_work);
+	INIT_LIST_HEAD(&log->history.chunks);
+#endif
+
+	log->mmap_hdr->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -589,6 +1376,12 @@ static int __init logger_init(void)
 {
 	int ret;
 
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+	ret = init_history();
+	if (unlikely(ret))
+		goto out;
+#endif
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
@@ -19,7 +19,11 @@
 #include <linux/file.h>
 #include <linux/mm.h>
 #include <linux/list.h>
+#include <linux/vmalloc.h>
 #include <linux/debugfs.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <asm/io.h>
@@ -29,6 +33,11 @@
 
 #define PMEM_MAX_DEVICES 10
 #define PMEM_MAX_ORDER 128
+/* free block orders are bounded by the bits in num_entries */
+#define PMEM_NR_FREE_ORDERS BITS_PER_LONG
+/* allocation latency histogram buckets, bucket i counts latencies below
+ * 2^(i + 1) ns */
+#define PMEM_LATENCY_BUCKETS 32
 #define PMEM_MIN_ALLOC PAGE_SIZE
 
 #define PMEM_DEBUG 1
@@ -48,6 +57,12 @@
  */
 #define PMEM_FLAGS_SUBMAP 0x1 << 3
 #define PMEM_FLAGS_UNSUBMAP 0x1 << 4
+/* indicates the physical address was handed to userspace, so the
+ * allocation must never be moved by compaction */
+#define PMEM_FLAGS_PHYS 0x1 << 5
+/* indicates a mapping of this allocation was split or copied (vma_open),
+ * compaction can't find every pte pointing at it so it is never moved */
+#define PMEM_FLAGS_NOCOMPACT 0x1 << 6
 
 
 struct pmem_data {
@@ -62,6 +77,9 @@ struct pmem_data {
 	struct rw_semaphore sem;
 	/* info about the mmaping process */
 	struct vm_area_struct *vma;
+	/* the master's own mapping, only used by compaction, vma stays NULL
+	 * for masters as get_pmem_user_addr callers expect */
+	struct vm_area_struct *master_vma;
 	/* task struct of the mapping process */
 	struct task_struct *task;
 	/* process id of teh mapping process */
@@ -74,14 +92,22 @@ struct pmem_data {
 	struct list_head region_list;
 	/* a linked list of data so we can access them for debugging */
 	struct list_head list;
-#if PMEM_DEBUG
+	/* references taken by kernel users of the physical address, see
+	 * get_pmem_addr, the allocation can't be moved while this is held */
 	int ref;
-#endif
 };
 
 struct pmem_bits {
 	unsigned allocated:1;		/* 1 if allocated, 0 if free */
 	unsigned order:7;		/* size of the region in pmem space */
+	/* entry in free_area[order] if this is the first slot of a free
+	 * block, empty otherwise */
+	struct list_head free_list;
+};
+
+struct pmem_free_area {
+	struct list_head list;		/* free blocks of this order */
+	unsigned long nr_free;		/* number of blocks on list */
 };
 
 struct pmem_region_node {
@@ -116,6 +142,9 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* free blocks indexed by order, as in the page allocator, so
+	 * allocating and freeing never scans the bitmap */
+	struct pmem_free_area free_area[PMEM_NR_FREE_ORDERS];
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -131,7 +160,7 @@ struct pmem_info {
 	 * needed */
 	struct semaphore data_list_sem;
 	struct list_head data_list;
-	/* pmem_sem protects the bitmap array
+	/* pmem_sem protects the bitmap array and free_area
 	 * a write lock should be held when modifying entries in bitmap
 	 * a read lock should be held when reading data from bits or
 	 * dereferencing a pointer into bitmap
@@ -145,6 +174,38 @@ struct pmem_info {
 	 */
 	struct rw_semaphore bitmap_sem;
 
+	/* serializes compaction of this region, taken before
+	 * data_list_sem */
+	struct mutex compact_lock;
+	/* set when an allocation failed for fragmentation, the compaction
+	 * thread clears it */
+	int compact_pending;
+	/* compaction statistics, protected by compact_lock */
+	unsigned long compact_runs;
+	unsigned long compact_moved;
+	unsigned long compact_moved_bytes;
+	unsigned long compact_busy;
+
+	/* allocation statistics, written under the bitmap_sem write lock and
+	 * read without it by the sysfs attributes, a torn read of these is
+	 * only ever a slightly stale value */
+	unsigned long allocated_bytes;
+	unsigned long peak_bytes;
+	unsigned long alloc_count;
+	unsigned long alloc_failures[PMEM_NR_FREE_ORDERS];
+	unsigned long alloc_latency[PMEM_LATENCY_BUCKETS];
+
+	/* cache maintenance statistics: bytes by operation, operations
+	 * issued, and requests made before batches coalesced them */
+	atomic_long_t cache_clean_bytes;
+	atomic_long_t cache_inv_bytes;
+	atomic_long_t cache_flush_bytes;
+	atomic_long_t cache_ops;
+	atomic_long_t cache_requests;
+	/* snapshot of the byte total at the last stats read, for the rate */
+	unsigned long cache_rate_bytes;
+	unsigned long cache_rate_jiffies;
+
 	long (*ioctl)(struct file *, unsigned int, unsigned long);
 	int (*release)(struct inode *, struct file *);
 };
@@ -152,7 +213,12 @@ struct pmem_info {
 static struct pmem_info pmem[PMEM_MAX_DEVICES];
 static int id_count;
 
+static struct task_struct *pmem_compact_task;
+static DECLARE_WAIT_QUEUE_HEAD(pmem_compact_wait);
+
 #define PMEM_IS_FREE(id, index) !(pmem[id].bitmap[index].allocated)
+#define PMEM_IS_FREE_BLOCK(id, index) \
+	(!list_empty(&pmem[id].bitmap[index].free_list))
 #define PMEM_ORDER(id, index) pmem[id].bitmap[index].order
 #define PMEM_BUDDY_INDEX(id, index) (index ^ (1 << PMEM_ORDER(id, index)))
 #define PMEM_NEXT_INDEX(id, index) (index + (1 << PMEM_ORDER(id, index)))
@@ -186,7 +252,7 @@ static int get_id(struct file *file)
 	return MINOR(file->f_dentry->d_inode->i_rdev);
 }
 
-static int is_pmem_file(struct file *file)
+int is_pmem_file(struct file *file)
 {
 	int id;
 
@@ -232,6 +298,43 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+static void pmem_free_area_add(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	struct pmem_free_area *area = &pmem[id].free_area[PMEM_ORDER(id, index)];
+
+	list_add(&pmem[id].bitmap[index].free_list, &area->list);
+	area->nr_free++;
+}
+
+static void pmem_free_area_del(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	struct pmem_free_area *area = &pmem[id].free_area[PMEM_ORDER(id, index)];
+
+	list_del_init(&pmem[id].bitmap[index].free_list);
+	area->nr_free--;
+}
+
+static unsigned long pmem_free_pages(int id)
+{
+	/* caller should hold a lock on pmem_sem! */
+	unsigned long pages = 0;
+	int i;
+
+	for (i = 0; i < PMEM_NR_FREE_ORDERS; i++)
+		pages += pmem[id].free_area[i].nr_free << i;
+	return pages;
+}
+
+static void pmem_stat_alloc(int id, unsigned long bytes)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	pmem[id].allocated_bytes += bytes;
+	if (pmem[id].allocated_bytes > pmem[id].peak_bytes)
+		pmem[id].peak_bytes = pmem[id].allocated_bytes;
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
@@ -239,26 +342,30 @@ static int pmem_free(int id, int index)
 	DLOG("index %d\n", index);
 
 	if (pmem[id].no_allocator) {
+		/* in no_allocator mode the index is the length */
+		pmem[id].allocated_bytes -= index;
 		pmem[id].allocated = 0;
 		return 0;
 	}
+	pmem[id].allocated_bytes -= PMEM_LEN(id, curr);
 	/* clean up the bitmap, merging any buddies */
 	pmem[id].bitmap[curr].allocated = 0;
 	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
-	 * repeat until the buddy is not free or end of the bitmap is reached
+	 * if the buddy is also a free block of the same order merge them
+	 * repeat until the buddy is not free or lies past the bitmap
 	 */
-	do {
+	for (;;) {
 		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
+		if (buddy >= pmem[id].num_entries ||
+		    !PMEM_IS_FREE_BLOCK(id, buddy) ||
+		    PMEM_ORDER(id, buddy) != PMEM_ORDER(id, curr))
 			break;
-		}
-	} while (curr < pmem[id].num_entries);
+		pmem_free_area_del(id, buddy);
+		PMEM_ORDER(id, buddy)++;
+		PMEM_ORDER(id, curr)++;
+		curr = min(buddy, curr);
+	}
+	pmem_free_area_add(id, curr);
 
 	return 0;
 }
@@ -347,11 +454,10 @@ static int pmem_open(struct inode *inode, struct file *file)
 	data->index = -1;
 	data->task = NULL;
 	data->vma = NULL;
+	data->master_vma = NULL;
 	data->pid = 0;
 	data->master_file = NULL;
-#if PMEM_DEBUG
 	data->ref = 0;
-#endif
 	INIT_LIST_HEAD(&data->region_list);
 	init_rwsem(&data->sem);
 
@@ -380,40 +486,40 @@ static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
+	struct pmem_free_area *area;
 	int best_fit = -1;
+	unsigned long curr;
 	unsigned long order = pmem_order(len);
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
-		if ((len > pmem[id].size) || pmem[id].allocated)
+		if ((len > pmem[id].size) || pmem[id].allocated) {
+			pmem[id].alloc_failures[min(order,
+				PMEM_NR_FREE_ORDERS - 1UL)]++;
 			return -1;
+		}
 		pmem[id].allocated = 1;
+		pmem_stat_alloc(id, len);
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (order > PMEM_MAX_ORDER) {
+		pmem[id].alloc_failures[PMEM_NR_FREE_ORDERS - 1]++;
 		return -1;
+	}
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
+	/* look through the free lists:
+	 * 	if there is a free block of the correct order use it
+	 * 	otherwise, use the best fit (smallest with size > order) block
 	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
+	for (curr = order; curr < PMEM_NR_FREE_ORDERS; curr++) {
+		area = &pmem[id].free_area[curr];
+		if (!list_empty(&area->list)) {
+			best_fit = list_entry(area->list.next, struct pmem_bits,
+					      free_list) - pmem[id].bitmap;
+			break;
 		}
-		curr = PMEM_NEXT_INDEX(id, curr);
 	}
 
 	/* if best_fit < 0, there are no suitable slots,
@@ -421,23 +527,52 @@ static int pmem_allocate(int id, unsigned long len)
 	 */
 	if (best_fit < 0) {
 		printk("pmem: no space left to allocate!\n");
+		pmem[id].alloc_failures[min(order,
+			PMEM_NR_FREE_ORDERS - 1UL)]++;
+		/* enough space, just not in one piece, try to fix that */
+		if (pmem_free_pages(id) >= (1UL << order)) {
+			pmem[id].compact_pending = 1;
+			wake_up(&pmem_compact_wait);
+		}
 		return -1;
 	}
 
 	/* now partition the best fit:
 	 * 	split the slot into 2 buddies of order - 1
+	 * 	return the upper buddy to the free lists
 	 * 	repeat until the slot is of the correct order
 	 */
+	pmem_free_area_del(id, best_fit);
 	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
 		int buddy;
 		PMEM_ORDER(id, best_fit) -= 1;
 		buddy = PMEM_BUDDY_INDEX(id, best_fit);
 		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+		pmem_free_area_add(id, buddy);
 	}
 	pmem[id].bitmap[best_fit].allocated = 1;
+	pmem_stat_alloc(id, PMEM_LEN(id, best_fit));
 	return best_fit;
 }
 
+/* pmem_allocate with the bitmap_sem taken, timing the whole thing, lock
+ * wait included, for the latency histogram */
+static int pmem_allocate_timed(int id, unsigned long len)
+{
+	ktime_t start = ktime_get();
+	s64 ns;
+	int index;
+
+	down_write(&pmem[id].bitmap_sem);
+	index = pmem_allocate(id, len);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	pmem[id].alloc_count++;
+	pmem[id].alloc_latency[min(ns > 1 ? fls64(ns) - 1 : 0,
+				   PMEM_LATENCY_BUCKETS - 1)]++;
+	up_write(&pmem[id].bitmap_sem);
+	return index;
+}
+
 static pgprot_t phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
 {
 	int id = get_id(file);
@@ -541,6 +676,7 @@ static void pmem_vma_open(struct vm_area_struct *vma)
 	 * ranges via fork */
 	BUG_ON(!has_allocation(file));
 	down_write(&data->sem);
+	data->flags |= PMEM_FLAGS_NOCOMPACT;
 	/* remap the garbage pages, forkers don't get access to the data */
 	pmem_unmap_pfn_range(id, vma, data, 0, vma->vm_start - vma->vm_end);
 	up_write(&data->sem);
@@ -566,6 +702,8 @@ static void pmem_vma_close(struct vm_area_struct *vma)
 		    (data->flags & PMEM_FLAGS_SUBMAP))
 			data->flags |= PMEM_FLAGS_UNSUBMAP;
 	}
+	if (data->master_vma == vma)
+		data->master_vma = NULL;
 	/* the kernel is going to free this vma now anyway */
 	up_write(&data->sem);
 }
@@ -606,9 +744,7 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 	}
 	/* if file->private_data == unalloced, alloc*/
 	if (data && data->index == -1) {
-		down_write(&pmem[id].bitmap_sem);
-		index = pmem_allocate(id, vma->vm_end - vma->vm_start);
-		up_write(&pmem[id].bitmap_sem);
+		index = pmem_allocate_timed(id, vma->vm_end - vma->vm_start);
 		data->index = index;
 	}
 	/* either no space was available or an error occured */
@@ -669,6 +805,7 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		}
 		data->flags |= PMEM_FLAGS_MASTERMAP;
 		data->pid = current->pid;
+		data->master_vma = vma;
 	}
 	vma->vm_ops = &vm_ops;
 error:
@@ -725,16 +862,13 @@ int get_pmem_addr(struct file *file, unsigned long *start, unsigned long *vstart
 	}
 	id = get_id(file);
 
-	down_read(&data->sem);
+	/* take the ref with the address so compaction can't move it between */
+	down_write(&data->sem);
 	*start = pmem_start_addr(id, data);
 	*len = pmem_len(id, data);
 	*vstart = (unsigned long)pmem_start_vaddr(id, data);
-	up_read(&data->sem);
-#if PMEM_DEBUG
-	down_write(&data->sem);
 	data->ref++;
 	up_write(&data->sem);
-#endif
 	return 0;
 }
 
@@ -776,16 +910,16 @@ void put_pmem_file(struct file *file)
 		return;
 	id = get_id(file);
 	data = (struct pmem_data *)file->private_data;
-#if PMEM_DEBUG
 	down_write(&data->sem);
+#if PMEM_DEBUG
 	if (data->ref == 0) {
 		printk("pmem: pmem_put > pmem_get %s (pid %d)\n",
 		       pmem[id].dev.name, data->pid);
 		BUG();
 	}
+#endif
 	data->ref--;
 	up_write(&data->sem);
-#endif
 	fput(file);
 }
 
@@ -801,53 +935,130 @@ void put_pmem_fd(unsigned int fd)
 	fput_light(file, put_needed);
 }
 
-void flush_pmem_fd(unsigned int fd, unsigned long offset, unsigned long len)
+static void pmem_cache_maint(int id, void *start, void *end, unsigned int op)
+{
+	unsigned long len = end - start;
+
+	switch (op) {
+	case PMEM_CACHE_CLEAN:
+		dmac_clean_range(start, end);
+		atomic_long_add(len, &pmem[id].cache_clean_bytes);
+		break;
+	case PMEM_CACHE_INVALIDATE:
+		dmac_inv_range(start, end);
+		atomic_long_add(len, &pmem[id].cache_inv_bytes);
+		break;
+	default:
+		dmac_flush_range(start, end);
+		atomic_long_add(len, &pmem[id].cache_flush_bytes);
+		break;
+	}
+	atomic_long_inc(&pmem[id].cache_ops);
+}
+
+/* clean, invalidate or flush exactly [offset, offset + len) of the
+ * allocation behind fd, clipped to the allocation.  only the cache lines
+ * of that range are touched; flushing lines a connected file hasn't got
+ * mapped is harmless, so no region lookup is needed.  'requests' is how
+ * many caller requests this range stands for, for the stats */
+static void pmem_cache_maint_range(unsigned int fd, unsigned long offset,
+				   unsigned long len, unsigned int op,
+				   int requests)
 {
 	struct pmem_data *data;
 	struct file *file;
 	int id;
 	void *vaddr;
-	struct pmem_region_node *region_node;
-	struct list_head *elt;
-	void *flush_start, *flush_end;
+	unsigned long alloc_len;
 	int fput_needed;
 
 	file = fget_light(fd, &fput_needed);
 	if (file == NULL)
 		return;
 
-	if (!is_pmem_file(file) || !has_allocation(file)) {
-		fput_light(file, fput_needed);
-		return;
-	}
+	if (!is_pmem_file(file) || !has_allocation(file))
+		goto end;
 
 	id = get_id(file);
 	data = (struct pmem_data *)file->private_data;
-	fput_light(file, fput_needed);
+	atomic_long_add(requests, &pmem[id].cache_requests);
 	if (!pmem[id].cached)
-		return;
+		goto end;
 
 	down_read(&data->sem);
 	vaddr = pmem_start_vaddr(id, data);
-	/* if this isn't a submmapped file, flush the whole thing */
-	if (unlikely(!(data->flags & PMEM_FLAGS_CONNECTED))) {
-		dmac_flush_range(vaddr, vaddr + pmem_len(id, data));
-		goto end;
+	alloc_len = pmem_len(id, data);
+	if (offset < alloc_len && len) {
+		if (len > alloc_len - offset)
+			len = alloc_len - offset;
+		pmem_cache_maint(id, vaddr + offset, vaddr + offset + len, op);
 	}
-	/* otherwise, flush the region of the file we are drawing */
-	list_for_each(elt, &data->region_list) {
-		region_node = list_entry(elt, struct pmem_region_node, list);
-		if ((offset >= region_node->region.offset) &&
-		    ((offset + len) <= (region_node->region.offset +
-			region_node->region.len))) {
-			flush_start = vaddr + region_node->region.offset;
-			flush_end = flush_start + region_node->region.len;
-			dmac_flush_range(flush_start, flush_end);
-			break;
-		}
-	}
-end:
 	up_read(&data->sem);
+end:
+	fput_light(file, fput_needed);
+}
+
+void cache_maint_pmem_fd(unsigned int fd, unsigned long offset,
+			 unsigned long len, unsigned int op)
+{
+	pmem_cache_maint_range(fd, offset, len, op, 1);
+}
+
+void flush_pmem_fd(unsigned int fd, unsigned long offset, unsigned long len)
+{
+	cache_maint_pmem_fd(fd, offset, len, PMEM_CACHE_FLUSH);
+}
+
+void pmem_cache_batch_init(struct pmem_cache_batch *batch)
+{
+	batch->count = 0;
+}
+
+/* run and empty the batch */
+void pmem_cache_batch_commit(struct pmem_cache_batch *batch)
+{
+	struct pmem_cache_range *r;
+	int i;
+
+	for (i = 0; i < batch->count; i++) {
+		r = &batch->range[i];
+		pmem_cache_maint_range(r->fd, r->offset, r->len, r->op,
+				       r->requests);
+	}
+	batch->count = 0;
+}
+
+/* queue a cache operation, merging it with a queued one on the same fd
+ * with the same op that it overlaps or abuts, as the src and dst planes
+ * of a blit list usually do */
+void pmem_cache_batch_add(struct pmem_cache_batch *batch, unsigned int fd,
+			  unsigned long offset, unsigned long len,
+			  unsigned int op)
+{
+	struct pmem_cache_range *r;
+	int i;
+
+	if (!len)
+		return;
+	for (i = 0; i < batch->count; i++) {
+		r = &batch->range[i];
+		if (r->fd != fd || r->op != op ||
+		    offset > r->offset + r->len || r->offset > offset + len)
+			continue;
+		len = max(r->offset + r->len, offset + len);
+		r->offset = min(r->offset, offset);
+		r->len = len - r->offset;
+		r->requests++;
+		return;
+	}
+	if (batch->count == PMEM_CACHE_BATCH_MAX)
+		pmem_cache_batch_commit(batch);
+	r = &batch->range[batch->count++];
+	r->fd = fd;
+	r->offset = offset;
+	r->len = len;
+	r->op = op;
+	r->requests = 1;
 }
 
 static int pmem_connect(unsigned long connect, struct file *file)
@@ -1081,6 +1292,387 @@ static void pmem_revoke(struct file *file, struct pmem_data *data)
 	pmem_unlock_data_and_mm(data, mm);
 }
 
+/* compaction:
+ * 	an allocation whose buddy is free is moved into a free block of the
+ * 	same order elsewhere, so its old slot merges with the buddy
+ * 	only idle allocations are moved: no kernel refs (get_pmem_file), no
+ * 	physical address handed to userspace (PMEM_GET_PHYS/GET_SIZE), and
+ * 	every mm and pmem_data involved can be locked without waiting, nor
+ * 	allocations whose mapping was ever split or forked
+ * 	user mappings of the master and of connected files are zapped before
+ * 	the copy and remapped afterwards with the same helpers the map/unmap
+ * 	ioctls use
+ */
+#define PMEM_COMPACT_MAX_FILES 8
+#define PMEM_COMPACT_MAX_PASSES 4
+
+static int pmem_compact_find(int id, int from, int *dst)
+{
+	/* caller should hold a lock on pmem_sem! */
+	struct pmem_bits *bits;
+	int curr, buddy, order;
+
+	for (curr = 0; curr < pmem[id].num_entries;
+	     curr = PMEM_NEXT_INDEX(id, curr)) {
+		if (curr < from || PMEM_IS_FREE(id, curr))
+			continue;
+		order = PMEM_ORDER(id, curr);
+		buddy = PMEM_BUDDY_INDEX(id, curr);
+		if (buddy >= pmem[id].num_entries ||
+		    !PMEM_IS_FREE_BLOCK(id, buddy) ||
+		    PMEM_ORDER(id, buddy) != order)
+			continue;
+		/* free blocks always have an allocated buddy, so any block
+		 * but our own buddy is one that can't merge anyway */
+		list_for_each_entry(bits, &pmem[id].free_area[order].list,
+				    free_list) {
+			if (bits - pmem[id].bitmap != buddy) {
+				*dst = bits - pmem[id].bitmap;
+				return curr;
+			}
+		}
+	}
+	return -1;
+}
+
+static struct vm_area_struct *pmem_compact_vma(struct pmem_data *data)
+{
+	if (data->flags & PMEM_FLAGS_CONNECTED)
+		return data->vma;
+	return data->master_vma;
+}
+
+static void pmem_compact_unmap(struct pmem_data *data)
+{
+	/* caller holds data->sem and the mm sem of the vma, faults on the
+	 * zapped range wait on the mm sem until the new ptes are in */
+	struct vm_area_struct *vma = pmem_compact_vma(data);
+	struct pmem_region_node *region_node;
+
+	if (!(data->flags & PMEM_FLAGS_CONNECTED)) {
+		zap_page_range(vma, vma->vm_start, vma->vm_end - vma->vm_start,
+			       NULL);
+		return;
+	}
+	list_for_each_entry(region_node, &data->region_list, list)
+		zap_page_range(vma, vma->vm_start + region_node->region.offset,
+			       region_node->region.len, NULL);
+}
+
+static void pmem_compact_remap(int id, struct pmem_data *data)
+{
+	/* caller holds data->sem and the mm sem of the vma */
+	struct vm_area_struct *vma = pmem_compact_vma(data);
+	struct pmem_region_node *region_node;
+	int ret = 0;
+
+	vma->vm_pgoff = pmem_start_addr(id, data) >> PAGE_SHIFT;
+	if (!(data->flags & PMEM_FLAGS_CONNECTED)) {
+		ret = pmem_remap_pfn_range(id, vma, data, 0,
+					   vma->vm_end - vma->vm_start);
+	} else {
+		/* the rest of a submap is the garbage page, leave it be */
+		list_for_each_entry(region_node, &data->region_list, list)
+			ret |= pmem_remap_pfn_range(id, vma, data,
+						    region_node->region.offset,
+						    region_node->region.len);
+	}
+	if (ret)
+		printk(KERN_ERR "pmem: failed to remap pid %d after "
+		       "compaction\n", data->pid);
+}
+
+static int pmem_compact_move(int id, int src, int dst)
+{
+	struct pmem_data *group[PMEM_COMPACT_MAX_FILES];
+	struct mm_struct *mms[PMEM_COMPACT_MAX_FILES];
+	int mm_locked[PMEM_COMPACT_MAX_FILES];
+	struct pmem_data *data;
+	int n = 0, data_locked = 0, ret = -EBUSY, i, j;
+	unsigned long len;
+	void *from, *to;
+
+	/* gather the master and every file connected to it */
+	down(&pmem[id].data_list_sem);
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		struct mm_struct *mm = NULL;
+
+		down_read(&data->sem);
+		if (data->index != src) {
+			up_read(&data->sem);
+			continue;
+		}
+		if (n == PMEM_COMPACT_MAX_FILES || data->ref ||
+		    (data->flags & (PMEM_FLAGS_PHYS | PMEM_FLAGS_NOCOMPACT))) {
+			up_read(&data->sem);
+			goto out;
+		}
+		if (pmem_compact_vma(data)) {
+			mm = pmem_compact_vma(data)->vm_mm;
+			if (!atomic_inc_not_zero(&mm->mm_users)) {
+				up_read(&data->sem);
+				goto out;
+			}
+		}
+		up_read(&data->sem);
+		mm_locked[n] = 0;
+		mms[n] = mm;
+		group[n++] = data;
+	}
+	if (!n)
+		goto out;
+
+	/* mm sems go before data sems, never wait on either: whoever holds
+	 * them is using the allocation right now */
+	for (i = 0; i < n; i++) {
+		if (!mms[i])
+			continue;
+		for (j = 0; j < i; j++)
+			if (mms[j] == mms[i])
+				break;
+		if (j < i)
+			continue;
+		if (!down_write_trylock(&mms[i]->mmap_sem))
+			goto unlock;
+		mm_locked[i] = 1;
+	}
+	for (; data_locked < n; data_locked++)
+		if (!down_write_trylock(&group[data_locked]->sem))
+			goto unlock;
+	for (i = 0; i < n; i++) {
+		data = group[i];
+		if (data->index != src || data->ref ||
+		    (data->flags & (PMEM_FLAGS_PHYS | PMEM_FLAGS_NOCOMPACT)) ||
+		    (pmem_compact_vma(data) ?
+		     pmem_compact_vma(data)->vm_mm : NULL) != mms[i])
+			goto unlock;
+	}
+
+	down_write(&pmem[id].bitmap_sem);
+	if (PMEM_IS_FREE(id, src) || !PMEM_IS_FREE_BLOCK(id, dst) ||
+	    PMEM_ORDER(id, dst) != PMEM_ORDER(id, src)) {
+		up_write(&pmem[id].bitmap_sem);
+		goto unlock;
+	}
+	pmem_free_area_del(id, dst);
+	pmem[id].bitmap[dst].allocated = 1;
+	/* pmem_free(src) takes this back out; a move doesn't change usage,
+	 * so it mustn't raise the peak either */
+	pmem[id].allocated_bytes += PMEM_LEN(id, dst);
+	up_write(&pmem[id].bitmap_sem);
+
+	/* no user pte may point at src while it is copied, or stores made
+	 * during the copy would be left behind */
+	for (i = 0; i < n; i++)
+		if (pmem_compact_vma(group[i]))
+			pmem_compact_unmap(group[i]);
+
+	len = PMEM_LEN(id, src);
+	from = (void *)(pmem[id].vbase + PMEM_OFFSET(src));
+	to = (void *)(pmem[id].vbase + PMEM_OFFSET(dst));
+	memcpy(to, from, len);
+	if (pmem[id].cached)
+		dmac_flush_range(to, to + len);
+
+	for (i = 0; i < n; i++) {
+		group[i]->index = dst;
+		if (pmem_compact_vma(group[i]))
+			pmem_compact_remap(id, group[i]);
+	}
+
+	down_write(&pmem[id].bitmap_sem);
+	pmem_free(id, src);
+	up_write(&pmem[id].bitmap_sem);
+
+	pmem[id].compact_moved++;
+	pmem[id].compact_moved_bytes += len;
+	ret = 0;
+	DLOG("moved %d to %d len %lx\n", src, dst, len);
+
+unlock:
+	for (i = 0; i < data_locked; i++)
+		up_write(&group[i]->sem);
+	for (i = 0; i < n; i++)
+		if (mm_locked[i])
+			up_write(&mms[i]->mmap_sem);
+out:
+	up(&pmem[id].data_list_sem);
+	/* outside data_list_sem, the last mmput may release pmem files */
+	for (i = 0; i < n; i++)
+		if (mms[i])
+			mmput(mms[i]);
+	return ret;
+}
+
+static int pmem_compact(int id)
+{
+	int pass, moved, total = 0, src, dst, from;
+
+	if (pmem[id].no_allocator)
+		return 0;
+
+	mutex_lock(&pmem[id].compact_lock);
+	pmem[id].compact_runs++;
+	for (pass = 0; pass < PMEM_COMPACT_MAX_PASSES; pass++) {
+		moved = 0;
+		from = 0;
+		for (;;) {
+			down_read(&pmem[id].bitmap_sem);
+			src = pmem_compact_find(id, from, &dst);
+			up_read(&pmem[id].bitmap_sem);
+			if (src < 0)
+				break;
+			from = src + 1;
+			if (pmem_compact_move(id, src, dst))
+				pmem[id].compact_busy++;
+			else
+				moved++;
+		}
+		total += moved;
+		if (!moved)
+			break;
+	}
+	mutex_unlock(&pmem[id].compact_lock);
+	return total;
+}
+
+/* unusable free space index for allocations of 'order', in thousandths:
+ * the share of free space sitting in blocks too small to satisfy them */
+static unsigned long pmem_frag_index(int id, int order)
+{
+	/* caller should hold a lock on pmem_sem! */
+	unsigned long free = pmem_free_pages(id), usable = 0;
+	int i;
+
+	if (!free)
+		return 0;
+	for (i = order; i < PMEM_NR_FREE_ORDERS; i++)
+		usable += pmem[id].free_area[i].nr_free << i;
+	return (free - usable) * 1000 / free;
+}
+
+static int pmem_compact_pending(void)
+{
+	int id;
+
+	for (id = 0; id < id_count; id++)
+		if (pmem[id].compact_pending)
+			return 1;
+	return 0;
+}
+
+static int pmem_compact_thread(void *unused)
+{
+	int id;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(pmem_compact_wait,
+					 pmem_compact_pending() ||
+					 kthread_should_stop());
+		for (id = 0; id < id_count; id++) {
+			if (!pmem[id].compact_pending)
+				continue;
+			pmem[id].compact_pending = 0;
+			pmem_compact(id);
+		}
+	}
+	return 0;
+}
+
+static ssize_t compact_read(struct file *file, char __user *buf, size_t count,
+			    loff_t *ppos)
+{
+	int id = (int)file->private_data;
+	char buffer[512];
+	unsigned long free;
+	int n, order, max_order = -1;
+
+	down_read(&pmem[id].bitmap_sem);
+	free = pmem_free_pages(id);
+	for (order = PMEM_NR_FREE_ORDERS - 1; order >= 0; order--)
+		if (pmem[id].free_area[order].nr_free) {
+			max_order = order;
+			break;
+		}
+	n = scnprintf(buffer, sizeof(buffer),
+		      "free pages: %lu\nlargest free order: %d\n"
+		      "fragmentation index: %lu\nunusable index by order:",
+		      free, max_order,
+		      free ? pmem_frag_index(id, fls(free) - 1) : 0);
+	for (order = 0; free && order < fls(free); order++)
+		n += scnprintf(buffer + n, sizeof(buffer) - n, " %lu",
+			       pmem_frag_index(id, order));
+	up_read(&pmem[id].bitmap_sem);
+
+	mutex_lock(&pmem[id].compact_lock);
+	n += scnprintf(buffer + n, sizeof(buffer) - n,
+		       "\ncompactions: %lu\nmoved: %lu (%lu bytes)\n"
+		       "busy: %lu\n", pmem[id].compact_runs,
+		       pmem[id].compact_moved, pmem[id].compact_moved_bytes,
+		       pmem[id].compact_busy);
+	mutex_unlock(&pmem[id].compact_lock);
+
+	return simple_read_from_buffer(buf, count, ppos, buffer, n);
+}
+
+static ssize_t compact_write(struct file *file, const char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	int id = (int)file->private_data;
+
+	/* any write runs a compaction pass right now */
+	pmem_compact(id);
+	return count;
+}
+
+static int compact_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static struct file_operations compact_fops = {
+	.read = compact_read,
+	.write = compact_write,
+	.open = compact_open,
+};
+
+static ssize_t cache_read(struct file *file, char __user *buf, size_t count,
+			  loff_t *ppos)
+{
+	int id = (int)file->private_data;
+	char buffer[384];
+	unsigned long clean, inv, flush, total, rate = 0, now = jiffies;
+	int n;
+
+	clean = atomic_long_read(&pmem[id].cache_clean_bytes);
+	inv = atomic_long_read(&pmem[id].cache_inv_bytes);
+	flush = atomic_long_read(&pmem[id].cache_flush_bytes);
+	total = clean + inv + flush;
+	/* the rate is over the time since the stats were last read */
+	if (*ppos == 0) {
+		if (now != pmem[id].cache_rate_jiffies)
+			rate = (total - pmem[id].cache_rate_bytes) * HZ /
+			       (now - pmem[id].cache_rate_jiffies);
+		pmem[id].cache_rate_bytes = total;
+		pmem[id].cache_rate_jiffies = now;
+	}
+
+	n = scnprintf(buffer, sizeof(buffer),
+		      "clean bytes: %lu\ninvalidate bytes: %lu\n"
+		      "flush bytes: %lu\nbytes/sec: %lu\n"
+		      "requests: %ld\noperations: %ld\n",
+		      clean, inv, flush, rate,
+		      atomic_long_read(&pmem[id].cache_requests),
+		      atomic_long_read(&pmem[id].cache_ops));
+	return simple_read_from_buffer(buf, count, ppos, buffer, n);
+}
+
+static struct file_operations cache_fops = {
+	.read = cache_read,
+	.open = compact_open,
+};
+
 static void pmem_get_size(struct pmem_region *region, struct file *file)
 {
 	struct pmem_data *data = (struct pmem_data *)file->private_data;
@@ -1091,8 +1683,12 @@ static void pmem_get_size(struct pmem_region *region, struct file *file)
 		region->len = 0;
 		return;
 	} else {
+		/* the offset is the physical address, so pin it in place */
+		down_write(&data->sem);
+		data->flags |= PMEM_FLAGS_PHYS;
 		region->offset = pmem_start_addr(id, data);
 		region->len = pmem_len(id, data);
+		up_write(&data->sem);
 	}
 	DLOG("offset %lx len %lx\n", region->offset, region->len);
 }
@@ -1113,8 +1709,11 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				region.len = 0;
 			} else {
 				data = (struct pmem_data *)file->private_data;
+				down_write(&data->sem);
+				data->flags |= PMEM_FLAGS_PHYS;
 				region.offset = pmem_start_addr(id, data);
 				region.len = pmem_len(id, data);
+				up_write(&data->sem);
 			}
 			printk(KERN_INFO "pmem: request for physical address of pmem region "
 					"from process %d.\n", current->pid);
@@ -1170,7 +1769,7 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			if (has_allocation(file))
 				return -EINVAL;
 			data = (struct pmem_data *)file->private_data;
-			data->index = pmem_allocate(id, arg);
+			data->index = pmem_allocate_timed(id, arg);
 			break;
 		}
 	case PMEM_CONNECT:
@@ -1237,6 +1836,127 @@ static struct file_operations debug_fops = {
 };
 #endif
 
+static int pmem_dev_id(struct device *dev)
+{
+	int id;
+
+	for (id = 0; id < id_count; id++)
+		if (pmem[id].dev.this_device == dev)
+			return id;
+	return -1;
+}
+
+static ssize_t show_allocated_bytes(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	int id = pmem_dev_id(dev);
+
+	return sprintf(buf, "%lu\n", pmem[id].allocated_bytes);
+}
+
+static ssize_t show_peak_bytes(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	int id = pmem_dev_id(dev);
+
+	return sprintf(buf, "%lu\n", pmem[id].peak_bytes);
+}
+
+/* writing anything restarts the high-water mark from current usage */
+static ssize_t store_peak_bytes(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	int id = pmem_dev_id(dev);
+
+	down_write(&pmem[id].bitmap_sem);
+	pmem[id].peak_bytes = pmem[id].allocated_bytes;
+	up_write(&pmem[id].bitmap_sem);
+	return count;
+}
+
+static ssize_t show_largest_free(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	int id = pmem_dev_id(dev);
+	int order;
+
+	if (pmem[id].no_allocator)
+		return sprintf(buf, "%lu\n",
+			       pmem[id].allocated ? 0 : pmem[id].size);
+	for (order = PMEM_NR_FREE_ORDERS - 1; order >= 0; order--)
+		if (pmem[id].free_area[order].nr_free)
+			return sprintf(buf, "%lu\n",
+				       (1UL << order) * PMEM_MIN_ALLOC);
+	return sprintf(buf, "0\n");
+}
+
+/* "order:count" for every order that has failed */
+static ssize_t show_alloc_failures(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	int id = pmem_dev_id(dev);
+	int order, n = 0;
+
+	for (order = 0; order < PMEM_NR_FREE_ORDERS; order++)
+		if (pmem[id].alloc_failures[order])
+			n += scnprintf(buf + n, PAGE_SIZE - n, "%d:%lu ", order,
+				       pmem[id].alloc_failures[order]);
+	n += scnprintf(buf + n, PAGE_SIZE - n, "\n");
+	return n;
+}
+
+/* the latency under which 'permille' of the allocations completed, as the
+ * upper bound of its histogram bucket */
+static unsigned long pmem_latency_percentile(int id, unsigned long count,
+					     int permille)
+{
+	unsigned long seen = 0;
+	int i;
+
+	for (i = 0; i < PMEM_LATENCY_BUCKETS; i++) {
+		seen += pmem[id].alloc_latency[i];
+		if (seen * 1000 >= count * permille)
+			break;
+	}
+	return i < 31 ? 2UL << i : ~0UL;
+}
+
+static ssize_t show_alloc_latency(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	int id = pmem_dev_id(dev);
+	unsigned long count = pmem[id].alloc_count;
+
+	if (!count)
+		return sprintf(buf, "count 0\n");
+	return sprintf(buf, "count %lu p50 %luns p90 %luns p99 %luns\n", count,
+		       pmem_latency_percentile(id, count, 500),
+		       pmem_latency_percentile(id, count, 900),
+		       pmem_latency_percentile(id, count, 990));
+}
+
+static DEVICE_ATTR(allocated_bytes, S_IRUGO, show_allocated_bytes, NULL);
+static DEVICE_ATTR(peak_bytes, S_IRUGO | S_IWUSR, show_peak_bytes,
+		   store_peak_bytes);
+static DEVICE_ATTR(largest_free, S_IRUGO, show_largest_free, NULL);
+static DEVICE_ATTR(alloc_failures, S_IRUGO, show_alloc_failures, NULL);
+static DEVICE_ATTR(alloc_latency, S_IRUGO, show_alloc_latency, NULL);
+
+static struct attribute *pmem_stat_attrs[] = {
+	&dev_attr_allocated_bytes.attr,
+	&dev_attr_peak_bytes.attr,
+	&dev_attr_largest_free.attr,
+	&dev_attr_alloc_failures.attr,
+	&dev_attr_alloc_latency.attr,
+	NULL,
+};
+
+static struct attribute_group pmem_stat_group = {
+	.name = "stats",
+	.attrs = pmem_stat_attrs,
+};
+
 #if 0
 static struct miscdevice pmem_dev = {
 	.name = "pmem",
@@ -1261,6 +1981,7 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	pmem[id].ioctl = ioctl;
 	pmem[id].release = release;
 	init_rwsem(&pmem[id].bitmap_sem);
+	mutex_init(&pmem[id].compact_lock);
 	init_MUTEX(&pmem[id].data_list_sem);
 	INIT_LIST_HEAD(&pmem[id].data_list);
 	pmem[id].dev.name = pdata->name;
@@ -1273,19 +1994,32 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 		printk(KERN_ALERT "Unable to register pmem driver!\n");
 		goto err_cant_register_device;
 	}
+	if (sysfs_create_group(&pmem[id].dev.this_device->kobj,
+			       &pmem_stat_group))
+		printk(KERN_WARNING "pmem: unable to create stats for %s\n",
+		       pdata->name);
 	pmem[id].num_entries = pmem[id].size / PMEM_MIN_ALLOC;
 
-	pmem[id].bitmap = kmalloc(pmem[id].num_entries *
-				  sizeof(struct pmem_bits), GFP_KERNEL);
+	/* a list_head per entry makes this too big to ask kmalloc for
+	 * contiguous pages on a large carveout */
+	pmem[id].bitmap = vmalloc(pmem[id].num_entries *
+				  sizeof(struct pmem_bits));
 	if (!pmem[id].bitmap)
 		goto err_no_mem_for_metadata;
 
 	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
 					  pmem[id].num_entries);
+	for (i = 0; i < pmem[id].num_entries; i++)
+		INIT_LIST_HEAD(&pmem[id].bitmap[i].free_list);
+	for (i = 0; i < PMEM_NR_FREE_ORDERS; i++) {
+		INIT_LIST_HEAD(&pmem[id].free_area[i].list);
+		pmem[id].free_area[i].nr_free = 0;
+	}
 
 	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
 		if ((pmem[id].num_entries) &  1<<i) {
 			PMEM_ORDER(id, index) = i;
+			pmem_free_area_add(id, index);
 			index = PMEM_NEXT_INDEX(id, index);
 		}
 	}
@@ -1312,10 +2046,35 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO, NULL, (void *)id,
 			    &debug_fops);
 #endif
+	if (pmem[id].cached) {
+		char name[64];
+
+		pmem[id].cache_rate_jiffies = jiffies;
+		snprintf(name, sizeof(name), "%s_cache", pdata->name);
+		debugfs_create_file(name, S_IFREG | S_IRUGO, NULL, (void *)id,
+				    &cache_fops);
+	}
+	if (!pmem[id].no_allocator) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "%s_compact", pdata->name);
+		debugfs_create_file(name, S_IFREG | S_IRUGO | S_IWUSR, NULL,
+				    (void *)id, &compact_fops);
+		if (!pmem_compact_task) {
+			pmem_compact_task = kthread_run(pmem_compact_thread,
+							NULL, "kpmemcompactd");
+			if (IS_ERR(pmem_compact_task)) {
+				printk(KERN_ERR "pmem: unable to start "
+				       "compaction thread\n");
+				pmem_compact_task = NULL;
+			}
+		}
+	}
 	return 0;
 error_cant_remap:
-	kfree(pmem[id].bitmap);
+	vfree(pmem[id].bitmap);
 err_no_mem_for_metadata:
+	sysfs_remove_group(&pmem[id].dev.this_device->kobj, &pmem_stat_group);
 	misc_deregister(&pmem[id].dev);
 err_cant_register_device:
 	return -1;
@@ -1338,6 +2097,7 @@ static int pmem_remove(struct platform_device *pdev)
 {
 	int id = pdev->id;
 	__free_page(pfn_to_page(pmem[id].garbage_pfn));
+	sysfs_remove_group(&pmem[id].dev.this_device->kobj, &pmem_stat_group);
 	misc_deregister(&pmem[id].dev);
 	return 0;
 }
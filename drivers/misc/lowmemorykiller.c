@@ -51,11 +51,14 @@ module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
+	struct hlist_node *node;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	int rem;
 	int tasksize;
 	int i;
+	int adj;
 	int min_adj = OOM_ADJUST_MAX + 1;
+	int selected_adj = 0;
 	int selected_tasksize = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES) + global_page_state(NR_FILE_PAGES);
@@ -71,33 +74,63 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	}
 	if(nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d, ma %d\n", nr_to_scan, gfp_mask, other_free, min_adj);
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		if(p->oomkilladj >= 0 && p->mm) {
+	if(min_adj == OOM_ADJUST_MAX + 1) {
+		lowmem_print(5, "lowmem_shrink %d, %x, return 0\n", nr_to_scan, gfp_mask);
+		return 0;
+	}
+	if(min_adj < 0)
+		min_adj = 0;
+	/*
+	 * Below a minfree, report the LRU size like the page cache would, so
+	 * shrink_slab's scan target stays proportional to its own scanning
+	 * without us looking at any process. Only calls that may kill go to
+	 * the buckets.
+	 */
+	rem = global_page_state(NR_ACTIVE) + global_page_state(NR_INACTIVE);
+	if(nr_to_scan <= 0) {
+		lowmem_print(5, "lowmem_shrink %d, %x, return %d\n", nr_to_scan, gfp_mask, rem);
+		return rem;
+	}
+	/*
+	 * The victim is the biggest process in the highest bucket at or above
+	 * min_adj that has one with memory; the buckets below it are never
+	 * looked at.
+	 */
+	spin_lock_irq(&oom_adj_lock);
+	for(adj = OOM_ADJUST_MAX; adj >= min_adj && selected == NULL; adj--) {
+		hlist_for_each_entry(p, node, oom_adj_bucket(adj), oom_adj_node) {
+			if(!p->mm)
+				continue;
 			tasksize = get_mm_rss(p->mm);
-			if(nr_to_scan > 0 && tasksize > 0 && p->oomkilladj >= min_adj) {
-				if(selected == NULL ||
-				   p->oomkilladj > selected->oomkilladj ||
-				   (p->oomkilladj == selected->oomkilladj &&
-				    tasksize > selected_tasksize)) {
-					selected = p;
-					selected_tasksize = tasksize;
-					lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-					             p->pid, p->comm, p->oomkilladj, tasksize);
-				}
+			if(tasksize <= 0)
+				continue;
+			if(selected == NULL || tasksize > selected_tasksize) {
+				selected = p;
+				selected_adj = adj;
+				selected_tasksize = tasksize;
 			}
-			rem += tasksize;
 		}
 	}
+	if(selected != NULL)
+		get_task_struct(selected);
+	spin_unlock_irq(&oom_adj_lock);
 	if(selected != NULL) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-		             selected->pid, selected->comm,
-		             selected->oomkilladj, selected_tasksize);
-		force_sig(SIGKILL, selected);
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+		             selected->pid, selected->comm, selected_adj,
+		             selected_tasksize);
+		/* it may have exited since; signal it only if it hasn't */
+		read_lock(&tasklist_lock);
+		if(pid_alive(selected)) {
+			lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+			             selected->pid, selected->comm,
+			             selected->oomkilladj, selected_tasksize);
+			force_sig(SIGKILL, selected);
+		}
+		read_unlock(&tasklist_lock);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n", nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
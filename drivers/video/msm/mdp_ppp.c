@@ -596,26 +596,45 @@ void mdp_ppp_put_img(struct mdp_blit_req *req)
 #endif
 }
 
-static void flush_imgs(struct mdp_blit_req *req, struct mdp_regs *regs)
-{
 #ifdef CONFIG_ANDROID_PMEM
-	uint32_t src0_len, src1_len, dst0_len, dst1_len;
+/* queue cache maintenance for the whole lines of 'rect' in each plane of
+ * 'img', which is what the mdp fetches and stores */
+static void flush_img(struct mdp_img *img, struct mdp_rect *rect,
+		      struct pmem_cache_batch *batch, unsigned int op)
+{
+	uint32_t stride = img->width * bytes_per_pixel[img->format];
+	uint32_t ratio, first, last;
 
-	/* flush src images to memory before dma to mdp */
-	get_len(&req->src, &req->src_rect, regs->src_bpp, &src0_len,
-		&src1_len);
-	flush_pmem_fd(req->src.memory_id, req->src.offset, src0_len);
-	if (IS_PSEUDOPLNR(req->src.format))
-		flush_pmem_fd(req->src.memory_id, req->src.offset + src0_len,
-			      src1_len);
+	pmem_cache_batch_add(batch, img->memory_id,
+			     img->offset + rect->y * stride, rect->h * stride,
+			     op);
+	if (IS_PSEUDOPLNR(img->format)) {
+		/* see get_chroma_addr for the chroma plane layout */
+		ratio = Y_TO_CRCB_RATIO(img->format);
+		first = rect->y / ratio;
+		last = DIV_ROUND_UP(rect->y + rect->h + 1, ratio);
+		pmem_cache_batch_add(batch, img->memory_id,
+				     img->offset + img->height * stride +
+				     first * stride, (last - first) * stride,
+				     op);
+	}
+}
+#endif
 
-	/* flush dst images */
-	get_len(&req->dst, &req->dst_rect, regs->dst_bpp, &dst0_len,
-		&dst1_len);
-	flush_pmem_fd(req->dst.memory_id, req->dst.offset, dst0_len);
-	if (IS_PSEUDOPLNR(req->dst.format))
-		flush_pmem_fd(req->dst.memory_id, req->dst.offset + dst0_len,
-			      dst1_len);
+/* queue the cache maintenance a blit needs on 'batch', the caller commits
+ * it before the blit is sent */
+void mdp_blit_flush(struct mdp_blit_req *req, struct pmem_cache_batch *batch)
+{
+#ifdef CONFIG_ANDROID_PMEM
+	/* blit() rejects these, there's nothing to flush for them */
+	if (unlikely(req->src.format >= MDP_IMGTYPE_LIMIT ||
+		     req->dst.format >= MDP_IMGTYPE_LIMIT))
+		return;
+
+	/* the mdp only reads src images, clean them to memory before dma */
+	flush_img(&req->src, &req->src_rect, batch, PMEM_CACHE_CLEAN);
+	/* dst images are read for blending and then written, flush them */
+	flush_img(&req->dst, &req->dst_rect, batch, PMEM_CACHE_FLUSH);
 #endif
 }
 
@@ -673,7 +692,6 @@ static int send_blit(struct mdp_blit_req *req, struct mdp_regs *regs)
 		writel(src_img_cfg[req->dst.format], PPP_ADDR_BG_CFG);
 		writel(pack_pattern[req->dst.format], PPP_ADDR_BG_PACK_PATTERN);
 	}
-	flush_imgs(req, regs);
 	writel(0x1000, MDP_DISPLAY0_START);
 	return 0;
 }
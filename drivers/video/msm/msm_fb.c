@@ -25,6 +25,7 @@
 #include <linux/android_power.h>
 #endif
 #include <linux/msm_mdp.h>
+#include <linux/android_pmem.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/arch/msm_fb.h>
@@ -492,15 +493,29 @@ static int msmfb_blit(struct fb_info *info, void __user *p)
 {
 	struct mdp_blit_req req;
 	struct mdp_blit_req_list req_list;
+	struct mdp_blit_req_list *list = (struct mdp_blit_req_list *)p;
+#ifdef CONFIG_ANDROID_PMEM
+	struct pmem_cache_batch batch;
+#endif
 	int i;
 	int ret;
 
 	if (copy_from_user(&req_list, p, sizeof(req_list)))
 		return -EFAULT;
 
+#ifdef CONFIG_ANDROID_PMEM
+	/* do the cache maintenance for the whole list before the first blit,
+	 * so requests sharing buffers share the flushes */
+	pmem_cache_batch_init(&batch);
+	for (i = 0; i < req_list.count; i++) {
+		if (copy_from_user(&req, &list->req[i], sizeof(req)))
+			return -EFAULT;
+		mdp_blit_flush(&req, &batch);
+	}
+	pmem_cache_batch_commit(&batch);
+#endif
+
 	for (i = 0; i < req_list.count; i++) {
-		struct mdp_blit_req_list *list =
-			(struct mdp_blit_req_list *)p;
 		if (copy_from_user(&req, &list->req[i], sizeof(req)))
 			return -EFAULT;
 		ret = mdp_blit(info, &req);
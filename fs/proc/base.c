@@ -964,7 +964,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 		put_task_struct(task);
 		return -EACCES;
 	}
-	task->oomkilladj = oom_adjust;
+	set_oom_adj(task, oom_adjust);
 	put_task_struct(task);
 	if (end - buffer == 0)
 		return -EIO;
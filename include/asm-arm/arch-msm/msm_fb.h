@@ -62,6 +62,8 @@ void mdp_set_grp_disp(unsigned disp_id);
 
 struct fb_info;
 struct mdp_blit_req;
+struct pmem_cache_batch;
 int mdp_blit(struct fb_info *info, struct mdp_blit_req *req);
+void mdp_blit_flush(struct mdp_blit_req *req, struct pmem_cache_batch *batch);
 
 #endif
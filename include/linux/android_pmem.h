@@ -47,6 +47,45 @@ int get_pmem_user_addr(struct file *file, unsigned long *start, unsigned long *e
 void put_pmem_file(struct file* file);
 void put_pmem_fd(unsigned int fd);
 void flush_pmem_fd(unsigned int fd, unsigned long start, unsigned long len);
+#ifdef CONFIG_ANDROID_PMEM
+int is_pmem_file(struct file *file);
+#else
+static inline int is_pmem_file(struct file *file)
+{
+	return 0;
+}
+#endif
+
+/* cache operations for cache_maint_pmem_fd and pmem_cache_batch_add */
+#define PMEM_CACHE_CLEAN	0x1	/* write back, the device will read */
+#define PMEM_CACHE_INVALIDATE	0x2	/* discard, the device has written */
+#define PMEM_CACHE_FLUSH	(PMEM_CACHE_CLEAN | PMEM_CACHE_INVALIDATE)
+
+void cache_maint_pmem_fd(unsigned int fd, unsigned long offset,
+			 unsigned long len, unsigned int op);
+
+/* collects cache operations, merging adjacent and overlapping ranges of
+ * the same fd and op, until pmem_cache_batch_commit runs them */
+#define PMEM_CACHE_BATCH_MAX 16
+
+struct pmem_cache_range {
+	unsigned int fd;
+	unsigned int op;
+	unsigned long offset;
+	unsigned long len;
+	int requests;		/* requests merged into this range */
+};
+
+struct pmem_cache_batch {
+	int count;
+	struct pmem_cache_range range[PMEM_CACHE_BATCH_MAX];
+};
+
+void pmem_cache_batch_init(struct pmem_cache_batch *batch);
+void pmem_cache_batch_add(struct pmem_cache_batch *batch, unsigned int fd,
+			  unsigned long offset, unsigned long len,
+			  unsigned int op);
+void pmem_cache_batch_commit(struct pmem_cache_batch *batch);
 
 struct android_pmem_platform_data;
 
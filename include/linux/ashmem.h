@@ -44,5 +44,7 @@ struct ashmem_pin {
 #define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+#define ASHMEM_SET_PURGE_EVENTFD	_IOW(__ASHMEMIOC, 11, int)
+#define ASHMEM_GET_PURGED	_IOR(__ASHMEMIOC, 12, struct ashmem_pin)
 
 #endif	/* _LINUX_ASHMEM_H */
@@ -32,6 +32,7 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
@@ -61,6 +62,27 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A BINDER_TYPE_PTR object describes a buffer in the sender's address
+ * space that is not part of the flattened data. The driver gathers it
+ * into the target buffer, after the offsets, and points 'buffer' at the
+ * copy. Large buffers in a readable pmem mapping are passed by reference
+ * instead: the driver sets BINDER_BUFFER_FLAG_REF, 'handle' is a new fd
+ * for the pmem file in the target and 'buffer' holds the offset of the
+ * data in that file.
+ */
+enum {
+	BINDER_BUFFER_FLAG_REF = 0x01,
+};
+
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;
+	void			*buffer;
+	size_t			length;
+	signed long		handle;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -91,6 +113,7 @@ struct binder_version {
 #define	BINDER_SET_CONTEXT_MGR		_IOW('b', 7, int)
 #define	BINDER_THREAD_EXIT		_IOW('b', 8, int)
 #define BINDER_VERSION			_IOWR('b', 9, struct binder_version)
+#define BINDER_SET_ASYNC_THROTTLE	_IOW('b', 10, int)
 
 /*
  * NOTE: Two special error codes you should check for when calling
@@ -147,6 +170,15 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * BC_TRANSACTION_SG and BC_REPLY_SG reserve buffers_size bytes in the
+ * target buffer for the BINDER_TYPE_PTR objects of the transaction.
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data	transaction_data;
+	size_t				buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -249,6 +281,16 @@ enum BinderDriverReturnProtocol {
 	 * The the last transaction (either a bcTRANSACTION or
 	 * a bcATTEMPT_ACQUIRE) failed (e.g. out of memory).  No parameters.
 	 */
+
+	BR_TRANSACTION_COMPLETE_ALMOST_FULL = _IO('r', 18),
+	/*
+	 * No parameters.  Sent instead of BR_TRANSACTION_COMPLETE, to
+	 * processes that enabled it with BINDER_SET_ASYNC_THROTTLE, for a
+	 * one-way transaction that went through but left the async space
+	 * of the target, or the sender's quota of it, almost full.  The
+	 * sender should slow down before one-way transactions start to
+	 * fail with BR_FAILED_REPLY.
+	 */
 };
 
 enum BinderDriverCommandProtocol {
@@ -324,6 +366,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with room for the
+	 * buffers of its BINDER_TYPE_PTR objects.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
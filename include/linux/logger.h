@@ -30,6 +30,51 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_header - the first page of a log mapped by a reader
+ *
+ * The log's buffer follows in the next page. Positions are free running
+ * counts of bytes ever written, the byte at position 'pos' is at offset
+ * 'pos & (size - 1)' in the buffer. To read, starting from 'pos':
+ *
+ * 	1) read 'w_off', then issue a read barrier
+ * 	2) parse the entries from 'pos' up to 'w_off', an entry may wrap
+ * 	   around the end of the buffer
+ * 	3) issue a read barrier, then read 'head'. Everything parsed from
+ * 	   before 'head' may have been overwritten while it was read: drop it
+ * 	   and start again from 'head'
+ *
+ * When 'pos' reaches 'w_off', poll() the file to wait for more. 'seq' counts
+ * the entries published, a reader can use it to tell how many it missed.
+ */
+struct logger_mmap_header {
+	__u32		size;	/* size of the buffer */
+	__u32		head;	/* position of the oldest entry in the log */
+	__u32		w_off;	/* position after the newest entry */
+	__u32		seq;	/* number of entries written */
+};
+
+#define LOGGER_FILTER_MAX_TAGS	8
+#define LOGGER_FILTER_MAX_PIDS	8
+#define LOGGER_FILTER_TAG_LEN	32
+
+/*
+ * struct logger_filter - which entries a reader wants, see LOGGER_SET_FILTER
+ *
+ * An entry is read if its priority, the first byte of its payload, is at
+ * least 'min_prio', if its tag is one of 'tags' and if its pid is one of
+ * 'pids'. Zero 'min_prio', 'nr_tags' or 'nr_pids' means any. Priorities and
+ * tags only make sense for the text logs, not for the events log.
+ */
+struct logger_filter {
+	__u8		min_prio;	/* lowest priority read */
+	__u8		nr_tags;	/* number of tags in 'tags' */
+	__u8		nr_pids;	/* number of pids in 'pids' */
+	__u8		__pad;
+	__s32		pids[LOGGER_FILTER_MAX_PIDS];
+	char		tags[LOGGER_FILTER_MAX_TAGS][LOGGER_FILTER_TAG_LEN];
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_MAIN		"log_main"	/* everything else */
@@ -44,5 +89,8 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH		_IO(__LOGGERIO, 5) /* read many entries */
+#define LOGGER_SET_HISTORY		_IO(__LOGGERIO, 6) /* read history */
+#define LOGGER_SET_FILTER		_IOW(__LOGGERIO, 7, struct logger_filter)
 
 #endif /* _LINUX_LOGGER_H */
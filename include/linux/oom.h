@@ -13,6 +13,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -30,5 +31,37 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask, int order);
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Processes by oomkilladj, for killers that want the processes at a given
+ * oomkilladj without walking the task list.
+ */
+#define OOM_ADJ_BUCKETS (OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+#ifdef CONFIG_OOM_ADJ_BUCKETS
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+extern struct hlist_head oom_adj_buckets[OOM_ADJ_BUCKETS];
+extern spinlock_t oom_adj_lock;
+
+#define oom_adj_bucket(adj) (&oom_adj_buckets[(adj) - OOM_DISABLE])
+#define oom_adj_init(p) INIT_HLIST_NODE(&(p)->oom_adj_node)
+
+extern void oom_adj_add(struct task_struct *p);
+extern void oom_adj_del(struct task_struct *p);
+extern void set_oom_adj(struct task_struct *p, int oom_adj);
+#else
+#define oom_adj_init(p) do { } while (0)
+#define set_oom_adj(p, adj) ((p)->oomkilladj = (adj))
+
+static inline void oom_adj_add(struct task_struct *p)
+{
+}
+
+static inline void oom_adj_del(struct task_struct *p)
+{
+}
+#endif
+
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
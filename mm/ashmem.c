@@ -26,50 +26,174 @@
 #include <linux/uaccess.h>
 #include <linux/personality.h>
 #include <linux/bitops.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/memcontrol.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/oom.h>
+#include <linux/pagemap.h>
+#include <linux/pid.h>
+#include <linux/proc_fs.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/rmap.h>
 #include <linux/shmem_fs.h>
+#include <linux/swap.h>
+#include <linux/vmstat.h>
 #include <linux/ashmem.h>
 
 /*
  * ashmem_area - android shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
- * Big Note: Mappings do NOT pin this structure; it dies on close()
+ * Locking: Protected by its own `mutex'
+ * Big Note: Mappings do NOT pin this structure; it dies on close(). Large
+ *	     mappings only hold `refs', which keeps its memory around so
+ *	     their faults can still look at the (by then empty) unpinned tree.
  */
 struct ashmem_area {
+	struct mutex mutex;		/* protects this area and its ranges */
 	char name[ASHMEM_NAME_LEN];	/* optional name for /proc/pid/maps */
-	struct list_head unpinned_list;	/* list of all ashmem areas */
+	struct rb_root unpinned;	/* unpinned ranges, by pgstart */
+	struct pid *owner;		/* process that opened us */
+	struct list_head purged_list;	/* purged ranges not yet reported */
+	wait_queue_head_t purge_wait;	/* pollers waiting for a purge */
+	struct file *purge_eventfd;	/* optional eventfd signalled on purge */
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	atomic_t refs;			/* our file, plus one per large vma */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex'; `lru' by `ashmem_lru_lock'
+ *
+ * The unpinned ranges of an area never overlap, so ordered by pgstart
+ * they are also ordered by pgend and a plain rbtree finds the ranges
+ * touching any interval in logarithmic time.
  */
 struct ashmem_range {
-	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct list_head lru;		/* entry in LRU list, or purged_list */
+	struct rb_node node;		/* entry in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
+	unsigned long lru_time;		/* jiffies when put on the LRU */
+};
+
+/*
+ * Purge policy, tunable under /sys/module/ashmem/parameters
+ *
+ * With purge_policy 0 the shrinker purges strictly least-recently-unpinned
+ * first. With purge_policy 1 it looks at the oldest purge_scan ranges and
+ * purges the one with the highest score, where
+ *
+ *   score = purge_oom_weight * owner's oom_adj
+ *         + purge_age_weight * seconds on the LRU
+ *         - purge_size_weight * log2(range size / nr_to_scan)
+ *
+ * so background apps' caches go first and a huge range is not thrown away
+ * to satisfy a small scan. The size term is zero for ranges that fit.
+ */
+enum {
+	ASHMEM_PURGE_LRU,
+	ASHMEM_PURGE_WEIGHTED,
+};
+static int ashmem_purge_policy = ASHMEM_PURGE_WEIGHTED;
+module_param_named(purge_policy, ashmem_purge_policy, int, S_IWUSR | S_IRUGO);
+static int ashmem_purge_scan = 32;
+module_param_named(purge_scan, ashmem_purge_scan, int, S_IWUSR | S_IRUGO);
+static int ashmem_purge_oom_weight = 64;
+module_param_named(purge_oom_weight, ashmem_purge_oom_weight, int,
+		   S_IWUSR | S_IRUGO);
+static int ashmem_purge_age_weight = 1;
+module_param_named(purge_age_weight, ashmem_purge_age_weight, int,
+		   S_IWUSR | S_IRUGO);
+static int ashmem_purge_size_weight = 32;
+module_param_named(purge_size_weight, ashmem_purge_size_weight, int,
+		   S_IWUSR | S_IRUGO);
+
+/*
+ * Purge statistics, shown in /proc/ashmem_purge. The totals are protected by
+ * ashmem_lru_lock; the log of recently purged ranges is lockless like the
+ * binder transaction log, entries being filled under the area's mutex.
+ */
+static struct ashmem_purge_stats {
+	unsigned long ranges;		/* ranges purged */
+	unsigned long pages;		/* pages purged */
+	unsigned long busy;		/* ranges skipped, area mutex busy */
+} ashmem_purge_stats;
+
+struct ashmem_purge_log_entry {
+	char name[32];
+	pid_t owner;
+	int oom_adj;
+	size_t pgstart;
+	size_t pages;
+	unsigned int age_ms;
+	long score;
+};
+
+static struct ashmem_purge_log {
+	atomic_t cur;
+	int full;
+	struct ashmem_purge_log_entry entry[32];
+} ashmem_purge_log = {
+	.cur = ATOMIC_INIT(~0U),
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and count, nothing else
+ *
+ * Each ashmem_area is protected by its own mutex, so purging one area never
+ * stalls pin/unpin on any other. The shrinker walks the LRU under this lock
+ * and only trylocks an area's mutex, as the lock ordering is:
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *                asma->mutex -> i_mutex -> i_alloc_sem
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/*
+ * Large-chunk faulting, tunable under /sys/module/ashmem/parameters
+ *
+ * Shared mappings of regions of at least large_threshold bytes fault in the
+ * pinned pages of a whole naturally aligned large_chunk (64K by default, up
+ * to 1M) at a time instead of a page at a time, as long as free memory
+ * allows; otherwise they fall back to ordinary single-page faults. A
+ * large_threshold of zero turns this off. The counters are shown in
+ * /proc/ashmem_large.
+ */
+#define ASHMEM_LARGE_CHUNK_MAX	(1024 * 1024)
+
+static unsigned long ashmem_large_threshold = 1024 * 1024;
+module_param_named(large_threshold, ashmem_large_threshold, ulong,
+		   S_IWUSR | S_IRUGO);
+static unsigned long ashmem_large_chunk = 64 * 1024;
+module_param_named(large_chunk, ashmem_large_chunk, ulong, S_IWUSR | S_IRUGO);
+
+static struct ashmem_large_stats {
+	atomic_long_t chunks;		/* faults that mapped their chunk */
+	atomic_long_t fallbacks;	/* faults that fell back to one page */
+	atomic_long_t pages;		/* pages mapped ahead of their fault */
+} ashmem_large_stats;
+
+/* shmem's vm_ops with ->fault replaced, set up on the first large mmap */
+static struct vm_operations_struct ashmem_large_vm_ops;
+static int (*ashmem_shmem_fault)(struct vm_area_struct *vma,
+				 struct vm_fault *vmf);
+static DEFINE_MUTEX(ashmem_large_mutex);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -100,31 +224,74 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	range->lru_time = jiffies;
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+static inline void lru_del_locked(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	lru_del_locked(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
+/*
+ * range_first - returns the lowest unpinned range of 'asma' that ends at or
+ * after page 'page', or NULL. Later ranges follow with range_next().
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_first(struct ashmem_area *asma, size_t page)
+{
+	struct rb_node *n = asma->unpinned.rb_node;
+	struct ashmem_range *range, *first = NULL;
+
+	while (n) {
+		range = rb_entry(n, struct ashmem_range, node);
+		if (range_before_page(range, page)) {
+			n = n->rb_right;
+		} else {
+			first = range;
+			n = n->rb_left;
+		}
+	}
+
+	return first;
+}
+
+static inline struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *n = rb_next(&range->node);
+
+	return n ? rb_entry(n, struct ashmem_range, node) : NULL;
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * The new range must not overlap any unpinned range of 'asma'.
+ *
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
+	struct rb_node **p = &asma->unpinned.rb_node;
+	struct rb_node *parent = NULL;
 	struct ashmem_range *range;
 
 	range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
@@ -136,26 +303,38 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgend = end;
 	range->purged = purged;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+	while (*p) {
+		parent = *p;
+		if (start < rb_entry(parent, struct ashmem_range, node)->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&range->node, parent, p);
+	rb_insert_color(&range->node, &asma->unpinned);
 
 	if (range_on_lru(range))
 		lru_add(range);
+	else
+		INIT_LIST_HEAD(&range->lru);
 
 	return 0;
 }
 
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
+	rb_erase(&range->node, &range->asma->unpinned);
 	if (range_on_lru(range))
 		lru_del(range);
+	else
+		list_del(&range->lru);
 	kmem_cache_free(ashmem_range_cachep, range);
 }
 
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold range->asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -165,8 +344,17 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
+}
+
+static void asma_put(struct ashmem_area *asma)
+{
+	if (atomic_dec_and_test(&asma->refs))
+		kmem_cache_free(ashmem_area_cachep, asma);
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -182,8 +370,13 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
+	asma->unpinned = RB_ROOT;
+	asma->owner = get_task_pid(current->group_leader, PIDTYPE_PID);
+	INIT_LIST_HEAD(&asma->purged_list);
+	init_waitqueue_head(&asma->purge_wait);
 	asma->prot_mask = PROT_MASK;
+	atomic_set(&asma->refs, 1);
 	file->private_data = asma;
 
 	return 0;
@@ -192,26 +385,205 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *n;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+	while ((n = rb_first(&asma->unpinned)))
+		range_del(rb_entry(n, struct ashmem_range, node));
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
-	kmem_cache_free(ashmem_area_cachep, asma);
+	if (asma->purge_eventfd)
+		fput(asma->purge_eventfd);
+	put_pid(asma->owner);
+	asma_put(asma);
+
+	return 0;
+}
+
+/*
+ * ashmem_large_map - fault in the shmem page at 'pgoff' and map it, the way
+ * __do_fault maps the page of a read fault
+ *
+ * Returns zero if the page is mapped, was already, or is left for its own
+ * fault, or the VM_FAULT_ERROR bits of shmem's fault otherwise. The caller
+ * holds mmap_sem for read and asma->mutex.
+ */
+static int ashmem_large_map(struct vm_area_struct *vma, pgoff_t pgoff)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long addr;
+	struct vm_fault vmf;
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t *pte, entry;
+	int ret;
+
+	addr = vma->vm_start + ((pgoff - vma->vm_pgoff) << PAGE_SHIFT);
+	vmf.flags = 0;
+	vmf.pgoff = pgoff;
+	vmf.virtual_address = (void __user *) addr;
+	vmf.page = NULL;
+
+	ret = ashmem_shmem_fault(vma, &vmf);
+	if (unlikely(ret & VM_FAULT_ERROR))
+		return ret & VM_FAULT_ERROR;
+
+	page = vmf.page;
+	if (!(ret & VM_FAULT_LOCKED))
+		lock_page(page);
+
+	/* truncated since shmem found it */
+	if (unlikely(page->mapping != vma->vm_file->f_mapping))
+		goto out;
+
+	if (mem_cgroup_charge(page, mm, GFP_KERNEL))
+		goto out;
+	pte = get_locked_pte(mm, addr, &ptl);
+	if (unlikely(!pte))
+		goto out_uncharge;
+	/* someone faulted it in meanwhile, which is fine */
+	if (!pte_none(*pte)) {
+		pte_unmap_unlock(pte, ptl);
+		goto out_uncharge;
+	}
+
+	/* the pte takes over the reference shmem's fault gave us */
+	flush_icache_page(vma, page);
+	entry = mk_pte(page, vma->vm_page_prot);
+	set_pte_at(mm, addr, pte, entry);
+	inc_mm_counter(mm, file_rss);
+	page_add_file_rmap(page);
+	update_mmu_cache(vma, addr, entry);
+	pte_unmap_unlock(pte, ptl);
+	unlock_page(page);
+	atomic_long_inc(&ashmem_large_stats.pages);
+
+	return 0;
 
+out_uncharge:
+	mem_cgroup_uncharge_page(page);
+out:
+	unlock_page(page);
+	page_cache_release(page);
 	return 0;
 }
 
+/*
+ * ashmem_large_fault - ->fault for large regions: map the pinned pages of
+ * the faulting address's chunk, then let shmem handle the faulting page
+ */
+static int ashmem_large_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct ashmem_area *asma = vma->vm_private_data;
+	unsigned long nr = ashmem_large_chunk >> PAGE_SHIFT;
+	struct ashmem_range *range;
+	pgoff_t pgoff, first, last;
+
+	if (nr <= 1 || !is_power_of_2(nr) || nr > (ASHMEM_LARGE_CHUNK_MAX >> PAGE_SHIFT))
+		goto out;
+
+	/* after remap_file_pages, pgoff no longer tells where a page goes */
+	if ((vma->vm_flags & VM_NONLINEAR) || (vmf->flags & FAULT_FLAG_NONLINEAR))
+		goto out;
+
+	/* leave some room above the reserves; this is only an optimization */
+	if (global_page_state(NR_FREE_PAGES) < totalreserve_pages + 2 * nr) {
+		atomic_long_inc(&ashmem_large_stats.fallbacks);
+		goto out;
+	}
+
+	/*
+	 * Holding the mutex keeps the unpinned tree still and the shrinker
+	 * from purging this area under us. It is only tried: get_name and
+	 * set_name copy user memory under it, which may be this very
+	 * mapping.
+	 */
+	if (!mutex_trylock(&asma->mutex)) {
+		atomic_long_inc(&ashmem_large_stats.fallbacks);
+		goto out;
+	}
+
+	first = max_t(pgoff_t, vmf->pgoff & ~(nr - 1), vma->vm_pgoff);
+	last = min_t(pgoff_t, (vmf->pgoff | (nr - 1)) + 1,
+		     vma->vm_pgoff + vma_pages(vma));
+
+	/*
+	 * Unpinned pages are skipped: they are the ones the shrinker may
+	 * purge, or already has, and faulting them in would only bring back
+	 * the memory it freed.
+	 */
+	range = range_first(asma, first);
+	for (pgoff = first; pgoff < last; pgoff++) {
+		if (range && page_in_range(range, pgoff)) {
+			pgoff = range->pgend;
+			range = range_next(range);
+			continue;
+		}
+		if (pgoff == vmf->pgoff)
+			continue;
+		if (ashmem_large_map(vma, pgoff)) {
+			mutex_unlock(&asma->mutex);
+			atomic_long_inc(&ashmem_large_stats.fallbacks);
+			goto out;
+		}
+	}
+	mutex_unlock(&asma->mutex);
+	atomic_long_inc(&ashmem_large_stats.chunks);
+
+out:
+	return ashmem_shmem_fault(vma, vmf);
+}
+
+/* a large vma keeps its area, see struct ashmem_area */
+static void ashmem_large_open(struct vm_area_struct *vma)
+{
+	struct ashmem_area *asma = vma->vm_private_data;
+
+	atomic_inc(&asma->refs);
+}
+
+static void ashmem_large_close(struct vm_area_struct *vma)
+{
+	asma_put(vma->vm_private_data);
+}
+
+/*
+ * ashmem_large_setup - switch a fresh shmem mapping of 'asma' over to
+ * ashmem_large_fault if the region is big enough
+ */
+static void ashmem_large_setup(struct ashmem_area *asma,
+			       struct vm_area_struct *vma)
+{
+	if (!ashmem_large_threshold || asma->size < ashmem_large_threshold)
+		return;
+	if (!(vma->vm_flags & VM_SHARED) || !vma->vm_ops->fault)
+		return;
+
+	mutex_lock(&ashmem_large_mutex);
+	if (!ashmem_shmem_fault) {
+		ashmem_large_vm_ops = *vma->vm_ops;
+		ashmem_large_vm_ops.open = ashmem_large_open;
+		ashmem_large_vm_ops.close = ashmem_large_close;
+		ashmem_large_vm_ops.fault = ashmem_large_fault;
+		ashmem_shmem_fault = vma->vm_ops->fault;
+	}
+	mutex_unlock(&ashmem_large_mutex);
+
+	if (vma->vm_ops->fault == ashmem_shmem_fault) {
+		vma->vm_ops = &ashmem_large_vm_ops;
+		vma->vm_private_data = asma;
+		atomic_inc(&asma->refs);
+	}
+}
+
 static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -244,12 +616,90 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 
 	shmem_set_file(vma, asma->file);
 	vma->vm_flags |= VM_CAN_NONLINEAR;
+	ashmem_large_setup(asma, vma);
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+static int asma_oom_adj(struct ashmem_area *asma)
+{
+	struct task_struct *task;
+	int oom_adj = OOM_ADJUST_MAX;	/* owner is gone: purge first */
+
+	rcu_read_lock();
+	task = pid_task(asma->owner, PIDTYPE_PID);
+	if (task)
+		oom_adj = task->oomkilladj;
+	rcu_read_unlock();
+
+	return oom_adj;
+}
+
+/*
+ * range_purge_score - how eager we are to purge 'range', higher goes first
+ *
+ * Caller must hold ashmem_lru_lock and range->asma->mutex.
+ */
+static long range_purge_score(struct ashmem_range *range, unsigned long now,
+			      int nr_to_scan)
+{
+	size_t size = range_size(range);
+	long score;
+
+	score = (long) ashmem_purge_oom_weight * asma_oom_adj(range->asma);
+	score += (long) ashmem_purge_age_weight *
+		 (long) ((now - range->lru_time) / HZ);
+	if (size > nr_to_scan)
+		score -= (long) ashmem_purge_size_weight *
+			 (fls(size / nr_to_scan) - 1);
+
+	return score;
+}
+
+/*
+ * ashmem_purge_log_add - record a purged range in the purge log
+ *
+ * Caller must hold range->asma->mutex.
+ */
+static void ashmem_purge_log_add(struct ashmem_range *range,
+				 unsigned long now, long score)
+{
+	struct ashmem_area *asma = range->asma;
+	struct ashmem_purge_log_entry *e;
+	unsigned int cur = atomic_inc_return(&ashmem_purge_log.cur);
+
+	if (cur >= ARRAY_SIZE(ashmem_purge_log.entry))
+		ashmem_purge_log.full = 1;
+	e = &ashmem_purge_log.entry[cur % ARRAY_SIZE(ashmem_purge_log.entry)];
+
+	strlcpy(e->name, asma->name[0] ? asma->name : ASHMEM_NAME_DEF,
+		sizeof(e->name));
+	e->owner = pid_nr(asma->owner);
+	e->oom_adj = asma_oom_adj(asma);
+	e->pgstart = range->pgstart;
+	e->pages = range_size(range);
+	e->age_ms = jiffies_to_msecs(now - range->lru_time);
+	e->score = score;
+}
+
+/*
+ * ashmem_purge_notify - queue a just-purged range for ASHMEM_GET_PURGED and
+ * wake up anyone polling the area or waiting on its eventfd
+ *
+ * Caller must hold range->asma->mutex.
+ */
+static void ashmem_purge_notify(struct ashmem_range *range)
+{
+	struct ashmem_area *asma = range->asma;
+
+	list_add_tail(&range->lru, &asma->purged_list);
+	wake_up_interruptible(&asma->purge_wait);
+	if (asma->purge_eventfd)
+		eventfd_signal(asma->purge_eventfd, 1);
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -264,32 +714,77 @@ out:
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
  * pages freed.
+ *
+ * With the weighted purge policy the order is refined by range_purge_score()
+ * over a window of the oldest ranges; see the tunables above.
+ *
+ * Only the area being purged is locked, and only for the truncate itself.
+ * Areas whose mutex is busy are skipped rather than waited on: their owner
+ * is in the middle of a pin/unpin, or is itself allocating and got us here.
  */
 static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
-
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
 		return -1;
 	if (!nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
-
-		vmtruncate_range(inode, start, end);
+	while (nr_to_scan > 0) {
+		struct ashmem_range *range, *best = NULL;
+		struct ashmem_area *asma;
+		struct inode *inode;
+		loff_t start, end;
+		unsigned long now = jiffies;
+		long score, best_score = 0;
+		int scan = 1;
+
+		if (ashmem_purge_policy == ASHMEM_PURGE_WEIGHTED)
+			scan = max(ashmem_purge_scan, 1);
+
+		spin_lock(&ashmem_lru_lock);
+		list_for_each_entry(range, &ashmem_lru_list, lru) {
+			if (!best || range->asma != best->asma) {
+				if (!mutex_trylock(&range->asma->mutex)) {
+					ashmem_purge_stats.busy++;
+					continue;
+				}
+			}
+			score = range_purge_score(range, now, nr_to_scan);
+			if (!best || score > best_score) {
+				if (best && best->asma != range->asma)
+					mutex_unlock(&best->asma->mutex);
+				best = range;
+				best_score = score;
+			} else if (best->asma != range->asma) {
+				mutex_unlock(&range->asma->mutex);
+			}
+			if (--scan <= 0)
+				break;
+		}
+		if (!best) {
+			spin_unlock(&ashmem_lru_lock);
+			break;
+		}
+		/* asma->mutex now keeps the range, area and file alive */
+		range = best;
+		asma = range->asma;
 		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
-
+		lru_del_locked(range);
+		ashmem_purge_stats.ranges++;
+		ashmem_purge_stats.pages += range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+
+		inode = asma->file->f_dentry->d_inode;
+		start = range->pgstart * PAGE_SIZE;
+		end = (range->pgend + 1) * PAGE_SIZE - 1;
+		vmtruncate_range(inode, start, end);
 		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
+
+		ashmem_purge_log_add(range, now, best_score);
+		ashmem_purge_notify(range);
+		mutex_unlock(&asma->mutex);
 	}
-	mutex_unlock(&ashmem_mutex);
 
 	return lru_count;
 }
@@ -303,7 +798,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -318,7 +813,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -326,7 +821,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -339,7 +834,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -348,7 +843,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[0] != '\0') {
 		size_t len;
 
@@ -364,7 +859,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -373,16 +868,18 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
+	for (range = range_first(asma, pgstart); range; range = next) {
+		next = range_next(range);
+
 		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
+		if (range->pgstart > pgend)
 			break;
 
 		/*
@@ -426,8 +923,8 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * more complicated, we allocate a new range for the
 			 * second half and adjust the first chunk's endpoint.
 			 */
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+			range_alloc(asma, range->purged, pgend + 1,
+				    range->pgend);
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
 		}
@@ -439,17 +936,24 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
+	int notify = 0;
+	int ret;
+
+	/*
+	 * Ranges are disjoint, so merging with one never pulls in a range
+	 * below it; only the ranges at or after the first overlap matter.
+	 */
+	for (range = range_first(asma, pgstart); range; range = next) {
+		next = range_next(range);
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
+		/* short circuit: everything from here on lies above us */
+		if (range->pgstart > pgend)
 			break;
 
 		/*
@@ -462,38 +966,106 @@ restart:
 			pgstart = min_t(size_t, range->pgstart, pgstart),
 			pgend = max_t(size_t, range->pgend, pgend);
 			purged |= range->purged;
+			if (!range_on_lru(range) && !list_empty(&range->lru))
+				notify = 1;
 			range_del(range);
-			goto restart;
 		}
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	ret = range_alloc(asma, purged, pgstart, pgend);
+
+	/* keep reporting a purge the user has not collected yet */
+	if (!ret && notify)
+		list_add_tail(&range_first(asma, pgstart)->lru,
+			      &asma->purged_list);
+
+	return ret;
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
+{
+	struct ashmem_range *range = range_first(asma, pgstart);
+
+	if (range && page_range_in_range(range, pgstart, pgend))
+		return ASHMEM_IS_UNPINNED;
+
+	return ASHMEM_IS_PINNED;
+}
+
+/*
+ * set_purge_eventfd - signal the eventfd 'fd' whenever a range of 'asma' is
+ * purged; a negative 'fd' stops signalling.
+ */
+static int set_purge_eventfd(struct ashmem_area *asma, int fd)
+{
+	struct file *efile = NULL, *old;
+
+	if (fd >= 0) {
+		efile = eventfd_fget(fd);
+		if (IS_ERR(efile))
+			return PTR_ERR(efile);
+	}
+
+	mutex_lock(&asma->mutex);
+	old = asma->purge_eventfd;
+	asma->purge_eventfd = efile;
+	mutex_unlock(&asma->mutex);
+
+	if (old)
+		fput(old);
+
+	return 0;
+}
+
+/*
+ * get_purged - report, and forget, the oldest purged range that has not been
+ * reported yet. Returns 1 and fills in the range, or 0 if there is none.
+ */
+static int get_purged(struct ashmem_area *asma, void __user *p)
 {
 	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
+	struct ashmem_pin pin;
+	int ret = 0;
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
+	mutex_lock(&asma->mutex);
+	if (!list_empty(&asma->purged_list)) {
+		range = list_first_entry(&asma->purged_list,
+					 struct ashmem_range, lru);
+		pin.offset = range->pgstart * PAGE_SIZE;
+		pin.len = range_size(range) * PAGE_SIZE;
+		list_del_init(&range->lru);
+		ret = 1;
 	}
+	mutex_unlock(&asma->mutex);
+
+	if (ret && unlikely(copy_to_user(p, &pin, sizeof(pin))))
+		return -EFAULT;
 
 	return ret;
 }
 
+static unsigned int ashmem_poll(struct file *file, poll_table *wait)
+{
+	struct ashmem_area *asma = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &asma->purge_wait, wait);
+
+	mutex_lock(&asma->mutex);
+	if (!list_empty(&asma->purged_list))
+		mask |= POLLIN | POLLRDNORM;
+	mutex_unlock(&asma->mutex);
+
+	return mask;
+}
+
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 			    void __user *p)
 {
@@ -523,7 +1095,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -537,7 +1109,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -582,16 +1154,108 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ashmem_shrink(ret, GFP_KERNEL);
 		}
 		break;
+	case ASHMEM_SET_PURGE_EVENTFD:
+		ret = set_purge_eventfd(asma, (int) arg);
+		break;
+	case ASHMEM_GET_PURGED:
+		ret = get_purged(asma, (void __user *) arg);
+		break;
 	}
 
 	return ret;
 }
 
+static char *print_ashmem_purge_log_entry(char *buf, char *end,
+					  struct ashmem_purge_log_entry *e)
+{
+	buf += snprintf(buf, end - buf,
+			"%d: %s pages %zu-%zu (%zu) age %u ms oom_adj %d "
+			"score %ld\n", e->owner, e->name, e->pgstart,
+			e->pgstart + e->pages - 1, e->pages, e->age_ms,
+			e->oom_adj, e->score);
+	return buf;
+}
+
+static int ashmem_read_proc_purge(char *page, char **start, off_t off,
+				  int count, int *eof, void *data)
+{
+	struct ashmem_purge_stats stats;
+	unsigned long pages;
+	char *buf = page;
+	char *end = page + PAGE_SIZE;
+	unsigned int cur, next;
+	int len, i;
+
+	if (off)
+		return 0;
+
+	spin_lock(&ashmem_lru_lock);
+	stats = ashmem_purge_stats;
+	pages = lru_count;
+	spin_unlock(&ashmem_lru_lock);
+
+	buf += snprintf(buf, end - buf,
+			"policy %s\nunpinned pages %lu\n"
+			"purged ranges %lu\npurged pages %lu\nbusy skips %lu\n",
+			ashmem_purge_policy == ASHMEM_PURGE_WEIGHTED ?
+			"weighted" : "lru", pages, stats.ranges, stats.pages,
+			stats.busy);
+
+	cur = atomic_read(&ashmem_purge_log.cur);
+	next = (cur + 1) % ARRAY_SIZE(ashmem_purge_log.entry);
+	if (ashmem_purge_log.full) {
+		for (i = next; i < ARRAY_SIZE(ashmem_purge_log.entry); i++) {
+			if (buf >= end)
+				break;
+			buf = print_ashmem_purge_log_entry(buf, end,
+						&ashmem_purge_log.entry[i]);
+		}
+	}
+	for (i = 0; i < next; i++) {
+		if (buf >= end)
+			break;
+		buf = print_ashmem_purge_log_entry(buf, end,
+						   &ashmem_purge_log.entry[i]);
+	}
+
+	*start = page + off;
+
+	len = buf - page;
+	if (len > off)
+		len -= off;
+	else
+		len = 0;
+
+	return len < count ? len  : count;
+}
+
+static int ashmem_read_proc_large(char *page, char **start, off_t off,
+				  int count, int *eof, void *data)
+{
+	int len;
+
+	if (off)
+		return 0;
+
+	len = snprintf(page, PAGE_SIZE,
+		       "threshold %lu\nchunk %lu\n"
+		       "chunks %ld\nfallbacks %ld\npages %ld\n",
+		       ashmem_large_threshold, ashmem_large_chunk,
+		       atomic_long_read(&ashmem_large_stats.chunks),
+		       atomic_long_read(&ashmem_large_stats.fallbacks),
+		       atomic_long_read(&ashmem_large_stats.pages));
+
+	*start = page + off;
+
+	return len < count ? len  : count;
+}
+
 static struct file_operations ashmem_fops = {
 	.owner = THIS_MODULE,
 	.open = ashmem_open,
 	.release = ashmem_release,
 	.mmap = ashmem_mmap,
+	.poll = ashmem_poll,
 	.unlocked_ioctl = ashmem_ioctl,
 	.compat_ioctl = ashmem_ioctl,
 };
@@ -630,6 +1294,11 @@ static int __init ashmem_init(void)
 
 	register_shrinker(&ashmem_shrinker);
 
+	create_proc_read_entry("ashmem_purge", S_IRUGO, NULL,
+			       ashmem_read_proc_purge, NULL);
+	create_proc_read_entry("ashmem_large", S_IRUGO, NULL,
+			       ashmem_read_proc_large, NULL);
+
 	printk(KERN_INFO "ashmem: initialized\n");
 
 	return 0;
@@ -639,6 +1308,8 @@ static void __exit ashmem_exit(void)
 {
 	int ret;
 
+	remove_proc_entry("ashmem_large", NULL);
+	remove_proc_entry("ashmem_purge", NULL);
 	unregister_shrinker(&ashmem_shrinker);
 
 	ret = misc_deregister(&ashmem_misc);
@@ -441,6 +441,57 @@ out:
 }
 #endif
 
+#ifdef CONFIG_OOM_ADJ_BUCKETS
+/*
+ * Every process is in the bucket for its oomkilladj, protected by
+ * oom_adj_lock. Processes are added and removed along with the task list,
+ * under tasklist_lock, so a process in a bucket with tasklist_lock held is
+ * still alive. tasklist_lock is write-locked with interrupts off, so
+ * oom_adj_lock is always taken with interrupts off as well.
+ */
+struct hlist_head oom_adj_buckets[OOM_ADJ_BUCKETS];
+EXPORT_SYMBOL_GPL(oom_adj_buckets);
+DEFINE_SPINLOCK(oom_adj_lock);
+EXPORT_SYMBOL_GPL(oom_adj_lock);
+
+/*
+ * Called with tasklist_lock write-locked, when p becomes a thread group
+ * leader.
+ */
+void oom_adj_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&oom_adj_lock, flags);
+	hlist_add_head(&p->oom_adj_node, oom_adj_bucket(p->oomkilladj));
+	spin_unlock_irqrestore(&oom_adj_lock, flags);
+}
+
+/*
+ * Called with tasklist_lock write-locked, when p stops being a thread group
+ * leader.
+ */
+void oom_adj_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&oom_adj_lock, flags);
+	hlist_del_init(&p->oom_adj_node);
+	spin_unlock_irqrestore(&oom_adj_lock, flags);
+}
+
+void set_oom_adj(struct task_struct *p, int oom_adj)
+{
+	spin_lock_irq(&oom_adj_lock);
+	p->oomkilladj = oom_adj;
+	if (!hlist_unhashed(&p->oom_adj_node)) {
+		hlist_del(&p->oom_adj_node);
+		hlist_add_head(&p->oom_adj_node, oom_adj_bucket(oom_adj));
+	}
+	spin_unlock_irq(&oom_adj_lock);
+}
+#endif
+
 static BLOCKING_NOTIFIER_HEAD(oom_notify_list);
 
 int register_oom_notifier(struct notifier_block *nb)